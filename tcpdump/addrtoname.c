@@ -61,12 +61,39 @@ extern int ether_ntohost(char *, const struct ether_addr *);
 #include <string.h>
 #include <stdlib.h>
 
+/*
+ * Reverse lookups can be done by a pool of threads where the thread
+ * library comes with the C library
+ */
+#ifdef __APPLE__
+#define USE_ASYNC_RESOLVER
+#endif
+
+/*
+ * Names can be kept across runs in the file given with --name-cache
+ */
+#ifdef __APPLE__
+#define USE_NAME_CACHE
+#endif
+
+#ifdef USE_ASYNC_RESOLVER
+#include <pthread.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/time.h>
+#include <errno.h>
+#endif
+
 #include "interface.h"
 #include "addrtoname.h"
 #include "llc.h"
 #include "setsignal.h"
 #include "extract.h"
 #include "oui.h"
+#ifdef USE_NAME_CACHE
+#include <sys/stat.h>
+#include "namecache.h"
+#endif
 
 #ifndef ETHER_ADDR_LEN
 #define ETHER_ADDR_LEN	6
@@ -75,23 +102,99 @@ extern int ether_ntohost(char *, const struct ether_addr *);
 /*
  * hash tables for whatever-to-name translations
  *
- * XXX there has to be error checks against strdup(3) failure
+ * The tables use open addressing with linear probing over an array of
+ * (hash, entry) slots, which doubles when three quarters full. A lookup
+ * usually reads one cache line of slots and the entry it is after.
+ * Entries and names are carved out of arenas and are never freed, but
+ * for the host tables when their size is bounded with set_name_limit().
  */
 
-#define HASHNAMESIZE 4096
+struct nameslot {
+	u_int32_t hash;
+	void *entry;			/* NULL for an empty slot */
+};
+
+struct nametable {
+	struct nameslot *slots;
+	u_int mask;			/* number of slots - 1 */
+	u_int count;
+};
+
+#define NAMETABLE_MINSIZE	64
+
+struct arena_chunk {
+	struct arena_chunk *next;
+};
+
+struct arena {
+	struct arena_chunk *chunks;
+	char *cur;
+	size_t left;
+};
+
+#define ARENA_CHUNKSIZE		(64 * 1024)
 
 struct hnamemem {
 	u_int32_t addr;
 	const char *name;
-	struct hnamemem *nxt;
+	struct hnamemem *nxt;		/* for the chains of print-atalk.c */
+#ifdef USE_ASYNC_RESOLVER
+	time_t expires;			/* when to look the name up again */
+	int pending;			/* lookup in progress */
+#endif
+};
+
+/*
+ * The host tables can be bounded for long captures: the entries are
+ * split in two generations, a lookup moves an entry of the previous
+ * generation to the current one, and when the current generation is
+ * full the previous one is dropped with its arena. This keeps the
+ * names that are in use, and a name returned by getname() stays valid
+ * for at least half the limit of new addresses.
+ */
+struct hosttable {
+	struct nametable cur;
+	struct nametable old;
+	struct arena arena;
+	struct arena old_arena;
 };
 
-static struct hnamemem hnametable[HASHNAMESIZE];
-static struct hnamemem tporttable[HASHNAMESIZE];
-static struct hnamemem uporttable[HASHNAMESIZE];
-static struct hnamemem eprototable[HASHNAMESIZE];
-static struct hnamemem dnaddrtable[HASHNAMESIZE];
-static struct hnamemem ipxsaptable[HASHNAMESIZE];
+static u_int host_name_limit;		/* 0 for no limit */
+
+static struct hosttable hnametable;
+static struct nametable tporttable;
+static struct nametable uporttable;
+static struct nametable eprototable;
+static struct nametable dnaddrtable;
+static struct nametable ipxsaptable;
+
+static struct arena name_arena;		/* names that are never freed */
+
+/*
+ * The tables filled from the system databases are built on their first
+ * lookup, so that runs which print few names, or none, don't pay for
+ * reading the services and ethers files at startup
+ */
+#define NAMES_ETHER	0x01
+#define NAMES_SERV	0x02
+#define NAMES_EPROTO	0x04
+#define NAMES_PROTOID	0x08
+
+static u_int names_pending;		/* tables not built yet */
+
+#define NEED_NAMES(which, init) \
+	do { \
+		if (names_pending & (which)) { \
+			names_pending &= ~(which); \
+			init(); \
+		} \
+	} while (0)
+
+static void init_etherarray(void);
+static void init_servarray(void);
+static void init_eprotoarray(void);
+static void init_protoidarray(void);
+static const char *ipxsap_name(u_int);
 
 #if defined(INET6) && defined(WIN32)
 /*
@@ -137,34 +240,312 @@ win32_gethostbyaddr(const char *addr, int len, int type)
 struct h6namemem {
 	struct in6_addr addr;
 	char *name;
-	struct h6namemem *nxt;
+#ifdef USE_ASYNC_RESOLVER
+	time_t expires;			/* when to look the name up again */
+	int pending;			/* lookup in progress */
+#endif
 };
 
-static struct h6namemem h6nametable[HASHNAMESIZE];
+static struct hosttable h6nametable;
 #endif /* INET6 */
 
 struct enamemem {
-	u_short e_addr0;
-	u_short e_addr1;
-	u_short e_addr2;
+	u_char e_addr[ETHER_ADDR_LEN];	/* used only for enametable */
+	u_int e_len;			/* length of e_bs */
 	const char *e_name;
-	u_char *e_nsap;			/* used only for nsaptable[] */
+	u_char *e_nsap;			/* used only for nsaptable */
 #define e_bs e_nsap			/* for bytestringtable */
-	struct enamemem *e_nxt;
 };
 
-static struct enamemem enametable[HASHNAMESIZE];
-static struct enamemem nsaptable[HASHNAMESIZE];
-static struct enamemem bytestringtable[HASHNAMESIZE];
+static struct nametable enametable;
+static struct nametable nsaptable;
+static struct nametable bytestringtable;
 
 struct protoidmem {
 	u_int32_t p_oui;
 	u_short p_proto;
 	const char *p_name;
-	struct protoidmem *p_nxt;
 };
 
-static struct protoidmem protoidtable[HASHNAMESIZE];
+static struct nametable protoidtable;
+
+static inline u_int32_t
+hash_word(u_int32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return (h);
+}
+
+static u_int32_t
+hash_bytes(const u_char *p, u_int len)
+{
+	u_int32_t h = len, w;
+
+	for (; len >= 4; p += 4, len -= 4) {
+		memcpy(&w, p, 4);
+		h = hash_word(h ^ w);
+	}
+	if (len > 0) {
+		w = 0;
+		memcpy(&w, p, len);
+		h = hash_word(h ^ w);
+	}
+	return (h);
+}
+
+/*
+ * Return zeroed memory that lives as long as the arena
+ */
+static void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *chunk;
+	size_t chunksize;
+	void *p;
+
+	size = (size + 7) & ~(size_t)7;
+	if (size > a->left) {
+		chunksize = size > ARENA_CHUNKSIZE ? size : ARENA_CHUNKSIZE;
+		chunk = calloc(1, sizeof(*chunk) + chunksize);
+		if (chunk == NULL)
+			error("arena_alloc: calloc");
+		chunk->next = a->chunks;
+		a->chunks = chunk;
+		a->cur = (char *)(chunk + 1);
+		a->left = chunksize;
+	}
+	p = a->cur;
+	a->cur += size;
+	a->left -= size;
+	return (p);
+}
+
+static char *
+arena_strdup(struct arena *a, const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	return (memcpy(arena_alloc(a, len), str, len));
+}
+
+static void
+arena_free(struct arena *a)
+{
+	struct arena_chunk *chunk;
+
+	while ((chunk = a->chunks) != NULL) {
+		a->chunks = chunk->next;
+		free(chunk);
+	}
+	a->cur = NULL;
+	a->left = 0;
+}
+
+/*
+ * Find the entry for which match() is true among those with the hash h
+ */
+static inline void *
+nt_find(struct nametable *t, u_int32_t h,
+	int (*match)(const void *, const void *), const void *key)
+{
+	struct nameslot *s;
+
+	if (t->count == 0)
+		return (NULL);
+	for (s = &t->slots[h & t->mask]; s->entry != NULL;
+	     s = (s == &t->slots[t->mask]) ? t->slots : s + 1)
+		if (s->hash == h && (*match)(s->entry, key))
+			return (s->entry);
+	return (NULL);
+}
+
+static void
+nt_grow(struct nametable *t)
+{
+	struct nameslot *slots, *s, *ns;
+	u_int size, mask;
+
+	size = t->slots == NULL ? NAMETABLE_MINSIZE : 2 * (t->mask + 1);
+	slots = calloc(size, sizeof(struct nameslot));
+	if (slots == NULL)
+		error("nt_grow: calloc");
+	mask = size - 1;
+	if (t->slots != NULL) {
+		for (s = t->slots; s <= &t->slots[t->mask]; s++) {
+			if (s->entry == NULL)
+				continue;
+			for (ns = &slots[s->hash & mask]; ns->entry != NULL;
+			     ns = (ns == &slots[mask]) ? slots : ns + 1)
+				;
+			*ns = *s;
+		}
+		free(t->slots);
+	}
+	t->slots = slots;
+	t->mask = mask;
+}
+
+/*
+ * Add an entry that is not in the table
+ */
+static void
+nt_insert(struct nametable *t, u_int32_t h, void *entry)
+{
+	struct nameslot *s;
+
+	if (t->slots == NULL || (t->count + 1) * 4 > (t->mask + 1) * 3)
+		nt_grow(t);
+	for (s = &t->slots[h & t->mask]; s->entry != NULL;
+	     s = (s == &t->slots[t->mask]) ? t->slots : s + 1)
+		;
+	s->hash = h;
+	s->entry = entry;
+	t->count++;
+}
+
+static void
+nt_free(struct nametable *t)
+{
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
+/*
+ * Start a new generation when the current one holds half the limit
+ */
+static void
+host_rotate(struct hosttable *ht)
+{
+	if (host_name_limit == 0 || ht->cur.count < host_name_limit / 2)
+		return;
+	nt_free(&ht->old);
+	arena_free(&ht->old_arena);
+	ht->old = ht->cur;
+	ht->old_arena = ht->arena;
+	memset(&ht->cur, 0, sizeof(ht->cur));
+	memset(&ht->arena, 0, sizeof(ht->arena));
+}
+
+static int
+match_num(const void *entry, const void *key)
+{
+	return (((const struct hnamemem *)entry)->addr == *(const u_int32_t *)key);
+}
+
+/*
+ * Find the entry of a number in one of the tables of ports and such,
+ * the name of a new entry is NULL
+ */
+static struct hnamemem *
+lookup_num(struct nametable *t, u_int32_t num)
+{
+	struct hnamemem *tp;
+	u_int32_t h = hash_word(num);
+
+	tp = nt_find(t, h, match_num, &num);
+	if (tp == NULL) {
+		tp = arena_alloc(&name_arena, sizeof(*tp));
+		tp->addr = num;
+		nt_insert(t, h, tp);
+	}
+	return (tp);
+}
+
+/*
+ * Find the entry of an IPv4 address. When create is set a missing entry
+ * is added to the current generation with a NULL name, otherwise NULL
+ * is returned for it.
+ */
+static struct hnamemem *
+lookup_host(u_int32_t addr, int create)
+{
+	struct hosttable *ht = &hnametable;
+	struct hnamemem *p, *op;
+	u_int32_t h = hash_word(addr);
+
+	if ((p = nt_find(&ht->cur, h, match_num, &addr)) != NULL)
+		return (p);
+	if (!create)
+		return (nt_find(&ht->old, h, match_num, &addr));
+
+	host_rotate(ht);
+	p = arena_alloc(&ht->arena, sizeof(*p));
+	if ((op = nt_find(&ht->old, h, match_num, &addr)) != NULL) {
+		*p = *op;
+		if (op->name != NULL)
+			p->name = arena_strdup(&ht->arena, op->name);
+	} else
+		p->addr = addr;
+	nt_insert(&ht->cur, h, p);
+	return (p);
+}
+
+#ifdef INET6
+static int
+match_host6(const void *entry, const void *key)
+{
+	return (memcmp(&((const struct h6namemem *)entry)->addr, key,
+	    sizeof(struct in6_addr)) == 0);
+}
+
+static struct h6namemem *
+lookup_host6(const struct in6_addr *addr, int create)
+{
+	struct hosttable *ht = &h6nametable;
+	struct h6namemem *p, *op;
+	u_int32_t h = hash_bytes((const u_char *)addr, sizeof(*addr));
+
+	if ((p = nt_find(&ht->cur, h, match_host6, addr)) != NULL)
+		return (p);
+	if (!create)
+		return (nt_find(&ht->old, h, match_host6, addr));
+
+	host_rotate(ht);
+	p = arena_alloc(&ht->arena, sizeof(*p));
+	if ((op = nt_find(&ht->old, h, match_host6, addr)) != NULL) {
+		*p = *op;
+		if (op->name != NULL)
+			p->name = arena_strdup(&ht->arena, op->name);
+	} else
+		p->addr = *addr;
+	nt_insert(&ht->cur, h, p);
+	return (p);
+}
+#endif /* INET6 */
+
+/*
+ * Bound the number of entries of each host table, 0 for no bound
+ */
+void
+set_name_limit(u_int limit)
+{
+	host_name_limit = limit;
+}
+
+static const char hex[] = "0123456789abcdef";
+
+static const char dec_octets[256][4] = {
+	"0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "13", "14", "15",
+	"16", "17", "18", "19", "20", "21", "22", "23", "24", "25", "26", "27", "28", "29", "30", "31",
+	"32", "33", "34", "35", "36", "37", "38", "39", "40", "41", "42", "43", "44", "45", "46", "47",
+	"48", "49", "50", "51", "52", "53", "54", "55", "56", "57", "58", "59", "60", "61", "62", "63",
+	"64", "65", "66", "67", "68", "69", "70", "71", "72", "73", "74", "75", "76", "77", "78", "79",
+	"80", "81", "82", "83", "84", "85", "86", "87", "88", "89", "90", "91", "92", "93", "94", "95",
+	"96", "97", "98", "99", "100", "101", "102", "103", "104", "105", "106", "107", "108", "109", "110", "111",
+	"112", "113", "114", "115", "116", "117", "118", "119", "120", "121", "122", "123", "124", "125", "126", "127",
+	"128", "129", "130", "131", "132", "133", "134", "135", "136", "137", "138", "139", "140", "141", "142", "143",
+	"144", "145", "146", "147", "148", "149", "150", "151", "152", "153", "154", "155", "156", "157", "158", "159",
+	"160", "161", "162", "163", "164", "165", "166", "167", "168", "169", "170", "171", "172", "173", "174", "175",
+	"176", "177", "178", "179", "180", "181", "182", "183", "184", "185", "186", "187", "188", "189", "190", "191",
+	"192", "193", "194", "195", "196", "197", "198", "199", "200", "201", "202", "203", "204", "205", "206", "207",
+	"208", "209", "210", "211", "212", "213", "214", "215", "216", "217", "218", "219", "220", "221", "222", "223",
+	"224", "225", "226", "227", "228", "229", "230", "231", "232", "233", "234", "235", "236", "237", "238", "239",
+	"240", "241", "242", "243", "244", "245", "246", "247", "248", "249", "250", "251", "252", "253", "254", "255",
+};
 
 /*
  * A faster replacement for inet_ntoa().
@@ -175,33 +556,388 @@ intoa(u_int32_t addr)
 	register char *cp;
 	register u_int byte;
 	register int n;
-	static char buf[sizeof(".xxx.xxx.xxx.xxx")];
+	static char buf[sizeof("xxx.xxx.xxx.xxx")];
 
 	NTOHL(addr);
-	cp = buf + sizeof(buf);
-	*--cp = '\0';
-
-	n = 4;
-	do {
-		byte = addr & 0xff;
-		*--cp = byte % 10 + '0';
-		byte /= 10;
-		if (byte > 0) {
-			*--cp = byte % 10 + '0';
-			byte /= 10;
-			if (byte > 0)
-				*--cp = byte + '0';
+	cp = buf;
+	for (n = 24; n >= 0; n -= 8) {
+		byte = (addr >> n) & 0xff;
+		/* the copy may spill into the room of the next octet */
+		memcpy(cp, dec_octets[byte], 4);
+		cp += 1 + (byte >= 10) + (byte >= 100);
+		*cp++ = '.';
+	}
+	cp[-1] = '\0';
+
+	return buf;
+}
+
+#ifdef INET6
+/*
+ * A faster replacement for inet_ntop() on IPv6 addresses, producing the
+ * same text: the longest run of two or more zero words is compressed as
+ * in RFC 5952, and the IPv4 address of mapped and compatible addresses
+ * is printed as a dotted quad. buf must hold INET6_ADDRSTRLEN bytes.
+ */
+static const char *
+ip6_ntoa(const struct in6_addr *addr, char *buf)
+{
+	const u_char *src = addr->s6_addr;
+	u_int words[8], w;
+	int i, base = -1, len = 0, cur = -1, curlen = 0;
+	u_int32_t addr4;
+	char *cp = buf;
+
+	for (i = 0; i < 8; i++) {
+		words[i] = (src[2 * i] << 8) | src[2 * i + 1];
+		if (words[i] == 0) {
+			if (cur == -1) {
+				cur = i;
+				curlen = 0;
+			}
+			curlen++;
+		} else if (cur != -1) {
+			if (curlen > len) {
+				base = cur;
+				len = curlen;
+			}
+			cur = -1;
 		}
-		*--cp = '.';
-		addr >>= 8;
-	} while (--n > 0);
+	}
+	if (cur != -1 && curlen > len) {
+		base = cur;
+		len = curlen;
+	}
+	if (len < 2)
+		base = -1;
 
-	return cp + 1;
+	for (i = 0; i < 8; i++) {
+		if (base != -1 && i >= base && i < base + len) {
+			if (i == base)
+				*cp++ = ':';
+			continue;
+		}
+		if (i != 0)
+			*cp++ = ':';
+		if (i == 6 && base == 0 &&
+		    (len == 6 || (len == 5 && words[5] == 0xffff))) {
+			memcpy(&addr4, &src[12], sizeof(addr4));
+			strcpy(cp, intoa(addr4));
+			return (buf);
+		}
+		w = words[i];
+		if (w >= 0x1000)
+			*cp++ = hex[w >> 12];
+		if (w >= 0x100)
+			*cp++ = hex[(w >> 8) & 0xf];
+		if (w >= 0x10)
+			*cp++ = hex[(w >> 4) & 0xf];
+		*cp++ = hex[w & 0xf];
+	}
+	if (base != -1 && base + len == 8)
+		*cp++ = ':';
+	*cp = '\0';
+	return (buf);
 }
+#endif /* INET6 */
 
 static u_int32_t f_netmask;
 static u_int32_t f_localnet;
 
+#ifdef USE_ASYNC_RESOLVER
+/*
+ * Asynchronous reverse lookups
+ *
+ * The hash tables are only touched by the thread printing packets: the
+ * resolver threads take requests from the pending list and put them on
+ * the done list, which getname() and getname6() drain before looking up
+ * their table. The entry of an address may have moved or been dropped
+ * in the meantime, so the answer is matched to it by address. Until the
+ * answer comes back an address prints in numeric form, unless the
+ * printing thread was asked to wait a little for it.
+ *
+ * gethostbyaddr() does not give the TTL of the record so names are kept
+ * for a fixed time, and failed lookups for a shorter time, after which
+ * the next sighting of the address triggers a new lookup.
+ */
+#define RESOLVER_THREADS	4
+#define RESOLVER_MAX_INFLIGHT	256
+#define RESOLVER_TTL		3600
+#define RESOLVER_NEGATIVE_TTL	300
+
+struct resolver_req {
+	int family;
+	union {
+		struct in_addr in;
+#ifdef INET6
+		struct in6_addr in6;
+#endif
+	} addr;
+	char *name;			/* result, NULL if not found */
+	struct resolver_req *nxt;
+};
+
+static int resolver_started;
+static u_int resolver_wait_ms;
+static int resolver_inflight;		/* requests on either list */
+static int resolver_ndone;		/* requests on the done list, atomic */
+static struct resolver_req *resolver_pending, **resolver_pending_tail = &resolver_pending;
+static struct resolver_req *resolver_done;
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t resolver_answer = PTHREAD_COND_INITIALIZER;
+
+static void *
+resolver_thread(void *arg _U_)
+{
+	struct resolver_req *req;
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	char host[NI_MAXHOST];
+
+	for (;;) {
+		pthread_mutex_lock(&resolver_lock);
+		while (resolver_pending == NULL)
+			pthread_cond_wait(&resolver_work, &resolver_lock);
+		req = resolver_pending;
+		resolver_pending = req->nxt;
+		if (resolver_pending == NULL)
+			resolver_pending_tail = &resolver_pending;
+		pthread_mutex_unlock(&resolver_lock);
+
+		memset(&ss, 0, sizeof(ss));
+		if (req->family == AF_INET) {
+			struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+			sin->sin_family = AF_INET;
+			sin->sin_addr = req->addr.in;
+			sslen = sizeof(struct sockaddr_in);
+#ifdef INET6
+		} else {
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_addr = req->addr.in6;
+			sslen = sizeof(struct sockaddr_in6);
+#endif
+		}
+#ifdef HAVE_SOCKADDR_SA_LEN
+		((struct sockaddr *)&ss)->sa_len = sslen;
+#endif
+		if (getnameinfo((struct sockaddr *)&ss, sslen, host, sizeof(host),
+				NULL, 0, NI_NAMEREQD) == 0)
+			req->name = strdup(host);
+
+		pthread_mutex_lock(&resolver_lock);
+		req->nxt = resolver_done;
+		resolver_done = req;
+		__atomic_add_fetch(&resolver_ndone, 1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&resolver_answer);
+		pthread_mutex_unlock(&resolver_lock);
+	}
+	/* NOTREACHED */
+	return (NULL);
+}
+
+/*
+ * Replace the name of an entry, the previous name may still be in use
+ * by the caller of getname() so it is left in the arena
+ */
+static void
+resolver_set_name(char **namep, char *name, struct arena *a)
+{
+	char *dotp;
+
+	if (Nflag) {
+		/* Remove domain qualifications */
+		dotp = strchr(name, '.');
+		if (dotp)
+			*dotp = '\0';
+	}
+	if (*namep == NULL || strcmp(*namep, name) != 0)
+		*namep = arena_strdup(a, name);
+	free(name);
+}
+
+static void
+resolver_drain(void)
+{
+	struct resolver_req *req, *done;
+	time_t now;
+
+	if (__atomic_load_n(&resolver_ndone, __ATOMIC_ACQUIRE) == 0)
+		return;
+
+	pthread_mutex_lock(&resolver_lock);
+	done = resolver_done;
+	resolver_done = NULL;
+	resolver_inflight -= __atomic_exchange_n(&resolver_ndone, 0, __ATOMIC_ACQ_REL);
+	pthread_mutex_unlock(&resolver_lock);
+
+	now = time(NULL);
+	while ((req = done) != NULL) {
+		done = req->nxt;
+		if (req->family == AF_INET) {
+			struct hnamemem *p;
+
+#ifdef USE_NAME_CACHE
+			namecache_add(NC_IPV4, &req->addr.in, sizeof(req->addr.in),
+			    req->name, req->name != NULL ? NC_TTL : NC_NEGATIVE_TTL);
+#endif
+			p = lookup_host(req->addr.in.s_addr, 0);
+			if (p != NULL) {
+				p->pending = 0;
+				p->expires = now + (req->name != NULL ?
+				    RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+				if (req->name != NULL)
+					resolver_set_name((char **)&p->name,
+					    req->name, &hnametable.arena);
+			} else
+				free(req->name);
+#ifdef INET6
+		} else {
+			struct h6namemem *p;
+
+#ifdef USE_NAME_CACHE
+			namecache_add(NC_IPV6, &req->addr.in6, sizeof(req->addr.in6),
+			    req->name, req->name != NULL ? NC_TTL : NC_NEGATIVE_TTL);
+#endif
+			p = lookup_host6(&req->addr.in6, 0);
+			if (p != NULL) {
+				p->pending = 0;
+				p->expires = now + (req->name != NULL ?
+				    RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+				if (req->name != NULL)
+					resolver_set_name(&p->name, req->name,
+					    &h6nametable.arena);
+			} else
+				free(req->name);
+#endif
+		}
+		free(req);
+	}
+}
+
+/*
+ * Queue a lookup, returns zero when too many lookups are in flight
+ */
+static int
+resolver_queue(int family, const void *addr)
+{
+	struct resolver_req *req;
+
+	if (resolver_inflight >= RESOLVER_MAX_INFLIGHT)
+		return (0);
+	req = calloc(1, sizeof(struct resolver_req));
+	if (req == NULL)
+		return (0);
+	req->family = family;
+	if (family == AF_INET)
+		memcpy(&req->addr.in, addr, sizeof(struct in_addr));
+#ifdef INET6
+	else
+		memcpy(&req->addr.in6, addr, sizeof(struct in6_addr));
+#endif
+
+	pthread_mutex_lock(&resolver_lock);
+	*resolver_pending_tail = req;
+	resolver_pending_tail = &req->nxt;
+	resolver_inflight++;
+	pthread_cond_signal(&resolver_work);
+	pthread_mutex_unlock(&resolver_lock);
+	return (1);
+}
+
+/*
+ * Give a new lookup resolver_wait_ms to complete before printing
+ */
+static void
+resolver_wait(int family, const void *addr, size_t addrlen)
+{
+	struct timespec deadline;
+	struct timeval now;
+
+	if (resolver_wait_ms == 0)
+		return;
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + resolver_wait_ms / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000 + (resolver_wait_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&resolver_lock);
+	for (;;) {
+		struct resolver_req *req;
+
+		for (req = resolver_done; req != NULL; req = req->nxt) {
+			if (req->family == family &&
+			    memcmp(&req->addr, addr, addrlen) == 0)
+				break;
+		}
+		if (req != NULL)
+			break;
+		if (pthread_cond_timedwait(&resolver_answer, &resolver_lock,
+					   &deadline) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&resolver_lock);
+	resolver_drain();
+}
+
+/*
+ * Start the resolver threads. Until this is called, or when it fails,
+ * names are looked up synchronously. Only the printing thread gets the
+ * signals.
+ */
+void
+init_async_resolver(u_int wait_ms)
+{
+	pthread_t thread;
+	sigset_t all, old;
+	int i;
+
+	resolver_wait_ms = wait_ms;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < RESOLVER_THREADS; i++) {
+		if (pthread_create(&thread, NULL, resolver_thread, NULL) != 0)
+			break;
+		pthread_detach(thread);
+		resolver_started = 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+#endif /* USE_ASYNC_RESOLVER */
+
+#ifdef USE_NAME_CACHE
+/*
+ * Look an address up in the persistent name cache. On a hit *namep is
+ * set to a copy of the name, or to NULL when the last lookup failed.
+ */
+static int
+cached_name(int kind, const void *addr, u_int len, struct arena *a,
+	    char **namep, time_t *expiresp)
+{
+	const char *name;
+	char *dotp;
+
+	if (!namecache_lookup(kind, addr, len, &name, expiresp))
+		return (0);
+	*namep = NULL;
+	if (name != NULL && (*namep = arena_strdup(a, name)) != NULL && Nflag) {
+		/* Remove domain qualifications */
+		dotp = strchr(*namep, '.');
+		if (dotp)
+			*dotp = '\0';
+	}
+	return (1);
+}
+#endif /* USE_NAME_CACHE */
+
 /*
  * Return a name for the IP address pointed to by ap.  This address
  * is assumed to be in network byte order.
@@ -227,15 +963,24 @@ getname(const u_char *ap)
 	register struct hostent *hp;
 	u_int32_t addr;
 	static struct hnamemem *p;		/* static for longjmp() */
+#ifdef USE_NAME_CACHE
+	char *name;
+	time_t expires;
+#endif
 
 	memcpy(&addr, ap, sizeof(addr));
-	p = &hnametable[addr & (HASHNAMESIZE-1)];
-	for (; p->nxt; p = p->nxt) {
-		if (p->addr == addr)
-			return (p->name);
+#ifdef USE_ASYNC_RESOLVER
+	resolver_drain();
+#endif
+	p = lookup_host(addr, 1);
+	if (p->name != NULL) {
+#ifdef USE_ASYNC_RESOLVER
+		if (p->expires != 0 && !p->pending &&
+		    time(NULL) >= p->expires)
+			p->pending = resolver_queue(AF_INET, &addr);
+#endif
+		return (p->name);
 	}
-	p->addr = addr;
-	p->nxt = newhnamemem();
 
 	/*
 	 * Print names unless:
@@ -246,21 +991,53 @@ getname(const u_char *ap)
 	 */
 	if (!nflag &&
 	    (addr & f_netmask) == f_localnet) {
+#ifdef USE_NAME_CACHE
+		if (cached_name(NC_IPV4, &addr, sizeof(addr), &hnametable.arena,
+				&name, &expires)) {
+#ifdef USE_ASYNC_RESOLVER
+			if (resolver_started)
+				p->expires = expires;
+#endif
+			if (name == NULL)
+				name = arena_strdup(&hnametable.arena, intoa(addr));
+			p->name = name;
+			return (p->name);
+		}
+#endif /* USE_NAME_CACHE */
+#ifdef USE_ASYNC_RESOLVER
+		if (resolver_started) {
+			p->name = arena_strdup(&hnametable.arena, intoa(addr));
+			/*
+			 * Retry on a later sighting when too many
+			 * lookups are in flight
+			 */
+			p->expires = 1;
+			p->pending = resolver_queue(AF_INET, &addr);
+			if (p->pending)
+				resolver_wait(AF_INET, &addr, sizeof(addr));
+			return (p->name);
+		}
+#endif /* USE_ASYNC_RESOLVER */
 		hp = gethostbyaddr((char *)&addr, 4, AF_INET);
+#ifdef USE_NAME_CACHE
+		namecache_add(NC_IPV4, &addr, sizeof(addr),
+		    hp != NULL ? hp->h_name : NULL,
+		    hp != NULL ? NC_TTL : NC_NEGATIVE_TTL);
+#endif
 		if (hp) {
 			char *dotp;
 
-			p->name = strdup(hp->h_name);
+			p->name = dotp = arena_strdup(&hnametable.arena, hp->h_name);
 			if (Nflag) {
 				/* Remove domain qualifications */
-				dotp = strchr(p->name, '.');
+				dotp = strchr(dotp, '.');
 				if (dotp)
 					*dotp = '\0';
 			}
 			return (p->name);
 		}
 	}
-	p->name = strdup(intoa(addr));
+	p->name = arena_strdup(&hnametable.arena, intoa(addr));
 	return (p->name);
 }
 
@@ -277,25 +1054,65 @@ getname6(const u_char *ap)
 	static struct h6namemem *p;		/* static for longjmp() */
 	register const char *cp;
 	char ntop_buf[INET6_ADDRSTRLEN];
+#ifdef USE_NAME_CACHE
+	char *name;
+	time_t expires;
+#endif
 
 	memcpy(&addr, ap, sizeof(addr));
-	p = &h6nametable[*(u_int16_t *)&addr.s6_addr[14] & (HASHNAMESIZE-1)];
-	for (; p->nxt; p = p->nxt) {
-		if (memcmp(&p->addr, &addr, sizeof(addr)) == 0)
-			return (p->name);
+#ifdef USE_ASYNC_RESOLVER
+	resolver_drain();
+#endif
+	p = lookup_host6(&addr, 1);
+	if (p->name != NULL) {
+#ifdef USE_ASYNC_RESOLVER
+		if (p->expires != 0 && !p->pending &&
+		    time(NULL) >= p->expires)
+			p->pending = resolver_queue(AF_INET6, &addr);
+#endif
+		return (p->name);
 	}
-	p->addr = addr;
-	p->nxt = newh6namemem();
 
 	/*
 	 * Do not print names if -n was given.
 	 */
 	if (!nflag) {
+#ifdef USE_NAME_CACHE
+		if (cached_name(NC_IPV6, &addr, sizeof(addr), &h6nametable.arena,
+				&name, &expires)) {
+#ifdef USE_ASYNC_RESOLVER
+			if (resolver_started)
+				p->expires = expires;
+#endif
+			if (name == NULL) {
+				cp = ip6_ntoa(&addr, ntop_buf);
+				name = arena_strdup(&h6nametable.arena, cp);
+			}
+			p->name = name;
+			return (p->name);
+		}
+#endif /* USE_NAME_CACHE */
+#ifdef USE_ASYNC_RESOLVER
+		if (resolver_started) {
+			cp = ip6_ntoa(&addr, ntop_buf);
+			p->name = arena_strdup(&h6nametable.arena, cp);
+			p->expires = 1;
+			p->pending = resolver_queue(AF_INET6, &addr);
+			if (p->pending)
+				resolver_wait(AF_INET6, &addr, sizeof(addr));
+			return (p->name);
+		}
+#endif /* USE_ASYNC_RESOLVER */
 		hp = gethostbyaddr((char *)&addr, sizeof(addr), AF_INET6);
+#ifdef USE_NAME_CACHE
+		namecache_add(NC_IPV6, &addr, sizeof(addr),
+		    hp != NULL ? hp->h_name : NULL,
+		    hp != NULL ? NC_TTL : NC_NEGATIVE_TTL);
+#endif
 		if (hp) {
 			char *dotp;
 
-			p->name = strdup(hp->h_name);
+			p->name = arena_strdup(&h6nametable.arena, hp->h_name);
 			if (Nflag) {
 				/* Remove domain qualifications */
 				dotp = strchr(p->name, '.');
@@ -305,45 +1122,51 @@ getname6(const u_char *ap)
 			return (p->name);
 		}
 	}
-	cp = inet_ntop(AF_INET6, &addr, ntop_buf, sizeof(ntop_buf));
-	p->name = strdup(cp);
+	cp = ip6_ntoa(&addr, ntop_buf);
+	p->name = arena_strdup(&h6nametable.arena, cp);
 	return (p->name);
 }
 #endif /* INET6 */
 
-static const char hex[] = "0123456789abcdef";
 
+static int
+match_emem(const void *entry, const void *key)
+{
+	return (memcmp(((const struct enamemem *)entry)->e_addr, key,
+	    ETHER_ADDR_LEN) == 0);
+}
 
 /* Find the hash node that corresponds the ether address 'ep' */
 
 static inline struct enamemem *
 lookup_emem(const u_char *ep)
 {
-	register u_int i, j, k;
 	struct enamemem *tp;
+	u_int32_t h = hash_bytes(ep, ETHER_ADDR_LEN);
 
-	k = (ep[0] << 8) | ep[1];
-	j = (ep[2] << 8) | ep[3];
-	i = (ep[4] << 8) | ep[5];
-
-	tp = &enametable[(i ^ j) & (HASHNAMESIZE-1)];
-	while (tp->e_nxt)
-		if (tp->e_addr0 == i &&
-		    tp->e_addr1 == j &&
-		    tp->e_addr2 == k)
-			return tp;
-		else
-			tp = tp->e_nxt;
-	tp->e_addr0 = i;
-	tp->e_addr1 = j;
-	tp->e_addr2 = k;
-	tp->e_nxt = (struct enamemem *)calloc(1, sizeof(*tp));
-	if (tp->e_nxt == NULL)
-		error("lookup_emem: calloc");
-
+	tp = nt_find(&enametable, h, match_emem, ep);
+	if (tp == NULL) {
+		tp = arena_alloc(&name_arena, sizeof(*tp));
+		memcpy(tp->e_addr, ep, ETHER_ADDR_LEN);
+		nt_insert(&enametable, h, tp);
+	}
 	return tp;
 }
 
+struct bytestring {
+	const u_char *bs;
+	u_int len;
+};
+
+static int
+match_bytestring(const void *entry, const void *key)
+{
+	const struct enamemem *tp = entry;
+	const struct bytestring *b = key;
+
+	return (tp->e_len == b->len && memcmp(tp->e_bs, b->bs, b->len) == 0);
+}
+
 /*
  * Find the hash node that corresponds to the bytestring 'bs'
  * with length 'nlen'
@@ -353,116 +1176,119 @@ static inline struct enamemem *
 lookup_bytestring(register const u_char *bs, const unsigned int nlen)
 {
 	struct enamemem *tp;
-	register u_int i, j, k;
-
-	if (nlen >= 6) {
-		k = (bs[0] << 8) | bs[1];
-		j = (bs[2] << 8) | bs[3];
-		i = (bs[4] << 8) | bs[5];
-	} else if (nlen >= 4) {
-		k = (bs[0] << 8) | bs[1];
-		j = (bs[2] << 8) | bs[3];
-		i = 0;
-	} else
-		i = j = k = 0;
-
-	tp = &bytestringtable[(i ^ j) & (HASHNAMESIZE-1)];
-	while (tp->e_nxt)
-		if (tp->e_addr0 == i &&
-		    tp->e_addr1 == j &&
-		    tp->e_addr2 == k &&
-		    memcmp((const char *)bs, (const char *)(tp->e_bs), nlen) == 0)
-			return tp;
-		else
-			tp = tp->e_nxt;
-
-	tp->e_addr0 = i;
-	tp->e_addr1 = j;
-	tp->e_addr2 = k;
-
-	tp->e_bs = (u_char *) calloc(1, nlen + 1);
-	if (tp->e_bs == NULL)
-		error("lookup_bytestring: calloc");
-
-	memcpy(tp->e_bs, bs, nlen);
-	tp->e_nxt = (struct enamemem *)calloc(1, sizeof(*tp));
-	if (tp->e_nxt == NULL)
-		error("lookup_bytestring: calloc");
-
+	struct bytestring key;
+	u_int32_t h = hash_bytes(bs, nlen);
+
+	key.bs = bs;
+	key.len = nlen;
+	tp = nt_find(&bytestringtable, h, match_bytestring, &key);
+	if (tp == NULL) {
+		tp = arena_alloc(&name_arena, sizeof(*tp) + nlen + 1);
+		tp->e_bs = (u_char *)(tp + 1);
+		tp->e_len = nlen;
+		memcpy(tp->e_bs, bs, nlen);
+		nt_insert(&bytestringtable, h, tp);
+	}
 	return tp;
 }
 
+static int
+match_nsap(const void *entry, const void *key)
+{
+	const struct enamemem *tp = entry;
+	const u_char *nsap = key;
+
+	return (tp->e_len == nsap[0] + 1U &&
+	    memcmp(tp->e_nsap, nsap, tp->e_len) == 0);
+}
+
 /* Find the hash node that corresponds the NSAP 'nsap' */
 
 static inline struct enamemem *
 lookup_nsap(register const u_char *nsap)
 {
-	register u_int i, j, k;
 	unsigned int nlen = *nsap;
 	struct enamemem *tp;
-	const u_char *ensap = nsap + nlen - 6;
-
-	if (nlen > 6) {
-		k = (ensap[0] << 8) | ensap[1];
-		j = (ensap[2] << 8) | ensap[3];
-		i = (ensap[4] << 8) | ensap[5];
+	u_int32_t h = hash_bytes(nsap, nlen + 1);
+
+	tp = nt_find(&nsaptable, h, match_nsap, nsap);
+	if (tp == NULL) {
+		tp = arena_alloc(&name_arena, sizeof(*tp) + nlen + 1);
+		tp->e_nsap = (u_char *)(tp + 1);
+		tp->e_len = nlen + 1;
+		memcpy(tp->e_nsap, nsap, nlen + 1);
+		nt_insert(&nsaptable, h, tp);
 	}
-	else
-		i = j = k = 0;
-
-	tp = &nsaptable[(i ^ j) & (HASHNAMESIZE-1)];
-	while (tp->e_nxt)
-		if (tp->e_addr0 == i &&
-		    tp->e_addr1 == j &&
-		    tp->e_addr2 == k &&
-		    tp->e_nsap[0] == nlen &&
-		    memcmp((const char *)&(nsap[1]),
-			(char *)&(tp->e_nsap[1]), nlen) == 0)
-			return tp;
-		else
-			tp = tp->e_nxt;
-	tp->e_addr0 = i;
-	tp->e_addr1 = j;
-	tp->e_addr2 = k;
-	tp->e_nsap = (u_char *)malloc(nlen + 1);
-	if (tp->e_nsap == NULL)
-		error("lookup_nsap: malloc");
-	memcpy((char *)tp->e_nsap, (const char *)nsap, nlen + 1);
-	tp->e_nxt = (struct enamemem *)calloc(1, sizeof(*tp));
-	if (tp->e_nxt == NULL)
-		error("lookup_nsap: calloc");
-
 	return tp;
 }
 
+static int
+match_protoid(const void *entry, const void *key)
+{
+	const struct protoidmem *tp = entry;
+	const struct protoidmem *k = key;
+
+	return (tp->p_oui == k->p_oui && tp->p_proto == k->p_proto);
+}
+
 /* Find the hash node that corresponds the protoid 'pi'. */
 
 static inline struct protoidmem *
 lookup_protoid(const u_char *pi)
 {
-	register u_int i, j;
-	struct protoidmem *tp;
+	struct protoidmem *tp, key;
+	u_int32_t h = hash_bytes(pi, 5);
 
 	/* 5 octets won't be aligned */
-	i = (((pi[0] << 8) + pi[1]) << 8) + pi[2];
-	j =   (pi[3] << 8) + pi[4];
-	/* XXX should be endian-insensitive, but do big-endian testing  XXX */
-
-	tp = &protoidtable[(i ^ j) & (HASHNAMESIZE-1)];
-	while (tp->p_nxt)
-		if (tp->p_oui == i && tp->p_proto == j)
-			return tp;
-		else
-			tp = tp->p_nxt;
-	tp->p_oui = i;
-	tp->p_proto = j;
-	tp->p_nxt = (struct protoidmem *)calloc(1, sizeof(*tp));
-	if (tp->p_nxt == NULL)
-		error("lookup_protoid: calloc");
-
+	key.p_oui = (((pi[0] << 8) + pi[1]) << 8) + pi[2];
+	key.p_proto = (pi[3] << 8) + pi[4];
+	tp = nt_find(&protoidtable, h, match_protoid, &key);
+	if (tp == NULL) {
+		tp = arena_alloc(&name_arena, sizeof(*tp));
+		tp->p_oui = key.p_oui;
+		tp->p_proto = key.p_proto;
+		nt_insert(&protoidtable, h, tp);
+	}
 	return tp;
 }
 
+#ifdef USE_ETHER_NTOHOST
+/*
+ * ether_ntohost() goes through /etc/ethers or a directory service, so
+ * its answers are kept in the persistent name cache when there is one
+ */
+static int
+ether_name(const u_char *ep, char *buf, size_t buflen)
+{
+#ifdef USE_NAME_CACHE
+	const char *name;
+
+	if (namecache_lookup(NC_ETHER, ep, ETHER_ADDR_LEN, &name, NULL)) {
+		if (name == NULL)
+			return (-1);
+		(void)snprintf(buf, buflen, "%s", name);
+		return (0);
+	}
+#endif
+	/*
+	 * We don't cast it to "const struct ether_addr *"
+	 * because some systems fail to declare the second
+	 * argument as a "const" pointer, even though they
+	 * don't modify what it points to.
+	 */
+	if (ether_ntohost(buf, (struct ether_addr *)ep) != 0) {
+#ifdef USE_NAME_CACHE
+		namecache_add(NC_ETHER, ep, ETHER_ADDR_LEN, NULL, NC_NEGATIVE_TTL);
+#endif
+		return (-1);
+	}
+#ifdef USE_NAME_CACHE
+	namecache_add(NC_ETHER, ep, ETHER_ADDR_LEN, buf, NC_FILE_TTL);
+#endif
+	return (0);
+}
+#endif /* USE_ETHER_NTOHOST */
+
 const char *
 etheraddr_string(register const u_char *ep)
 {
@@ -472,6 +1298,7 @@ etheraddr_string(register const u_char *ep)
 	int oui;
 	char buf[BUFSIZE];
 
+	NEED_NAMES(NAMES_ETHER, init_etherarray);
 	tp = lookup_emem(ep);
 	if (tp->e_name)
 		return (tp->e_name);
@@ -479,26 +1306,20 @@ etheraddr_string(register const u_char *ep)
 	if (!nflag) {
 		char buf2[BUFSIZE];
 
-		/*
-		 * We don't cast it to "const struct ether_addr *"
-		 * because some systems fail to declare the second
-		 * argument as a "const" pointer, even though they
-		 * don't modify what it points to.
-		 */
-		if (ether_ntohost(buf2, (struct ether_addr *)ep) == 0) {
-			tp->e_name = strdup(buf2);
+		if (ether_name(ep, buf2, sizeof(buf2)) == 0) {
+			tp->e_name = arena_strdup(&name_arena, buf2);
 			return (tp->e_name);
 		}
 	}
 #endif
 	cp = buf;
 	oui = EXTRACT_24BITS(ep);
-	*cp++ = hex[*ep >> 4 ];
-	*cp++ = hex[*ep++ & 0xf];
+	memcpy(cp, &hex_pairs[2 * *ep++], 2);
+	cp += 2;
 	for (i = 5; --i >= 0;) {
 		*cp++ = ':';
-		*cp++ = hex[*ep >> 4 ];
-		*cp++ = hex[*ep++ & 0xf];
+		memcpy(cp, &hex_pairs[2 * *ep++], 2);
+		cp += 2;
 	}
 
 	if (!nflag) {
@@ -506,7 +1327,7 @@ etheraddr_string(register const u_char *ep)
 		    tok2str(oui_values, "Unknown", oui));
 	} else
 		*cp = '\0';
-	tp->e_name = strdup(buf);
+	tp->e_name = arena_strdup(&name_arena, buf);
 	return (tp->e_name);
 }
 
@@ -525,15 +1346,15 @@ le64addr_string(const u_char *ep)
 
 	cp = buf;
 	for (i = len; i > 0 ; --i) {
-		*cp++ = hex[*(ep + i - 1) >> 4];
-		*cp++ = hex[*(ep + i - 1) & 0xf];
+		memcpy(cp, &hex_pairs[2 * *(ep + i - 1)], 2);
+		cp += 2;
 		*cp++ = ':';
 	}
 	cp --;
 
 	*cp = '\0';
 
-	tp->e_name = strdup(buf);
+	tp->e_name = arena_strdup(&name_arena, buf);
 
 	return (tp->e_name);
 }
@@ -558,15 +1379,13 @@ linkaddr_string(const u_char *ep, const unsigned int type, const unsigned int le
 	if (tp->e_name)
 		return (tp->e_name);
 
-	tp->e_name = cp = (char *)malloc(len*3);
-	if (tp->e_name == NULL)
-		error("linkaddr_string: malloc");
-	*cp++ = hex[*ep >> 4];
-	*cp++ = hex[*ep++ & 0xf];
+	tp->e_name = cp = arena_alloc(&name_arena, len*3);
+	memcpy(cp, &hex_pairs[2 * *ep++], 2);
+	cp += 2;
 	for (i = len-1; i > 0 ; --i) {
 		*cp++ = ':';
-		*cp++ = hex[*ep >> 4];
-		*cp++ = hex[*ep++ & 0xf];
+		memcpy(cp, &hex_pairs[2 * *ep++], 2);
+		cp += 2;
 	}
 	*cp = '\0';
 	return (tp->e_name);
@@ -580,12 +1399,10 @@ etherproto_string(u_short port)
 	register u_int32_t i = port;
 	char buf[sizeof("0000")];
 
-	for (tp = &eprototable[i & (HASHNAMESIZE-1)]; tp->nxt; tp = tp->nxt)
-		if (tp->addr == i)
-			return (tp->name);
-
-	tp->addr = i;
-	tp->nxt = newhnamemem();
+	NEED_NAMES(NAMES_EPROTO, init_eprotoarray);
+	tp = lookup_num(&eprototable, i);
+	if (tp->name)
+		return (tp->name);
 
 	cp = buf;
 	NTOHS(port);
@@ -594,7 +1411,7 @@ etherproto_string(u_short port)
 	*cp++ = hex[port >> 4 & 0xf];
 	*cp++ = hex[port & 0xf];
 	*cp++ = '\0';
-	tp->name = strdup(buf);
+	tp->name = arena_strdup(&name_arena, buf);
 	return (tp->name);
 }
 
@@ -606,6 +1423,7 @@ protoid_string(register const u_char *pi)
 	register struct protoidmem *tp;
 	char buf[sizeof("00:00:00:00:00")];
 
+	NEED_NAMES(NAMES_PROTOID, init_protoidarray);
 	tp = lookup_protoid(pi);
 	if (tp->p_name)
 		return tp->p_name;
@@ -621,7 +1439,7 @@ protoid_string(register const u_char *pi)
 		*cp++ = hex[*pi++ & 0xf];
 	}
 	*cp = '\0';
-	tp->p_name = strdup(buf);
+	tp->p_name = arena_strdup(&name_arena, buf);
 	return (tp->p_name);
 }
 
@@ -640,9 +1458,8 @@ isonsap_string(const u_char *nsap, register u_int nsap_length)
 	if (tp->e_name)
 		return tp->e_name;
 
-	tp->e_name = cp = (char *)malloc(sizeof("xx.xxxx.xxxx.xxxx.xxxx.xxxx.xxxx.xxxx.xxxx.xxxx.xx"));
-	if (cp == NULL)
-		error("isonsap_string: malloc");
+	tp->e_name = cp = arena_alloc(&name_arena,
+	    sizeof("xx.xxxx.xxxx.xxxx.xxxx.xxxx.xxxx.xxxx.xxxx.xxxx.xx"));
 
 	for (nsap_idx = 0; nsap_idx < nsap_length; nsap_idx++) {
 		*cp++ = hex[*nsap >> 4];
@@ -663,15 +1480,13 @@ tcpport_string(u_short port)
 	register u_int32_t i = port;
 	char buf[sizeof("00000")];
 
-	for (tp = &tporttable[i & (HASHNAMESIZE-1)]; tp->nxt; tp = tp->nxt)
-		if (tp->addr == i)
-			return (tp->name);
-
-	tp->addr = i;
-	tp->nxt = newhnamemem();
+	NEED_NAMES(NAMES_SERV, init_servarray);
+	tp = lookup_num(&tporttable, i);
+	if (tp->name)
+		return (tp->name);
 
 	(void)snprintf(buf, sizeof(buf), "%u", i);
-	tp->name = strdup(buf);
+	tp->name = arena_strdup(&name_arena, buf);
 	return (tp->name);
 }
 
@@ -682,15 +1497,13 @@ udpport_string(register u_short port)
 	register u_int32_t i = port;
 	char buf[sizeof("00000")];
 
-	for (tp = &uporttable[i & (HASHNAMESIZE-1)]; tp->nxt; tp = tp->nxt)
-		if (tp->addr == i)
-			return (tp->name);
-
-	tp->addr = i;
-	tp->nxt = newhnamemem();
+	NEED_NAMES(NAMES_SERV, init_servarray);
+	tp = lookup_num(&uporttable, i);
+	if (tp->name)
+		return (tp->name);
 
 	(void)snprintf(buf, sizeof(buf), "%u", i);
-	tp->name = strdup(buf);
+	tp->name = arena_strdup(&name_arena, buf);
 	return (tp->name);
 }
 
@@ -700,14 +1513,14 @@ ipxsap_string(u_short port)
 	register char *cp;
 	register struct hnamemem *tp;
 	register u_int32_t i = port;
+	const char *name;
 	char buf[sizeof("0000")];
 
-	for (tp = &ipxsaptable[i & (HASHNAMESIZE-1)]; tp->nxt; tp = tp->nxt)
-		if (tp->addr == i)
-			return (tp->name);
-
-	tp->addr = i;
-	tp->nxt = newhnamemem();
+	if (!nflag && (name = ipxsap_name(ntohs(port))) != NULL)
+		return (name);
+	tp = lookup_num(&ipxsaptable, i);
+	if (tp->name)
+		return (tp->name);
 
 	cp = buf;
 	NTOHS(port);
@@ -716,39 +1529,128 @@ ipxsap_string(u_short port)
 	*cp++ = hex[port >> 4 & 0xf];
 	*cp++ = hex[port & 0xf];
 	*cp++ = '\0';
-	tp->name = strdup(buf);
+	tp->name = arena_strdup(&name_arena, buf);
 	return (tp->name);
 }
 
+/* Returns 1 if the port had no name yet */
+static int
+add_servent(struct nametable *table, int port, const char *name)
+{
+	struct hnamemem *tp;
+	char buf[sizeof("0000000000")];
+
+	/* The first entry of a port wins */
+	tp = lookup_num(table, port);
+	if (tp->name)
+		return (0);
+	if (nflag) {
+		(void)snprintf(buf, sizeof(buf), "%d", port);
+		tp->name = arena_strdup(&name_arena, buf);
+	} else
+		tp->name = arena_strdup(&name_arena, name);
+	return (1);
+}
+
+#ifdef USE_NAME_CACHE
+#ifndef _PATH_SERVICES
+#define _PATH_SERVICES	"/etc/services"
+#endif
+
+static const char services_stamp[] = "services";
+
+struct cached_servents {
+	struct nametable *table;
+	u_int count;
+};
+
+static void
+add_cached_servent(const u_char *key, u_int keylen, const char *name,
+		   void *arg)
+{
+	struct cached_servents *cs = arg;
+
+	if (keylen == 2 && name != NULL) {
+		add_servent(cs->table, EXTRACT_16BITS(key), name);
+		cs->count++;
+	}
+}
+
+/*
+ * The services are in the name cache when it was written after the last
+ * change to the services file.  The stamp also has the number of ports
+ * that were cached, as some of them may have been evicted or expired
+ * since; the table is then read from the services file again.
+ */
+static int
+init_servarray_cached(char *mtime, size_t mtimelen)
+{
+	struct cached_servents tcp, udp;
+	struct stat st;
+	const char *name, *sp;
+	size_t len;
+
+	if (stat(_PATH_SERVICES, &st) < 0)
+		return (0);
+	(void)snprintf(mtime, mtimelen, "%lld", (long long)st.st_mtime);
+	len = strlen(mtime);
+	if (!namecache_lookup(NC_STAMP, services_stamp, sizeof(services_stamp) - 1,
+			      &name, NULL) ||
+	    name == NULL || strncmp(name, mtime, len) != 0 || name[len] != ' ')
+		return (0);
+	sp = name + len + 1;
+
+	tcp.table = &tporttable;
+	tcp.count = 0;
+	namecache_foreach(NC_TCP, add_cached_servent, &tcp);
+	udp.table = &uporttable;
+	udp.count = 0;
+	namecache_foreach(NC_UDP, add_cached_servent, &udp);
+	return (strtoul(sp, NULL, 10) == tcp.count + udp.count);
+}
+#endif /* USE_NAME_CACHE */
+
 static void
 init_servarray(void)
 {
 	struct servent *sv;
-	register struct hnamemem *table;
-	register int i;
-	char buf[sizeof("0000000000")];
+#ifdef USE_NAME_CACHE
+	char mtime[sizeof("-9223372036854775808")] = "";
+	char stamp[sizeof(mtime) + sizeof(" 4294967295")];
+	u_int count = 0;
+
+	if (init_servarray_cached(mtime, sizeof(mtime)))
+		return;
+#endif
 
 	while ((sv = getservent()) != NULL) {
 		int port = ntohs(sv->s_port);
-		i = port & (HASHNAMESIZE-1);
-		if (strcmp(sv->s_proto, "tcp") == 0)
-			table = &tporttable[i];
-		else if (strcmp(sv->s_proto, "udp") == 0)
-			table = &uporttable[i];
-		else
-			continue;
-
-		while (table->name)
-			table = table->nxt;
-		if (nflag) {
-			(void)snprintf(buf, sizeof(buf), "%d", port);
-			table->name = strdup(buf);
-		} else
-			table->name = strdup(sv->s_name);
-		table->addr = port;
-		table->nxt = newhnamemem();
+		if (strcmp(sv->s_proto, "tcp") == 0) {
+			if (!add_servent(&tporttable, port, sv->s_name))
+				continue;
+#ifdef USE_NAME_CACHE
+			namecache_add(NC_TCP, &sv->s_port, 2, sv->s_name,
+			    NC_FILE_TTL);
+			count++;
+#endif
+		} else if (strcmp(sv->s_proto, "udp") == 0) {
+			if (!add_servent(&uporttable, port, sv->s_name))
+				continue;
+#ifdef USE_NAME_CACHE
+			namecache_add(NC_UDP, &sv->s_port, 2, sv->s_name,
+			    NC_FILE_TTL);
+			count++;
+#endif
+		}
 	}
 	endservent();
+#ifdef USE_NAME_CACHE
+	if (mtime[0] != '\0') {
+		(void)snprintf(stamp, sizeof(stamp), "%s %u", mtime, count);
+		namecache_add(NC_STAMP, services_stamp, sizeof(services_stamp) - 1,
+		    stamp, NC_FILE_TTL);
+	}
+#endif
 }
 
 /* in libpcap.a (nametoaddr.c) */
@@ -766,16 +1668,12 @@ static void
 init_eprotoarray(void)
 {
 	register int i;
-	register struct hnamemem *table;
+	register struct hnamemem *tp;
 
 	for (i = 0; eproto_db[i].s; i++) {
-		int j = htons(eproto_db[i].p) & (HASHNAMESIZE-1);
-		table = &eprototable[j];
-		while (table->name)
-			table = table->nxt;
-		table->name = eproto_db[i].s;
-		table->addr = htons(eproto_db[i].p);
-		table->nxt = newhnamemem();
+		tp = lookup_num(&eprototable, htons(eproto_db[i].p));
+		if (tp->name == NULL)
+			tp->name = eproto_db[i].s;
 	}
 }
 
@@ -811,7 +1709,7 @@ init_protoidarray(void)
 
 		memcpy((char *)&protoid[3], (char *)&etype, 2);
 		tp = lookup_protoid(protoid);
-		tp->p_name = strdup(eproto_db[i].s);
+		tp->p_name = eproto_db[i].s;
 	}
 	/* Hardwire some SNAP proto ID names */
 	for (pl = protoidlist; pl->name != NULL; ++pl) {
@@ -862,7 +1760,7 @@ init_etherarray(void)
 	if (fp != NULL) {
 		while ((ep = pcap_next_etherent(fp)) != NULL) {
 			tp = lookup_emem(ep->addr);
-			tp->e_name = strdup(ep->name);
+			tp->e_name = arena_strdup(&name_arena, ep->name);
 		}
 		(void)fclose(fp);
 	}
@@ -885,7 +1783,7 @@ init_etherarray(void)
 		 * as a "const" pointer.
 		 */
 		if (ether_ntohost(name, (struct ether_addr *)el->addr) == 0) {
-			tp->e_name = strdup(name);
+			tp->e_name = arena_strdup(&name_arena, name);
 			continue;
 		}
 #endif
@@ -1075,8 +1973,8 @@ static const struct tok ipxsap_db[] = {
 	{ 0x079b, "ShivaLanRover/E 115" },
 	{ 0x079c, "ShivaLanRover/T 115" },
 	{ 0x07B4, "CubixWorldDesk" },
-	{ 0x07c2, "Quarterdeck IWare Connect V2.x NLM" },
 	{ 0x07c1, "Quarterdeck IWare Connect V3.x NLM" },
+	{ 0x07c2, "Quarterdeck IWare Connect V2.x NLM" },
 	{ 0x0810, "ELAN License Server Demo" },
 	{ 0x0824, "ShivaLanRoverAccessSwitch/E" },
 	{ 0x086a, "ISSC Collector" },
@@ -1110,21 +2008,27 @@ static const struct tok ipxsap_db[] = {
 	{ 0, (char *)0 }
 };
 
-static void
-init_ipxsaparray(void)
+static int
+tok_compare(const void *key, const void *elem)
 {
-	register int i;
-	register struct hnamemem *table;
-
-	for (i = 0; ipxsap_db[i].s != NULL; i++) {
-		int j = htons(ipxsap_db[i].v) & (HASHNAMESIZE-1);
-		table = &ipxsaptable[j];
-		while (table->name)
-			table = table->nxt;
-		table->name = ipxsap_db[i].s;
-		table->addr = htons(ipxsap_db[i].v);
-		table->nxt = newhnamemem();
-	}
+	int v = *(const int *)key;
+
+	return (v - ((const struct tok *)elem)->v);
+}
+
+/*
+ * ipxsap_db[] is sorted by value, leaving out the terminating entry
+ */
+static const char *
+ipxsap_name(u_int v)
+{
+	const struct tok *tp;
+	int key = v;
+
+	tp = bsearch(&key, ipxsap_db,
+	    sizeof(ipxsap_db) / sizeof(ipxsap_db[0]) - 1, sizeof(ipxsap_db[0]),
+	    tok_compare);
+	return (tp != NULL ? tp->s : NULL);
 }
 
 /*
@@ -1146,11 +2050,21 @@ init_addrtoname(u_int32_t localnet, u_int32_t mask)
 		 */
 		return;
 
-	init_etherarray();
-	init_servarray();
-	init_eprotoarray();
-	init_protoidarray();
-	init_ipxsaparray();
+	names_pending = NAMES_ETHER | NAMES_SERV | NAMES_EPROTO | NAMES_PROTOID;
+}
+
+/*
+ * Build the tables that are still pending, for when tcpdump is about to
+ * give up the privileges or the root directory needed to read the files
+ * they come from
+ */
+void
+load_addrtoname_tables(void)
+{
+	NEED_NAMES(NAMES_ETHER, init_etherarray);
+	NEED_NAMES(NAMES_SERV, init_servarray);
+	NEED_NAMES(NAMES_EPROTO, init_eprotoarray);
+	NEED_NAMES(NAMES_PROTOID, init_protoidarray);
 }
 
 const char *
@@ -1158,13 +2072,10 @@ dnaddr_string(u_short dnaddr)
 {
 	register struct hnamemem *tp;
 
-	for (tp = &dnaddrtable[dnaddr & (HASHNAMESIZE-1)]; tp->nxt != 0;
-	     tp = tp->nxt)
-		if (tp->addr == dnaddr)
-			return (tp->name);
+	tp = lookup_num(&dnaddrtable, dnaddr);
+	if (tp->name)
+		return (tp->name);
 
-	tp->addr = dnaddr;
-	tp->nxt = newhnamemem();
 	if (nflag)
 		tp->name = dnnum_string(dnaddr);
 	else
@@ -1191,24 +2102,3 @@ newhnamemem(void)
 	p = ptr++;
 	return (p);
 }
-
-#ifdef INET6
-/* Return a zero'ed h6namemem struct and cuts down on calloc() overhead */
-struct h6namemem *
-newh6namemem(void)
-{
-	register struct h6namemem *p;
-	static struct h6namemem *ptr = NULL;
-	static u_int num = 0;
-
-	if (num  <= 0) {
-		num = 64;
-		ptr = (struct h6namemem *)calloc(num, sizeof (*ptr));
-		if (ptr == NULL)
-			error("newh6namemem: calloc");
-	}
-	--num;
-	p = ptr++;
-	return (p);
-}
-#endif /* INET6 */
@@ -45,10 +45,12 @@ extern const char *getname6(const u_char *);
 extern const char *intoa(u_int32_t);
 
 extern void init_addrtoname(u_int32_t, u_int32_t);
-extern struct hnamemem *newhnamemem(void);
-#ifdef INET6
-extern struct h6namemem *newh6namemem(void);
+extern void load_addrtoname_tables(void);
+#ifdef __APPLE__
+extern void init_async_resolver(u_int);
 #endif
+extern void set_name_limit(u_int);
+extern struct hnamemem *newhnamemem(void);
 
 #define ipaddr_string(p) getname((const u_char *)(p))
 #ifdef INET6
@@ -0,0 +1,638 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Userland BPF JIT for the filters that tcpdump runs itself, i.e. the
+ * per-interface filters of PKTAP and PCAP-NG captures.
+ *
+ * The generated code follows bpf_filter() exactly: out of bounds packet
+ * loads and division by zero return 0 (no match). Programs that use an
+ * instruction the JIT does not know about run with the libpcap interpreter.
+ *
+ * x86-64 register usage:
+ *	rdi	packet pointer
+ *	esi	wire length
+ *	r8d	buffer (captured) length
+ *	eax	A accumulator
+ *	ecx	X index register
+ *	edx	scratch for div
+ *	r10,r11	scratch
+ *	[rsp]	scratch memory M[]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <tcpdump-stdinc.h>
+
+#include <pcap.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "bpf_jit.h"
+
+typedef u_int (*bpf_jit_func_t)(const u_char *, u_int, u_int);
+
+struct bpf_jit_filter {
+	bpf_jit_func_t	func;		/* NULL when interpreted */
+	void		*code;
+	size_t		code_size;
+	struct bpf_insn	*insns;		/* for the interpreter */
+};
+
+#if defined(__x86_64__)
+
+#define JIT_TARGET_RET0		-1	/* return 0 */
+#define JIT_TARGET_EXIT		-2	/* return A */
+
+#define JIT_MEM_SIZE		(BPF_MEMWORDS * 4)
+#define JIT_FRAME_SIZE		(JIT_MEM_SIZE + 8)	/* keep rsp 16 byte aligned */
+
+/* Condition codes for Jcc rel32 (0x0f 0x80 + cc) */
+#define CC_B	0x2
+#define CC_AE	0x3
+#define CC_E	0x4
+#define CC_NE	0x5
+#define CC_BE	0x6
+#define CC_A	0x7
+
+struct jit_fixup {
+	size_t	offset;		/* of the rel32 */
+	int	target;		/* BPF instruction or JIT_TARGET_xxx */
+};
+
+struct jit_state {
+	u_char		*buf;
+	size_t		len;
+	size_t		size;
+	size_t		*addrs;		/* native offset of each BPF instruction */
+	struct jit_fixup *fixups;
+	u_int		num_fixups;
+	u_int		max_fixups;
+	int		failed;
+};
+
+static void
+emit(struct jit_state *st, const u_char *bytes, size_t n)
+{
+	if (st->failed)
+		return;
+	if (st->len + n > st->size) {
+		size_t size = st->size ? st->size * 2 : 1024;
+		u_char *buf;
+
+		while (st->len + n > size)
+			size *= 2;
+		buf = realloc(st->buf, size);
+		if (buf == NULL) {
+			st->failed = 1;
+			return;
+		}
+		st->buf = buf;
+		st->size = size;
+	}
+	memcpy(st->buf + st->len, bytes, n);
+	st->len += n;
+}
+
+#define EMIT(st, ...) do { \
+	static const u_char __b[] = { __VA_ARGS__ }; \
+	emit((st), __b, sizeof(__b)); \
+} while (0)
+
+static void
+emit_u32(struct jit_state *st, uint32_t v)
+{
+	u_char b[4];
+
+	b[0] = v & 0xff;
+	b[1] = (v >> 8) & 0xff;
+	b[2] = (v >> 16) & 0xff;
+	b[3] = (v >> 24) & 0xff;
+	emit(st, b, 4);
+}
+
+static void
+emit_u8(struct jit_state *st, u_int v)
+{
+	u_char b = v & 0xff;
+
+	emit(st, &b, 1);
+}
+
+static void
+emit_rel32(struct jit_state *st, int target)
+{
+	if (st->failed)
+		return;
+	if (st->num_fixups == st->max_fixups) {
+		u_int max = st->max_fixups ? st->max_fixups * 2 : 64;
+		struct jit_fixup *fixups;
+
+		fixups = realloc(st->fixups, max * sizeof(struct jit_fixup));
+		if (fixups == NULL) {
+			st->failed = 1;
+			return;
+		}
+		st->fixups = fixups;
+		st->max_fixups = max;
+	}
+	st->fixups[st->num_fixups].offset = st->len;
+	st->fixups[st->num_fixups].target = target;
+	st->num_fixups++;
+	emit_u32(st, 0);
+}
+
+static void
+emit_jmp(struct jit_state *st, int target)
+{
+	EMIT(st, 0xe9);
+	emit_rel32(st, target);
+}
+
+static void
+emit_jcc(struct jit_state *st, int cc, int target)
+{
+	emit_u8(st, 0x0f);
+	emit_u8(st, 0x80 + cc);
+	emit_rel32(st, target);
+}
+
+/*
+ * Branch to "jt" or "jf" on the flags set by the previous instruction
+ */
+static void
+emit_cond(struct jit_state *st, int cc, int inv_cc, int pc, int jt, int jf)
+{
+	if (jt == jf) {
+		if (jt != pc + 1)
+			emit_jmp(st, jt);
+	} else if (jt == pc + 1) {
+		emit_jcc(st, inv_cc, jf);
+	} else {
+		emit_jcc(st, cc, jt);
+		if (jf != pc + 1)
+			emit_jmp(st, jf);
+	}
+}
+
+/*
+ * Packet load at a constant offset: fail unless k + size <= buflen
+ */
+static void
+emit_load_abs(struct jit_state *st, u_int size, uint32_t k)
+{
+	if (k > 0x7fffffff - size) {
+		emit_jmp(st, JIT_TARGET_RET0);
+		return;
+	}
+	EMIT(st, 0x41, 0x81, 0xf8);		/* cmp r8d, k + size */
+	emit_u32(st, k + size);
+	emit_jcc(st, CC_B, JIT_TARGET_RET0);
+	switch (size) {
+		case 4:
+			EMIT(st, 0x8b, 0x87);		/* mov eax, [rdi + k] */
+			emit_u32(st, k);
+			EMIT(st, 0x0f, 0xc8);		/* bswap eax */
+			break;
+		case 2:
+			EMIT(st, 0x0f, 0xb7, 0x87);	/* movzx eax, word [rdi + k] */
+			emit_u32(st, k);
+			EMIT(st, 0x66, 0xc1, 0xc0, 0x08); /* rol ax, 8 */
+			break;
+		case 1:
+			EMIT(st, 0x0f, 0xb6, 0x87);	/* movzx eax, byte [rdi + k] */
+			emit_u32(st, k);
+			break;
+	}
+}
+
+/*
+ * Packet load at X + k, computed in 64 bits so that it cannot wrap
+ */
+static void
+emit_load_ind(struct jit_state *st, u_int size, uint32_t k)
+{
+	EMIT(st, 0x41, 0x89, 0xca);		/* mov r10d, ecx */
+	EMIT(st, 0x41, 0xbb);			/* mov r11d, k */
+	emit_u32(st, k);
+	EMIT(st, 0x4d, 0x01, 0xda);		/* add r10, r11 */
+	EMIT(st, 0x4d, 0x8d, 0x5a);		/* lea r11, [r10 + size] */
+	emit_u8(st, size);
+	EMIT(st, 0x4d, 0x39, 0xc3);		/* cmp r11, r8 */
+	emit_jcc(st, CC_A, JIT_TARGET_RET0);
+	switch (size) {
+		case 4:
+			EMIT(st, 0x42, 0x8b, 0x04, 0x17);	/* mov eax, [rdi + r10] */
+			EMIT(st, 0x0f, 0xc8);			/* bswap eax */
+			break;
+		case 2:
+			EMIT(st, 0x42, 0x0f, 0xb7, 0x04, 0x17); /* movzx eax, word [rdi + r10] */
+			EMIT(st, 0x66, 0xc1, 0xc0, 0x08);	/* rol ax, 8 */
+			break;
+		case 1:
+			EMIT(st, 0x42, 0x0f, 0xb6, 0x04, 0x17); /* movzx eax, byte [rdi + r10] */
+			break;
+	}
+}
+
+static int
+jit_translate(struct jit_state *st, const struct bpf_insn *insns, int n)
+{
+	int pc;
+
+	EMIT(st, 0x48, 0x83, 0xec, JIT_FRAME_SIZE);	/* sub rsp, frame */
+	EMIT(st, 0x41, 0x89, 0xd0);			/* mov r8d, edx */
+	EMIT(st, 0x31, 0xc0);				/* xor eax, eax */
+	EMIT(st, 0x31, 0xc9);				/* xor ecx, ecx */
+
+	for (pc = 0; pc < n; pc++) {
+		const struct bpf_insn *p = &insns[pc];
+		uint32_t k = p->k;
+		int jt = pc + 1 + p->jt;
+		int jf = pc + 1 + p->jf;
+		u_int size;
+
+		st->addrs[pc] = st->len;
+
+		switch (BPF_CLASS(p->code)) {
+		case BPF_LD:
+		case BPF_LDX:
+			switch (BPF_SIZE(p->code)) {
+				case BPF_W: size = 4; break;
+				case BPF_H: size = 2; break;
+				case BPF_B: size = 1; break;
+				default: return (-1);
+			}
+			break;
+		default:
+			size = 0;
+			break;
+		}
+
+		switch (p->code) {
+		case BPF_LD|BPF_W|BPF_ABS:
+		case BPF_LD|BPF_H|BPF_ABS:
+		case BPF_LD|BPF_B|BPF_ABS:
+			emit_load_abs(st, size, k);
+			break;
+		case BPF_LD|BPF_W|BPF_IND:
+		case BPF_LD|BPF_H|BPF_IND:
+		case BPF_LD|BPF_B|BPF_IND:
+			emit_load_ind(st, size, k);
+			break;
+		case BPF_LD|BPF_W|BPF_LEN:
+			EMIT(st, 0x89, 0xf0);		/* mov eax, esi */
+			break;
+		case BPF_LDX|BPF_W|BPF_LEN:
+			EMIT(st, 0x89, 0xf1);		/* mov ecx, esi */
+			break;
+		case BPF_LD|BPF_IMM:
+			EMIT(st, 0xb8);			/* mov eax, k */
+			emit_u32(st, k);
+			break;
+		case BPF_LDX|BPF_IMM:
+			EMIT(st, 0xb9);			/* mov ecx, k */
+			emit_u32(st, k);
+			break;
+		case BPF_LD|BPF_MEM:
+			if (k >= BPF_MEMWORDS)
+				return (-1);
+			EMIT(st, 0x8b, 0x44, 0x24);	/* mov eax, [rsp + 4k] */
+			emit_u8(st, k * 4);
+			break;
+		case BPF_LDX|BPF_MEM:
+			if (k >= BPF_MEMWORDS)
+				return (-1);
+			EMIT(st, 0x8b, 0x4c, 0x24);	/* mov ecx, [rsp + 4k] */
+			emit_u8(st, k * 4);
+			break;
+		case BPF_LDX|BPF_MSH|BPF_B:
+			if (k > 0x7ffffffe) {
+				emit_jmp(st, JIT_TARGET_RET0);
+				break;
+			}
+			EMIT(st, 0x41, 0x81, 0xf8);	/* cmp r8d, k + 1 */
+			emit_u32(st, k + 1);
+			emit_jcc(st, CC_B, JIT_TARGET_RET0);
+			EMIT(st, 0x0f, 0xb6, 0x8f);	/* movzx ecx, byte [rdi + k] */
+			emit_u32(st, k);
+			EMIT(st, 0x83, 0xe1, 0x0f);	/* and ecx, 0xf */
+			EMIT(st, 0xc1, 0xe1, 0x02);	/* shl ecx, 2 */
+			break;
+		case BPF_ST:
+			if (k >= BPF_MEMWORDS)
+				return (-1);
+			EMIT(st, 0x89, 0x44, 0x24);	/* mov [rsp + 4k], eax */
+			emit_u8(st, k * 4);
+			break;
+		case BPF_STX:
+			if (k >= BPF_MEMWORDS)
+				return (-1);
+			EMIT(st, 0x89, 0x4c, 0x24);	/* mov [rsp + 4k], ecx */
+			emit_u8(st, k * 4);
+			break;
+
+		case BPF_ALU|BPF_ADD|BPF_K:
+			EMIT(st, 0x05);			/* add eax, k */
+			emit_u32(st, k);
+			break;
+		case BPF_ALU|BPF_SUB|BPF_K:
+			EMIT(st, 0x2d);			/* sub eax, k */
+			emit_u32(st, k);
+			break;
+		case BPF_ALU|BPF_MUL|BPF_K:
+			EMIT(st, 0x69, 0xc0);		/* imul eax, eax, k */
+			emit_u32(st, k);
+			break;
+		case BPF_ALU|BPF_DIV|BPF_K:
+#ifdef BPF_MOD
+		case BPF_ALU|BPF_MOD|BPF_K:
+#endif
+			if (k == 0) {
+				emit_jmp(st, JIT_TARGET_RET0);
+				break;
+			}
+			EMIT(st, 0x31, 0xd2);		/* xor edx, edx */
+			EMIT(st, 0x41, 0xba);		/* mov r10d, k */
+			emit_u32(st, k);
+			EMIT(st, 0x41, 0xf7, 0xf2);	/* div r10d */
+#ifdef BPF_MOD
+			if (BPF_OP(p->code) == BPF_MOD)
+				EMIT(st, 0x89, 0xd0);	/* mov eax, edx */
+#endif
+			break;
+		case BPF_ALU|BPF_AND|BPF_K:
+			EMIT(st, 0x25);			/* and eax, k */
+			emit_u32(st, k);
+			break;
+		case BPF_ALU|BPF_OR|BPF_K:
+			EMIT(st, 0x0d);			/* or eax, k */
+			emit_u32(st, k);
+			break;
+#ifdef BPF_XOR
+		case BPF_ALU|BPF_XOR|BPF_K:
+			EMIT(st, 0x35);			/* xor eax, k */
+			emit_u32(st, k);
+			break;
+#endif
+		case BPF_ALU|BPF_LSH|BPF_K:
+			EMIT(st, 0xc1, 0xe0);		/* shl eax, k */
+			emit_u8(st, k);
+			break;
+		case BPF_ALU|BPF_RSH|BPF_K:
+			EMIT(st, 0xc1, 0xe8);		/* shr eax, k */
+			emit_u8(st, k);
+			break;
+		case BPF_ALU|BPF_NEG:
+			EMIT(st, 0xf7, 0xd8);		/* neg eax */
+			break;
+		case BPF_ALU|BPF_ADD|BPF_X:
+			EMIT(st, 0x01, 0xc8);		/* add eax, ecx */
+			break;
+		case BPF_ALU|BPF_SUB|BPF_X:
+			EMIT(st, 0x29, 0xc8);		/* sub eax, ecx */
+			break;
+		case BPF_ALU|BPF_MUL|BPF_X:
+			EMIT(st, 0x0f, 0xaf, 0xc1);	/* imul eax, ecx */
+			break;
+		case BPF_ALU|BPF_DIV|BPF_X:
+#ifdef BPF_MOD
+		case BPF_ALU|BPF_MOD|BPF_X:
+#endif
+			EMIT(st, 0x85, 0xc9);		/* test ecx, ecx */
+			emit_jcc(st, CC_E, JIT_TARGET_RET0);
+			EMIT(st, 0x31, 0xd2);		/* xor edx, edx */
+			EMIT(st, 0xf7, 0xf1);		/* div ecx */
+#ifdef BPF_MOD
+			if (BPF_OP(p->code) == BPF_MOD)
+				EMIT(st, 0x89, 0xd0);	/* mov eax, edx */
+#endif
+			break;
+		case BPF_ALU|BPF_AND|BPF_X:
+			EMIT(st, 0x21, 0xc8);		/* and eax, ecx */
+			break;
+		case BPF_ALU|BPF_OR|BPF_X:
+			EMIT(st, 0x09, 0xc8);		/* or eax, ecx */
+			break;
+#ifdef BPF_XOR
+		case BPF_ALU|BPF_XOR|BPF_X:
+			EMIT(st, 0x31, 0xc8);		/* xor eax, ecx */
+			break;
+#endif
+		case BPF_ALU|BPF_LSH|BPF_X:
+			EMIT(st, 0xd3, 0xe0);		/* shl eax, cl */
+			break;
+		case BPF_ALU|BPF_RSH|BPF_X:
+			EMIT(st, 0xd3, 0xe8);		/* shr eax, cl */
+			break;
+
+		case BPF_JMP|BPF_JA:
+			if (k >= (uint32_t)(n - pc - 1))
+				return (-1);
+			if (k != 0)
+				emit_jmp(st, pc + 1 + (int)k);
+			break;
+		case BPF_JMP|BPF_JEQ|BPF_K:
+		case BPF_JMP|BPF_JGT|BPF_K:
+		case BPF_JMP|BPF_JGE|BPF_K:
+		case BPF_JMP|BPF_JSET|BPF_K:
+		case BPF_JMP|BPF_JEQ|BPF_X:
+		case BPF_JMP|BPF_JGT|BPF_X:
+		case BPF_JMP|BPF_JGE|BPF_X:
+		case BPF_JMP|BPF_JSET|BPF_X:
+			if (jt >= n || jf >= n)
+				return (-1);
+			if (BPF_OP(p->code) == BPF_JSET) {
+				if (BPF_SRC(p->code) == BPF_K) {
+					EMIT(st, 0xa9);		/* test eax, k */
+					emit_u32(st, k);
+				} else
+					EMIT(st, 0x85, 0xc8);	/* test eax, ecx */
+			} else {
+				if (BPF_SRC(p->code) == BPF_K) {
+					EMIT(st, 0x3d);		/* cmp eax, k */
+					emit_u32(st, k);
+				} else
+					EMIT(st, 0x39, 0xc8);	/* cmp eax, ecx */
+			}
+			switch (BPF_OP(p->code)) {
+				case BPF_JEQ:
+					emit_cond(st, CC_E, CC_NE, pc, jt, jf);
+					break;
+				case BPF_JGT:
+					emit_cond(st, CC_A, CC_BE, pc, jt, jf);
+					break;
+				case BPF_JGE:
+					emit_cond(st, CC_AE, CC_B, pc, jt, jf);
+					break;
+				case BPF_JSET:
+					emit_cond(st, CC_NE, CC_E, pc, jt, jf);
+					break;
+			}
+			break;
+
+		case BPF_RET|BPF_K:
+			EMIT(st, 0xb8);			/* mov eax, k */
+			emit_u32(st, k);
+			emit_jmp(st, JIT_TARGET_EXIT);
+			break;
+		case BPF_RET|BPF_A:
+			emit_jmp(st, JIT_TARGET_EXIT);
+			break;
+
+		case BPF_MISC|BPF_TAX:
+			EMIT(st, 0x89, 0xc1);		/* mov ecx, eax */
+			break;
+		case BPF_MISC|BPF_TXA:
+			EMIT(st, 0x89, 0xc8);		/* mov eax, ecx */
+			break;
+
+		default:
+			return (-1);
+		}
+	}
+	/*
+	 * Like bpf_validate(), require the program to end with a return
+	 */
+	if (n == 0 || BPF_CLASS(insns[n - 1].code) != BPF_RET)
+		return (-1);
+
+	return (0);
+}
+
+static void *
+jit_x86_64(const struct bpf_insn *insns, int n, size_t *code_size)
+{
+	struct jit_state st;
+	size_t ret0, exit_off;
+	u_int i;
+	void *code = NULL;
+
+	memset(&st, 0, sizeof(st));
+	st.addrs = calloc(n + 1, sizeof(size_t));
+	if (st.addrs == NULL)
+		return (NULL);
+
+	if (jit_translate(&st, insns, n) != 0)
+		goto done;
+
+	ret0 = st.len;
+	EMIT(&st, 0x31, 0xc0);				/* xor eax, eax */
+	exit_off = st.len;
+	EMIT(&st, 0x48, 0x83, 0xc4, JIT_FRAME_SIZE);	/* add rsp, frame */
+	EMIT(&st, 0xc3);				/* ret */
+	if (st.failed)
+		goto done;
+
+	for (i = 0; i < st.num_fixups; i++) {
+		struct jit_fixup *fx = &st.fixups[i];
+		size_t target;
+		int32_t rel;
+
+		if (fx->target == JIT_TARGET_RET0)
+			target = ret0;
+		else if (fx->target == JIT_TARGET_EXIT)
+			target = exit_off;
+		else
+			target = st.addrs[fx->target];
+		rel = (int32_t)(target - (fx->offset + 4));
+		memcpy(st.buf + fx->offset, &rel, 4);
+	}
+
+	code = mmap(NULL, st.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (code == MAP_FAILED) {
+		code = NULL;
+		goto done;
+	}
+	memcpy(code, st.buf, st.len);
+	if (mprotect(code, st.len, PROT_READ | PROT_EXEC) != 0) {
+		munmap(code, st.len);
+		code = NULL;
+		goto done;
+	}
+	*code_size = st.len;
+done:
+	free(st.buf);
+	free(st.fixups);
+	free(st.addrs);
+	return (code);
+}
+
+#endif /* __x86_64__ */
+
+bpf_jit_filter_t *
+bpf_jit_compile(const struct bpf_program *prog)
+{
+	struct bpf_jit_filter *filter;
+
+	filter = calloc(1, sizeof(struct bpf_jit_filter));
+	if (filter == NULL)
+		return (NULL);
+	filter->insns = calloc(prog->bf_len + 1, sizeof(struct bpf_insn));
+	if (filter->insns == NULL) {
+		free(filter);
+		return (NULL);
+	}
+	if (prog->bf_len == 0) {
+		/* bpf_filter() accepts everything when there is no program */
+		filter->insns[0].code = BPF_RET|BPF_K;
+		filter->insns[0].k = (u_int)-1;
+	} else
+		memcpy(filter->insns, prog->bf_insns, prog->bf_len * sizeof(struct bpf_insn));
+
+#if defined(__x86_64__)
+	if (getenv("TCPDUMP_NO_BPF_JIT") == NULL) {
+		filter->code = jit_x86_64(prog->bf_insns, prog->bf_len, &filter->code_size);
+		filter->func = (bpf_jit_func_t)filter->code;
+	}
+#endif /* __x86_64__ */
+
+	return (filter);
+}
+
+u_int
+bpf_jit_filter(bpf_jit_filter_t *filter, const u_char *p, u_int wirelen, u_int buflen)
+{
+	if (filter->func != NULL)
+		return (filter->func(p, wirelen, buflen));
+	return (bpf_filter(filter->insns, p, wirelen, buflen));
+}
+
+void
+bpf_jit_free(bpf_jit_filter_t *filter)
+{
+	if (filter == NULL)
+		return;
+	if (filter->code != NULL)
+		munmap(filter->code, filter->code_size);
+	free(filter->insns);
+	free(filter);
+}
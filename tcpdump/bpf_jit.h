@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef tcpdump_bpf_jit_h
+#define tcpdump_bpf_jit_h
+
+struct bpf_jit_filter;
+typedef struct bpf_jit_filter bpf_jit_filter_t;
+
+/*
+ * Compile a BPF program to native code. When the architecture is not
+ * supported or the program cannot be translated the returned filter
+ * runs the libpcap interpreter instead. Returns NULL when out of memory.
+ */
+bpf_jit_filter_t * bpf_jit_compile(const struct bpf_program *);
+
+/*
+ * Same return value as bpf_filter(): zero if the packet doesn't match,
+ * the number of bytes to keep otherwise
+ */
+u_int bpf_jit_filter(bpf_jit_filter_t *, const u_char *, u_int, u_int);
+
+void bpf_jit_free(bpf_jit_filter_t *);
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <tcpdump-stdinc.h>
+
+#include <stdlib.h>
+
+#include "bufpool.h"
+
+static u_int
+bufpool_class(u_int size)
+{
+	u_int c;
+
+	for (c = 0; (1U << (c + BUFPOOL_MINSHIFT)) < size; c++)
+		continue;
+	return (c);
+}
+
+u_int
+bufpool_size(u_int size)
+{
+	return (1U << (bufpool_class(size) + BUFPOOL_MINSHIFT));
+}
+
+void *
+bufpool_get(struct buf_pool *pool, u_int size, u_int limit)
+{
+	u_int c = bufpool_class(size);
+	u_int csize = 1U << (c + BUFPOOL_MINSHIFT);
+	void *p;
+
+	if (c >= BUFPOOL_NCLASS || pool->inuse + csize > limit)
+		return (NULL);
+	if ((p = pool->free[c]) != NULL) {
+		pool->free[c] = *(void **)p;
+		pool->nfree[c]--;
+	} else if ((p = malloc(csize)) == NULL)
+		return (NULL);
+	pool->inuse += csize;
+	return (p);
+}
+
+void
+bufpool_put(struct buf_pool *pool, void *p, u_int size)
+{
+	u_int c = bufpool_class(size);
+
+	pool->inuse -= 1U << (c + BUFPOOL_MINSHIFT);
+	if (pool->nfree[c] < BUFPOOL_KEEP) {
+		*(void **)p = pool->free[c];
+		pool->free[c] = p;
+		pool->nfree[c]++;
+	} else
+		free(p);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef tcpdump_bufpool_h
+#define tcpdump_bufpool_h
+
+/*
+ * Buffers in power of two size classes from 1K to 256K, with a few
+ * free buffers kept per class, for the reassembly code
+ */
+#define BUFPOOL_MINSHIFT	10
+#define BUFPOOL_NCLASS		9
+#define BUFPOOL_MAX		(1U << (BUFPOOL_MINSHIFT + BUFPOOL_NCLASS - 1))
+#define BUFPOOL_KEEP		8
+
+struct buf_pool {
+	u_int	inuse;			/* bytes handed out */
+	void	*free[BUFPOOL_NCLASS];
+	u_int	nfree[BUFPOOL_NCLASS];
+};
+
+/* the size of the buffer bufpool_get() returns for size bytes */
+u_int bufpool_size(u_int);
+
+/*
+ * Returns a buffer of at least size bytes, or NULL if it is larger than
+ * BUFPOOL_MAX or the pool would then hand out more than limit bytes
+ */
+void *bufpool_get(struct buf_pool *, u_int, u_int);
+
+/* size is the one the buffer was asked for */
+void bufpool_put(struct buf_pool *, void *, u_int);
+
+#endif
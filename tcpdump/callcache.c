@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <tcpdump-stdinc.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "callcache.h"
+
+/*
+ * The table doubles when there are more entries than buckets, so the
+ * chains stay short without a limit on the number of calls
+ */
+#define CALLCACHE_MINHASH	256
+
+u_int32_t
+callcache_hashfn(u_int32_t id, const void *client, const void *server,
+		 size_t alen)
+{
+	const u_char *c = client, *s = server;
+	u_int32_t h = id * 2654435761U;
+	size_t i;
+
+	for (i = 0; i < alen; i++)
+		h = (h ^ c[i] ^ (s[i] << 8)) * 16777619U;
+	return (h ^ (h >> 15));
+}
+
+struct callcache_entry *
+callcache_chain(const struct callcache *cc, u_int32_t hash)
+{
+	if (cc->hashsize == 0)
+		return (NULL);
+	return (cc->hash[hash & (cc->hashsize - 1)]);
+}
+
+void
+callcache_append(struct callcache_entry *list, struct callcache_entry *ce)
+{
+	ce->prev = list->prev;
+	ce->next = list;
+	list->prev->next = ce;
+	list->prev = ce;
+}
+
+void
+callcache_unlink(struct callcache_entry *ce)
+{
+	ce->prev->next = ce->next;
+	ce->next->prev = ce->prev;
+}
+
+void
+callcache_remove(struct callcache *cc, struct callcache_entry *ce)
+{
+	struct callcache_entry **pp;
+
+	for (pp = &cc->hash[ce->hash & (cc->hashsize - 1)]; *pp != ce;
+	     pp = &(*pp)->hnext)
+		continue;
+	*pp = ce->hnext;
+	callcache_unlink(ce);
+	ce->hnext = cc->free;
+	cc->free = ce;
+	cc->count--;
+}
+
+static void
+callcache_grow(struct callcache *cc)
+{
+	struct callcache_entry **nhash, *ce;
+	u_int nsize, i;
+
+	nsize = cc->hashsize != 0 ? cc->hashsize * 2 : CALLCACHE_MINHASH;
+	nhash = calloc(nsize, sizeof(*nhash));
+	if (nhash == NULL)
+		return;		/* the chains get longer instead */
+	for (i = 0; i < cc->hashsize; i++) {
+		while ((ce = cc->hash[i]) != NULL) {
+			cc->hash[i] = ce->hnext;
+			ce->hnext = nhash[ce->hash & (nsize - 1)];
+			nhash[ce->hash & (nsize - 1)] = ce;
+		}
+	}
+	free(cc->hash);
+	cc->hash = nhash;
+	cc->hashsize = nsize;
+}
+
+struct callcache_entry *
+callcache_enter(struct callcache *cc, u_int32_t hash)
+{
+	struct callcache_entry *ce;
+
+	if (cc->count >= cc->hashsize)
+		callcache_grow(cc);
+	if (cc->hashsize == 0)
+		return (NULL);
+	if ((ce = cc->free) != NULL)
+		cc->free = ce->hnext;
+	else if ((ce = malloc(cc->entsize)) == NULL)
+		return (NULL);
+	memset(ce, 0, cc->entsize);
+	ce->hash = hash;
+	ce->hnext = cc->hash[hash & (cc->hashsize - 1)];
+	cc->hash[hash & (cc->hashsize - 1)] = ce;
+	cc->count++;
+	return (ce);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef tcpdump_callcache_h
+#define tcpdump_callcache_h
+
+/*
+ * Calls waiting for their replies, for the RPC printers that need the
+ * call to decode the reply.  A printer's entries start with a struct
+ * callcache_entry and it compares the rest of its key itself, on the
+ * hash chain of the key's hash.  The printer also keeps the entries on
+ * its own lists, oldest first, to expire and evict them.
+ */
+struct callcache_entry {
+	struct callcache_entry *hnext;	/* hash chain */
+	struct callcache_entry *prev;	/* on one of the printer's lists */
+	struct callcache_entry *next;
+	u_int32_t	hash;
+};
+
+struct callcache {
+	struct callcache_entry **hash;
+	u_int		hashsize;
+	u_int		count;
+	size_t		entsize;	/* size of the printer's entries */
+	struct callcache_entry *free;
+};
+
+#define CALLCACHE_INIT(type)	{ NULL, 0, 0, sizeof(type), NULL }
+#define CALLCACHE_LIST_INIT(list) { NULL, &(list), &(list) }
+
+/* hash of a transaction ID and the client and server addresses */
+u_int32_t callcache_hashfn(u_int32_t, const void *, const void *, size_t);
+
+/* the first entry on the hash chain of hash, or NULL */
+struct callcache_entry *callcache_chain(const struct callcache *, u_int32_t);
+
+/*
+ * Returns a zeroed entry on the hash chain of hash and on none of the
+ * lists, or NULL if out of memory
+ */
+struct callcache_entry *callcache_enter(struct callcache *, u_int32_t);
+
+/* takes the entry off its hash chain and list and frees it */
+void callcache_remove(struct callcache *, struct callcache_entry *);
+
+void callcache_append(struct callcache_entry *, struct callcache_entry *);
+void callcache_unlink(struct callcache_entry *);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <tcpdump-stdinc.h>
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hdlc.h"
+
+/*
+ * Undo the HDLC byte stuffing of the data from s to ep into t, return
+ * the end of the unescaped data.  An escape byte with nothing after it
+ * is dropped.
+ *
+ * Escapes are rare in most traffic, so the data between them is copied
+ * in bulk: with SSE2, 16 bytes at a time up to the next escape (t never
+ * gets ahead of s, so a buffer as long as the input always has room for
+ * a whole block), otherwise with memchr() and memcpy() once 8 bytes in
+ * a row needed no escaping.  Where escapes are dense, as in compressed
+ * or encrypted data sent over an async map that escapes control bytes,
+ * a test on each byte mispredicts often; the bytes are done there
+ * without a branch on the escape, which also stores a byte it does not
+ * keep at t.
+ */
+u_char *
+ppp_hdlc_unescape(u_char *t, const u_char *s, const u_char *ep)
+{
+	const u_char *q;
+	u_int c, esc, pending, run;
+#ifdef __SSE2__
+	const __m128i escv = _mm_set1_epi8(0x7d);
+	const u_char *lim;
+	__m128i v;
+	int mask, n;
+
+	while (ep - s >= 16) {
+		v = _mm_loadu_si128((const __m128i *)s);
+		_mm_storeu_si128((__m128i *)t, v);
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, escv));
+		if (mask == 0) {
+			s += 16;
+			t += 16;
+		} else if ((mask & (mask - 1)) == 0) {
+			n = __builtin_ctz(mask);
+			s += n;
+			t += n;
+			if (ep - s < 2)
+				return (t);
+			*t++ = s[1] ^ 0x20;
+			s += 2;
+		} else {
+			for (pending = 0, lim = s + 16; s < lim; ) {
+				c = *s++;
+				esc = (c == 0x7d) & (pending ^ 1);
+				*t = c ^ (pending << 5);
+				t += esc ^ 1;
+				pending = esc;
+			}
+			if (pending) {
+				if (s == ep)
+					return (t);
+				*t++ = *s++ ^ 0x20;
+			}
+		}
+	}
+#endif /* __SSE2__ */
+	for (pending = 0, run = 0; s < ep; ) {
+		c = *s++;
+		esc = (c == 0x7d) & (pending ^ 1);
+		*t = c ^ (pending << 5);
+		t += esc ^ 1;
+		pending = esc;
+		run = (run + 1) & (esc - 1);
+		if (run == 8) {
+			q = memchr(s, 0x7d, ep - s);
+			if (q == NULL)
+				q = ep;
+			memcpy(t, s, q - s);
+			t += q - s;
+			s = q;
+			run = 0;
+		}
+	}
+	return (t);
+}
@@ -176,6 +176,7 @@ extern void hex_and_ascii_print_with_offset(const char *, const u_char *,
 extern void hex_and_ascii_print(const char *, const u_char *, u_int);
 extern void hex_print_with_offset(const char *, const u_char *, u_int, u_int);
 extern void hex_print(const char *, const u_char *, u_int);
+extern const char hex_pairs[];
 extern void telnet_print(const u_char *, u_int);
 extern int llc_print(const u_char *, u_int, u_int, const u_char *,
 	const u_char *, u_short *);
@@ -228,7 +229,12 @@ extern u_int ltalk_if_print(const struct pcap_pkthdr *, const u_char *);
 extern void msdp_print(const unsigned char *, u_int);
 extern void nfsreply_print(const u_char *, u_int, const u_char *);
 extern void nfsreq_print(const u_char *, u_int, const u_char *);
+extern int nfs_stats;
+extern void nfs_stats_report(void);
 extern void ns_print(const u_char *, u_int, int);
+extern u_int dns_stats_interval;
+extern void dns_analyze(const u_char *, u_int);
+extern void dns_stats_report(int);
 extern const u_char * ns_nprint (register const u_char *, register const u_char *);
 extern void ntp_print(const u_char *, u_int);
 extern u_int null_if_print(const struct pcap_pkthdr *, const u_char *);
@@ -286,6 +292,11 @@ extern void snmp_print(const u_char *, u_int);
 extern void sunrpcrequest_print(const u_char *, u_int, const u_char *);
 extern u_int symantec_if_print(const struct pcap_pkthdr *, const u_char *);
 extern void tcp_print(const u_char *, u_int, const u_char *, int);
+extern void tcp_set_state_limit(u_int);
+extern void tcp_state_stats(u_int *, u_long *);
+extern void tcp_analyze(const u_char *, u_int);
+extern void tcp_flow_report_all(int);
+extern void tcp_signature_report(void);
 extern void tftp_print(const u_char *, u_int);
 extern void timed_print(const u_char *);
 extern void udld_print(const u_char *, u_int);
@@ -295,6 +306,7 @@ extern void wb_print(const void *, u_int);
 extern int ah_print(register const u_char *);
 extern int ipcomp_print(register const u_char *, int *);
 extern void rx_print(register const u_char *, int, int, int, u_char *);
+extern void rx_cache_stats(u_int *, u_long *);
 extern void netbeui_print(u_short, const u_char *, int);
 extern void ipx_netbios_print(const u_char *, u_int);
 extern void nbt_tcp_print(const u_char *, int);
@@ -340,6 +352,10 @@ extern void ip6_opt_print(const u_char *, int);
 extern int hbhopt_print(const u_char *);
 extern int dstopt_print(const u_char *);
 extern int frag6_print(const u_char *, const u_char *);
+#ifdef __APPLE__
+struct ip_reasm_done;
+extern int frag6_reasm(const u_char *, const u_char *, struct ip_reasm_done *);
+#endif
 extern int mobility_print(const u_char *, const u_char *);
 extern void ripng_print(const u_char *, unsigned int);
 extern int rt6_print(const u_char *, const u_char *);
@@ -423,6 +439,7 @@ extern netdissect_options *gndo;
 #define Hflag gndo->ndo_Hflag
 //#define snaplen     gndo->ndo_snaplen
 #define snapend     gndo->ndo_snapend
+#define pkt_ts      gndo->ndo_pkt_ts
 
 #endif /* NETDISSECT_REWORKED */
 
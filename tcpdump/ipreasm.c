@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * IP fragment reassembly for --ip-defrag
+ *
+ * Datagrams being put back together are hashed on their key and kept on
+ * a list in the order they were last added to. Those that have not seen
+ * a fragment in IPR_TIMEOUT seconds of packet time are given up on, and
+ * so are the oldest ones when there are more than IPR_MAX of them or
+ * when the buffers would take more than ip_reasm_limit bytes.
+ *
+ * The bytes received are kept as a short list of ranges. Fragments may
+ * come in any order and overlap; the data of the last one wins and the
+ * overlap is counted. The headers of the first fragment are kept in front
+ * of the data, so that the datagram ends up in one piece like a packet.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <tcpdump-stdinc.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bufpool.h"
+#include "ipreasm.h"
+
+#define IPR_TIMEOUT		30
+#define IPR_MAX			4096
+#define IPR_HASHSIZE		1024
+#define IPR_NRANGE		16
+#define IPR_KEEP		64
+#define IPR_DGMAX		65535
+
+struct ipr_range {
+	u_int		start;
+	u_int		end;
+};
+
+struct ipr_dg {
+	struct ipr_dg	*hnext;
+	struct ipr_dg	*prev;		/* on ipr_lru, oldest first */
+	struct ipr_dg	*next;
+	struct ip_reasm_key key;
+	u_int		hash;
+	time_t		last;
+	u_char		*buf;
+	u_int		size;
+	u_int		total;		/* 0 until the last fragment is seen */
+	u_int		nrange;
+	struct ipr_range range[IPR_NRANGE];
+	u_int		hdrlen;
+};
+
+u_int ip_reasm_limit;
+
+static struct buf_pool ipr_pool;
+static struct ipr_dg *ipr_hash[IPR_HASHSIZE];
+static struct ipr_dg ipr_lru = { NULL, &ipr_lru, &ipr_lru };
+static struct ipr_dg *ipr_free;
+static u_int ipr_count, ipr_nfree;
+static u_long ipr_complete, ipr_incomplete, ipr_overlaps;
+
+static u_int
+ipr_hashfn(const struct ip_reasm_key *key)
+{
+	u_int alen = key->family == 6 ? 16 : 4;
+	u_int h = 2166136261U;
+	u_int i;
+
+	for (i = 0; i < alen; i++)
+		h = (h ^ key->src[i]) * 16777619U;
+	for (i = 0; i < alen; i++)
+		h = (h ^ key->dst[i]) * 16777619U;
+	h = (h ^ key->id) * 16777619U;
+	h = (h ^ key->proto) * 16777619U;
+	return (h ^ (h >> 16));
+}
+
+static int
+ipr_match(const struct ip_reasm_key *a, const struct ip_reasm_key *b)
+{
+	u_int alen = a->family == 6 ? 16 : 4;
+
+	return (a->id == b->id && a->proto == b->proto &&
+	    a->family == b->family && memcmp(a->src, b->src, alen) == 0 &&
+	    memcmp(a->dst, b->dst, alen) == 0);
+}
+
+static void
+ipr_unlink(struct ipr_dg *dg)
+{
+	struct ipr_dg **pp;
+
+	for (pp = &ipr_hash[dg->hash % IPR_HASHSIZE]; *pp != dg;
+	    pp = &(*pp)->hnext)
+		continue;
+	*pp = dg->hnext;
+	dg->prev->next = dg->next;
+	dg->next->prev = dg->prev;
+	ipr_count--;
+}
+
+static void
+ipr_put(struct ipr_dg *dg)
+{
+	if (dg->buf != NULL)
+		bufpool_put(&ipr_pool, dg->buf, dg->size);
+	if (ipr_nfree < IPR_KEEP) {
+		dg->hnext = ipr_free;
+		ipr_free = dg;
+		ipr_nfree++;
+	} else
+		free(dg);
+}
+
+static void
+ipr_drop(struct ipr_dg *dg)
+{
+	ipr_unlink(dg);
+	ipr_put(dg);
+	ipr_incomplete++;
+}
+
+static int
+ipr_fail(struct ipr_dg *dg)
+{
+	ipr_drop(dg);
+	return (-1);
+}
+
+static struct ipr_dg *
+ipr_lookup(const struct ip_reasm_key *key, time_t now)
+{
+	u_int h = ipr_hashfn(key);
+	struct ipr_dg *dg;
+
+	for (dg = ipr_hash[h % IPR_HASHSIZE]; dg != NULL; dg = dg->hnext) {
+		if (dg->hash == h && ipr_match(&dg->key, key)) {
+			dg->prev->next = dg->next;
+			dg->next->prev = dg->prev;
+			break;
+		}
+	}
+	if (dg == NULL) {
+		if (ipr_count >= IPR_MAX)
+			ipr_drop(ipr_lru.next);
+		if ((dg = ipr_free) != NULL) {
+			ipr_free = dg->hnext;
+			ipr_nfree--;
+		} else if ((dg = malloc(sizeof(*dg))) == NULL)
+			return (NULL);
+		dg->key = *key;
+		dg->hash = h;
+		dg->buf = NULL;
+		dg->size = 0;
+		dg->total = 0;
+		dg->nrange = 0;
+		dg->hdrlen = 0;
+		dg->hnext = ipr_hash[h % IPR_HASHSIZE];
+		ipr_hash[h % IPR_HASHSIZE] = dg;
+		ipr_count++;
+	}
+	dg->last = now;
+	dg->prev = ipr_lru.prev;
+	dg->next = &ipr_lru;
+	ipr_lru.prev->next = dg;
+	ipr_lru.prev = dg;
+	return (dg);
+}
+
+/*
+ * Make room for end bytes of data, giving up on the oldest other datagrams
+ * when over the limit
+ */
+static int
+ipr_grow(struct ipr_dg *dg, u_int end)
+{
+	u_char *nbuf;
+
+	end += IP_REASM_HDRMAX;
+	if (end <= dg->size)
+		return (0);
+	while ((nbuf = bufpool_get(&ipr_pool, end, ip_reasm_limit)) == NULL) {
+		if (ipr_lru.next == dg)
+			return (-1);
+		ipr_drop(ipr_lru.next);
+	}
+	if (dg->buf != NULL) {
+		memcpy(nbuf, dg->buf, dg->size);
+		bufpool_put(&ipr_pool, dg->buf, dg->size);
+	}
+	dg->buf = nbuf;
+	dg->size = bufpool_size(end);
+	return (0);
+}
+
+/*
+ * Merge [start, end) into the sorted ranges, returns 1 if it overlaps
+ * data already received and -1 when there are too many holes
+ */
+static int
+ipr_range_add(struct ipr_dg *dg, u_int start, u_int end)
+{
+	struct ipr_range *r = dg->range;
+	u_int i, j, overlap = 0;
+
+	for (i = 0; i < dg->nrange && r[i].end < start; i++)
+		continue;
+	for (j = i; j < dg->nrange && r[j].start <= end; j++) {
+		if (r[j].start < end && r[j].end > start)
+			overlap = 1;
+		if (r[j].start < start)
+			start = r[j].start;
+		if (r[j].end > end)
+			end = r[j].end;
+	}
+	/* ranges i to j - 1 are replaced by the merged one */
+	if (i == j) {
+		if (dg->nrange == IPR_NRANGE)
+			return (-1);
+		memmove(&r[i + 1], &r[i], (dg->nrange - i) * sizeof(*r));
+		dg->nrange++;
+	} else if (j > i + 1) {
+		memmove(&r[i + 1], &r[j], (dg->nrange - j) * sizeof(*r));
+		dg->nrange -= j - i - 1;
+	}
+	r[i].start = start;
+	r[i].end = end;
+	return (overlap);
+}
+
+int
+ip_reasm_add(const struct ip_reasm_key *key, time_t now, u_int off,
+    const u_char *data, u_int len, int more, const u_char *hdr, u_int hdrlen,
+    struct ip_reasm_done *done)
+{
+	struct ipr_dg *dg;
+	u_int end = off + len;
+	int overlap;
+
+	if (end > IPR_DGMAX || (more && (len == 0 || (len & 7) != 0)))
+		return (-1);
+
+	while (ipr_lru.next != &ipr_lru && ipr_lru.next->last + IPR_TIMEOUT < now)
+		ipr_drop(ipr_lru.next);
+
+	if ((dg = ipr_lookup(key, now)) == NULL)
+		return (-1);
+
+	if (!more) {
+		if ((dg->total != 0 && dg->total != end) ||
+		    (dg->nrange != 0 && dg->range[dg->nrange - 1].end > end))
+			return (ipr_fail(dg));
+		dg->total = end;
+	} else if (dg->total != 0 && end > dg->total)
+		return (ipr_fail(dg));
+
+	if (ipr_grow(dg, end) < 0)
+		return (ipr_fail(dg));
+	if (off == 0) {
+		if (hdrlen > IP_REASM_HDRMAX)
+			return (ipr_fail(dg));
+		memcpy(dg->buf + IP_REASM_HDRMAX - hdrlen, hdr, hdrlen);
+		dg->hdrlen = hdrlen;
+	}
+	if (len != 0) {
+		if ((overlap = ipr_range_add(dg, off, end)) < 0)
+			return (ipr_fail(dg));
+		ipr_overlaps += overlap;
+		memcpy(dg->buf + IP_REASM_HDRMAX + off, data, len);
+	}
+
+	if (dg->total == 0 || dg->nrange != 1 || dg->range[0].start != 0 ||
+	    dg->range[0].end != dg->total)
+		return (0);
+
+	ipr_unlink(dg);
+	ipr_complete++;
+	done->hdr = dg->buf + IP_REASM_HDRMAX - dg->hdrlen;
+	done->hdrlen = dg->hdrlen;
+	done->data = dg->buf + IP_REASM_HDRMAX;
+	done->len = dg->total;
+	done->dg = dg;
+	return (1);
+}
+
+void
+ip_reasm_release(struct ip_reasm_done *done)
+{
+	ipr_put(done->dg);
+	done->dg = NULL;
+}
+
+void
+ip_reasm_stats(u_long *complete, u_long *incomplete, u_long *overlaps)
+{
+	*complete = ipr_complete;
+	*incomplete = ipr_incomplete + ipr_count;
+	*overlaps = ipr_overlaps;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef tcpdump_ipreasm_h
+#define tcpdump_ipreasm_h
+
+/*
+ * Fragments of one datagram: both addresses (IPv4 ones in the first
+ * four bytes), the identification and, for IPv4, the protocol
+ */
+struct ip_reasm_key {
+	u_char		src[16];
+	u_char		dst[16];
+	u_int32_t	id;
+	u_char		proto;
+	u_char		family;		/* 4 or 6 */
+};
+
+/*
+ * A datagram put back together, valid until ip_reasm_release(). The
+ * headers of the first fragment come right before the data and may be
+ * changed to describe the whole datagram.
+ */
+struct ip_reasm_done {
+	u_char		*hdr;
+	u_int		hdrlen;
+	const u_char	*data;
+	u_int		len;
+	void		*dg;
+};
+
+#define IP_REASM_LIMIT		(16 * 1024 * 1024)	/* default for --ip-defrag */
+#define IP_REASM_HDRMAX		256
+
+/* bytes that can be buffered for all the datagrams, off when 0 */
+extern u_int ip_reasm_limit;
+
+/*
+ * Add the fragment at offset off to its datagram. hdr is the part of the
+ * packet in front of the fragment, it is only kept from the one at
+ * offset 0. Returns 1 and fills in done when the datagram is complete,
+ * 0 when fragments are still missing, and -1 when the fragment cannot
+ * be kept and should be printed on its own.
+ */
+int ip_reasm_add(const struct ip_reasm_key *, time_t, u_int, const u_char *,
+    u_int, int, const u_char *, u_int, struct ip_reasm_done *);
+void ip_reasm_release(struct ip_reasm_done *);
+
+/* datagrams reassembled, given up on or still waiting, and overlaps */
+void ip_reasm_stats(u_long *, u_long *, u_long *);
+
+#endif
@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Persistent name cache for --name-cache
+ *
+ * The cache file holds an open addressing table of fixed size slots
+ * followed by a heap of NUL terminated names:
+ *
+ *	struct namecache_header
+ *	struct namecache_slot[nc_nslots]
+ *	names
+ *
+ * The file of the previous runs is mapped read-only for lookups, and the
+ * names found during this run are kept in memory. On exit they are merged
+ * with the current content of the file into a new file that replaces it
+ * with rename(2), so a concurrent reader always sees a complete file.
+ * Entries expire, and when the probe sequence of a key is full the entry
+ * closest to expiry is evicted.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <tcpdump-stdinc.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "netdissect.h"
+#include "interface.h"
+#include "namecache.h"
+
+#define NAMECACHE_MAGIC		0x74636e63	/* "tcnc" */
+#define NAMECACHE_VERSION	1
+#define NAMECACHE_SLOTS		65536
+#define NAMECACHE_PROBES	16
+#define NAMECACHE_MAXHEAP	(16 * 1024 * 1024)
+
+struct namecache_header {
+	u_int32_t magic;
+	u_int32_t version;
+	u_int32_t nslots;
+	u_int32_t heapsize;
+};
+
+struct namecache_slot {
+	u_int8_t kind;			/* 0 for an empty slot */
+	u_int8_t keylen;
+	u_int16_t namelen;		/* 0 for a failed lookup */
+	u_int32_t expires;
+	u_int32_t nameoff;
+	u_int32_t pad;
+	u_int8_t key[NC_MAXKEY];
+};
+
+struct namecache_table {
+	struct namecache_header *hdr;
+	struct namecache_slot *slots;
+	char *heap;
+};
+
+struct namecache_entry {
+	u_int8_t kind;
+	u_int8_t keylen;
+	u_int8_t key[NC_MAXKEY];
+	u_int32_t expires;
+	char *name;
+	struct namecache_entry *nxt;
+};
+
+static char *nc_path = NULL;
+static void *nc_map = NULL;
+static size_t nc_mapsize = 0;
+static struct namecache_table nc_table;
+static struct namecache_entry *nc_added = NULL;
+
+static u_int32_t
+nc_hash(int kind, const u_char *key, u_int keylen)
+{
+	u_int32_t h = 2166136261U;
+	u_int i;
+
+	h = (h ^ kind) * 16777619U;
+	for (i = 0; i < keylen; i++)
+		h = (h ^ key[i]) * 16777619U;
+	return (h);
+}
+
+/*
+ * Map a cache file and check that it is consistent, the file may have
+ * been written by another version or be truncated
+ */
+static int
+nc_map_file(const char *path, void **mapp, size_t *sizep,
+	    struct namecache_table *table)
+{
+	struct namecache_header *hdr;
+	struct stat st;
+	size_t size;
+	void *map;
+	u_int32_t i;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (-1);
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return (-1);
+	}
+	size = st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return (-1);
+
+	hdr = map;
+	if (hdr->magic != NAMECACHE_MAGIC || hdr->version != NAMECACHE_VERSION ||
+	    hdr->nslots != NAMECACHE_SLOTS || hdr->heapsize > NAMECACHE_MAXHEAP ||
+	    size != sizeof(*hdr) + hdr->nslots * sizeof(struct namecache_slot) +
+	    hdr->heapsize)
+		goto bad;
+
+	table->hdr = hdr;
+	table->slots = (struct namecache_slot *)(hdr + 1);
+	table->heap = (char *)(table->slots + hdr->nslots);
+	for (i = 0; i < hdr->nslots; i++) {
+		struct namecache_slot *slot = &table->slots[i];
+
+		if (slot->kind == 0)
+			continue;
+		if (slot->kind > NC_STAMP || slot->keylen > NC_MAXKEY)
+			goto bad;
+		if (slot->namelen == 0)
+			continue;	/* failed lookup, there is no name */
+		if (slot->nameoff >= hdr->heapsize ||
+		    slot->namelen >= hdr->heapsize - slot->nameoff ||
+		    table->heap[slot->nameoff + slot->namelen] != '\0')
+			goto bad;
+	}
+	*mapp = map;
+	*sizep = size;
+	return (0);
+
+bad:
+	munmap(map, size);
+	return (-1);
+}
+
+static struct namecache_slot *
+nc_find(struct namecache_table *table, int kind, const u_char *key,
+	u_int keylen)
+{
+	struct namecache_slot *slot;
+	u_int32_t h;
+	int i;
+
+	h = nc_hash(kind, key, keylen);
+	for (i = 0; i < NAMECACHE_PROBES; i++) {
+		slot = &table->slots[(h + i) & (NAMECACHE_SLOTS - 1)];
+		if (slot->kind == 0)
+			return (NULL);
+		if (slot->kind == kind && slot->keylen == keylen &&
+		    memcmp(slot->key, key, keylen) == 0)
+			return (slot);
+	}
+	return (NULL);
+}
+
+static void namecache_save(void);
+
+/*
+ * The file need not exist yet, an unreadable or invalid file is replaced
+ */
+void
+namecache_open(const char *path)
+{
+	if ((nc_path = strdup(path)) == NULL)
+		error("%s: strdup", __func__);
+
+	if (nc_map_file(nc_path, &nc_map, &nc_mapsize, &nc_table) < 0) {
+		if (errno != ENOENT)
+			warning("ignoring name cache %s", nc_path);
+		nc_map = NULL;
+	}
+	atexit(namecache_save);
+}
+
+int
+namecache_is_open(void)
+{
+	return (nc_path != NULL);
+}
+
+int
+namecache_lookup(int kind, const void *key, u_int keylen, const char **name,
+		 time_t *expires)
+{
+	struct namecache_slot *slot;
+
+	if (nc_map == NULL || keylen > NC_MAXKEY)
+		return (0);
+	slot = nc_find(&nc_table, kind, key, keylen);
+	if (slot == NULL || slot->expires <= (u_int32_t)time(NULL))
+		return (0);
+	*name = slot->namelen != 0 ? &nc_table.heap[slot->nameoff] : NULL;
+	if (expires != NULL)
+		*expires = slot->expires;
+	return (1);
+}
+
+void
+namecache_add(int kind, const void *key, u_int keylen, const char *name,
+	      u_int ttl)
+{
+	struct namecache_entry *entry;
+
+	if (nc_path == NULL || keylen > NC_MAXKEY ||
+	    (name != NULL && strlen(name) >= 0xffff))
+		return;
+	if ((entry = calloc(1, sizeof(*entry))) == NULL)
+		return;
+	if (name != NULL && (entry->name = strdup(name)) == NULL) {
+		free(entry);
+		return;
+	}
+	entry->kind = kind;
+	entry->keylen = keylen;
+	memcpy(entry->key, key, keylen);
+	entry->expires = time(NULL) + ttl;
+	entry->nxt = nc_added;
+	nc_added = entry;
+}
+
+void
+namecache_foreach(int kind, void (*func)(const u_char *, u_int, const char *, void *),
+		  void *arg)
+{
+	u_int32_t now = time(NULL);
+	u_int32_t i;
+
+	if (nc_map == NULL)
+		return;
+	for (i = 0; i < NAMECACHE_SLOTS; i++) {
+		struct namecache_slot *slot = &nc_table.slots[i];
+
+		if (slot->kind != kind || slot->expires <= now)
+			continue;
+		(*func)(slot->key, slot->keylen,
+			slot->namelen != 0 ? &nc_table.heap[slot->nameoff] : NULL, arg);
+	}
+}
+
+/*
+ * Table being built for the new cache file
+ */
+struct nc_build {
+	struct namecache_slot *slots;
+	char *heap;
+	u_int32_t heapsize;
+	u_int32_t heapcap;
+};
+
+static void
+nc_insert(struct nc_build *b, int kind, const u_char *key, u_int keylen,
+	  const char *name, u_int32_t expires)
+{
+	struct namecache_slot *slot, *victim = NULL;
+	u_int32_t h, namelen;
+	int i;
+
+	h = nc_hash(kind, key, keylen);
+	for (i = 0; i < NAMECACHE_PROBES; i++) {
+		slot = &b->slots[(h + i) & (NAMECACHE_SLOTS - 1)];
+		if (slot->kind == 0 ||
+		    (slot->kind == kind && slot->keylen == keylen &&
+		     memcmp(slot->key, key, keylen) == 0)) {
+			victim = slot;
+			break;
+		}
+		if (victim == NULL || slot->expires < victim->expires)
+			victim = slot;
+	}
+	/*
+	 * Evicting an entry in the middle of another probe sequence does
+	 * not break it since slots never become empty
+	 */
+	slot = victim;
+	memset(slot, 0, sizeof(*slot));
+	slot->kind = kind;
+	slot->keylen = keylen;
+	memcpy(slot->key, key, keylen);
+	slot->expires = expires;
+	if (name == NULL)
+		return;
+
+	namelen = strlen(name);
+	if (b->heapsize + namelen + 1 > b->heapcap) {
+		u_int32_t cap = b->heapcap ? 2 * b->heapcap : 64 * 1024;
+		char *heap;
+
+		while (b->heapsize + namelen + 1 > cap)
+			cap *= 2;
+		if (cap > NAMECACHE_MAXHEAP ||
+		    (heap = realloc(b->heap, cap)) == NULL) {
+			slot->expires = 0;	/* dropped on the next load */
+			return;
+		}
+		b->heap = heap;
+		b->heapcap = cap;
+	}
+	memcpy(b->heap + b->heapsize, name, namelen + 1);
+	slot->nameoff = b->heapsize;
+	slot->namelen = namelen;
+	b->heapsize += namelen + 1;
+}
+
+static void
+namecache_save(void)
+{
+	struct namecache_header hdr;
+	struct namecache_table cur;
+	struct namecache_entry *entry, *next;
+	struct nc_build b;
+	void *map = NULL;
+	size_t mapsize = 0;
+	u_int32_t now = time(NULL);
+	u_int32_t i;
+	char *tmp;
+	FILE *fp;
+	int fd;
+
+	if (nc_added == NULL)
+		return;
+
+	memset(&b, 0, sizeof(b));
+	b.slots = calloc(NAMECACHE_SLOTS, sizeof(struct namecache_slot));
+	if (b.slots == NULL)
+		return;
+
+	/*
+	 * Another run may have updated the file since it was mapped
+	 */
+	if (nc_map_file(nc_path, &map, &mapsize, &cur) == 0) {
+		for (i = 0; i < NAMECACHE_SLOTS; i++) {
+			struct namecache_slot *slot = &cur.slots[i];
+
+			if (slot->kind == 0 || slot->expires <= now)
+				continue;
+			nc_insert(&b, slot->kind, slot->key, slot->keylen,
+				  slot->namelen != 0 ? &cur.heap[slot->nameoff] : NULL,
+				  slot->expires);
+		}
+		munmap(map, mapsize);
+	}
+	/*
+	 * nc_added has the newest entry first, put the list in the order
+	 * the entries were added so the last one for a key is what stays
+	 */
+	for (entry = nc_added, nc_added = NULL; entry != NULL; entry = next) {
+		next = entry->nxt;
+		entry->nxt = nc_added;
+		nc_added = entry;
+	}
+	for (entry = nc_added; entry != NULL; entry = entry->nxt)
+		nc_insert(&b, entry->kind, entry->key, entry->keylen,
+			  entry->name, entry->expires);
+
+	if (asprintf(&tmp, "%s.XXXXXX", nc_path) < 0)
+		goto done;
+	if ((fd = mkstemp(tmp)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		warning("can't write name cache %s: %s", tmp, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		goto done;
+	}
+	hdr.magic = NAMECACHE_MAGIC;
+	hdr.version = NAMECACHE_VERSION;
+	hdr.nslots = NAMECACHE_SLOTS;
+	hdr.heapsize = b.heapsize;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(b.slots, sizeof(struct namecache_slot), NAMECACHE_SLOTS, fp) != NAMECACHE_SLOTS ||
+	    (b.heapsize > 0 && fwrite(b.heap, b.heapsize, 1, fp) != 1) ||
+	    fchmod(fd, 0644) < 0 || fclose(fp) != 0 ||
+	    rename(tmp, nc_path) < 0) {
+		warning("can't write name cache %s: %s", nc_path, strerror(errno));
+		unlink(tmp);
+	}
+	free(tmp);
+done:
+	free(b.slots);
+	free(b.heap);
+}
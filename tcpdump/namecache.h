@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef tcpdump_namecache_h
+#define tcpdump_namecache_h
+
+/*
+ * Kinds of names kept in the cache
+ */
+#define NC_IPV4		1
+#define NC_IPV6		2
+#define NC_ETHER	3
+#define NC_TCP		4
+#define NC_UDP		5
+#define NC_STAMP	6	/* when a source file was last loaded */
+
+#define NC_MAXKEY	16
+
+#define NC_TTL		3600		/* host names */
+#define NC_NEGATIVE_TTL	300		/* failed lookups */
+#define NC_FILE_TTL	(30 * 86400)	/* names loaded from a file */
+
+void namecache_open(const char *);
+int namecache_is_open(void);
+
+/*
+ * Returns 1 when the key is in the cache and has not expired: the name
+ * is NULL if the last lookup failed. Returns 0 otherwise.
+ */
+int namecache_lookup(int, const void *, u_int, const char **, time_t *);
+
+/*
+ * Remember a name, or a failed lookup when the name is NULL, for ttl
+ * seconds. The cache file is updated when tcpdump exits.
+ */
+void namecache_add(int, const void *, u_int, const char *, u_int);
+
+void namecache_foreach(int, void (*)(const u_char *, u_int, const char *, void *), void *);
+
+#endif
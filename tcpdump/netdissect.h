@@ -162,6 +162,12 @@ struct netdissect_options {
   const u_char *ndo_packetp;
   const u_char *ndo_snapend;
 
+  /* arrival time of the packet being printed */
+  struct timeval ndo_pkt_ts;
+
+  /* per-packet scratch memory, see nd_scratch_alloc() */
+  struct nd_scratch *ndo_scratch;
+
   /* bookkeeping for ^T output */
   int ndo_infodelay;
 
@@ -294,6 +300,9 @@ extern char *copy_argv(netdissect_options *, char **);
 extern void safeputchar(int);
 extern void safeputs(const char *, int);
 
+extern void *nd_scratch_alloc(netdissect_options *, size_t);
+extern void nd_scratch_reset(netdissect_options *);
+
 #define PLURAL_SUFFIX(n) \
 	(((n) != 1) ? "s" : "")
 
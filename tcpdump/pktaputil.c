@@ -52,8 +52,9 @@
 #include "netdissect.h"
 #include "interface.h"
 #include "pktmetadatafilter.h"
+#include "bpf_jit.h"
 
-extern node_t *pkt_meta_data_expression;
+extern pkt_meta_data_program_t *pkt_meta_data_program;
 
 extern netdissect_options *gndo;
 
@@ -65,6 +66,247 @@ extern u_int packets_mtdt_fltr_drop;
 
 extern char *svc2str(uint32_t);
 
+/*
+ * The pcap_if_info structures belong to libpcap so the per-interface
+ * state is kept on the side, indexed by interface id. The same entries
+ * back the lookups by id and by name so that libpcap linear scans of
+ * its interface list happen only once per interface.
+ */
+struct if_info_state {
+	struct pcap_if_info *if_info;
+	struct bpf_insn *bf_insns;
+	bpf_jit_filter_t *filter;
+};
+
+static pcap_t *if_info_pcap = NULL;
+static struct if_info_state *if_info_states = NULL;
+static int if_info_states_count = 0;
+
+void if_info_states_flush(void);
+
+/*
+ * Open addressing hash of the interfaces by name, the size is a power
+ * of two kept at most half full
+ */
+static struct pcap_if_info **if_info_names = NULL;
+static u_int if_info_names_size = 0;
+static u_int if_info_names_count = 0;
+static struct pcap_if_info *if_info_last = NULL;
+
+static u_int
+if_name_hash(const char *name)
+{
+	u_int h = 2166136261U;
+
+	while (*name != 0) {
+		h ^= (u_char)*name++;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static struct if_info_state *
+if_info_state_slot(int if_id)
+{
+	if (if_id < 0)
+		return (NULL);
+
+	if (if_id >= if_info_states_count) {
+		int count = if_info_states_count ? if_info_states_count : 8;
+		struct if_info_state *states;
+
+		while (count <= if_id)
+			count *= 2;
+		states = realloc(if_info_states, count * sizeof(struct if_info_state));
+		if (states == NULL)
+			return (NULL);
+		bzero(states + if_info_states_count,
+		      (count - if_info_states_count) * sizeof(struct if_info_state));
+		if_info_states = states;
+		if_info_states_count = count;
+	}
+	return (&if_info_states[if_id]);
+}
+
+static struct if_info_state *
+get_if_info_state(struct pcap_if_info *if_info)
+{
+	struct if_info_state *state;
+
+	state = if_info_state_slot(if_info->if_id);
+	if (state == NULL)
+		return (NULL);
+
+	/*
+	 * The slot may have been reused by another interface
+	 */
+	if (state->if_info != if_info) {
+		if (state->filter != NULL)
+			bpf_jit_free(state->filter);
+		bzero(state, sizeof(struct if_info_state));
+		state->if_info = if_info;
+	}
+	return (state);
+}
+
+static void
+if_info_names_insert(struct pcap_if_info *if_info)
+{
+	u_int i;
+
+	if (if_info->if_name == NULL)
+		return;
+
+	if (2 * (if_info_names_count + 1) > if_info_names_size) {
+		u_int size = if_info_names_size ? 2 * if_info_names_size : 64;
+		struct pcap_if_info **names;
+		u_int j;
+
+		names = calloc(size, sizeof(struct pcap_if_info *));
+		if (names == NULL)
+			return;
+		for (j = 0; j < if_info_names_size; j++) {
+			if (if_info_names[j] == NULL)
+				continue;
+			i = if_name_hash(if_info_names[j]->if_name) & (size - 1);
+			while (names[i] != NULL)
+				i = (i + 1) & (size - 1);
+			names[i] = if_info_names[j];
+		}
+		free(if_info_names);
+		if_info_names = names;
+		if_info_names_size = size;
+	}
+	i = if_name_hash(if_info->if_name) & (if_info_names_size - 1);
+	while (if_info_names[i] != NULL) {
+		if (if_info_names[i] == if_info)
+			return;
+		i = (i + 1) & (if_info_names_size - 1);
+	}
+	if_info_names[i] = if_info;
+	if_info_names_count++;
+}
+
+/*
+ * Start over when packets come from another capture handle
+ */
+static void
+if_info_check_pcap(pcap_t *pcap)
+{
+	if (pcap != if_info_pcap) {
+		if_info_states_flush();
+		if_info_pcap = pcap;
+	}
+}
+
+/*
+ * Same as pcap_find_if_info_by_name() without the linear scan
+ */
+struct pcap_if_info *
+if_info_find_by_name(pcap_t *pcap, const char *name)
+{
+	struct pcap_if_info *if_info;
+	u_int i;
+
+	if_info_check_pcap(pcap);
+
+	if (if_info_last != NULL && strcmp(if_info_last->if_name, name) == 0)
+		return (if_info_last);
+
+	if (if_info_names_size > 0) {
+		i = if_name_hash(name) & (if_info_names_size - 1);
+		while ((if_info = if_info_names[i]) != NULL) {
+			if (strcmp(if_info->if_name, name) == 0) {
+				if_info_last = if_info;
+				return (if_info);
+			}
+			i = (i + 1) & (if_info_names_size - 1);
+		}
+	}
+
+	if_info = pcap_find_if_info_by_name(pcap, name);
+	if (if_info != NULL) {
+		if_info_names_insert(if_info);
+		(void) get_if_info_state(if_info);
+		if_info_last = if_info;
+	}
+	return (if_info);
+}
+
+/*
+ * Same as pcap_find_if_info_by_id() without the linear scan
+ */
+struct pcap_if_info *
+if_info_find_by_id(pcap_t *pcap, int if_id)
+{
+	struct pcap_if_info *if_info;
+
+	if_info_check_pcap(pcap);
+
+	if (if_id >= 0 && if_id < if_info_states_count &&
+	    (if_info = if_info_states[if_id].if_info) != NULL)
+		return (if_info);
+
+	if_info = pcap_find_if_info_by_id(pcap, if_id);
+	if (if_info != NULL) {
+		(void) get_if_info_state(if_info);
+		if_info_names_insert(if_info);
+	}
+	return (if_info);
+}
+
+/*
+ * Returns zero if the packet doesn't match the interface filter, non-zero
+ * if it matches or if the interface has no filter
+ */
+int
+if_info_filter_packet(struct pcap_if_info *if_info, const u_char *pkt_data,
+		      u_int wirelen, u_int caplen)
+{
+	struct if_info_state *state;
+
+	if (if_info->if_filter_program.bf_insns == NULL)
+		return (1);
+
+	/*
+	 * Recompile when the filter expression changed
+	 */
+	state = get_if_info_state(if_info);
+	if (state != NULL &&
+	    (state->filter == NULL ||
+	     state->bf_insns != if_info->if_filter_program.bf_insns)) {
+		if (state->filter != NULL)
+			bpf_jit_free(state->filter);
+		state->bf_insns = if_info->if_filter_program.bf_insns;
+		state->filter = bpf_jit_compile(&if_info->if_filter_program);
+	}
+	if (state == NULL || state->filter == NULL)
+		return (bpf_filter(if_info->if_filter_program.bf_insns, pkt_data,
+				   wirelen, caplen));
+
+	return (bpf_jit_filter(state->filter, pkt_data, wirelen, caplen));
+}
+
+/*
+ * To be called whenever libpcap discards its interface list
+ */
+void
+if_info_states_flush(void)
+{
+	int i;
+
+	for (i = 0; i < if_info_states_count; i++) {
+		if (if_info_states[i].filter != NULL)
+			bpf_jit_free(if_info_states[i].filter);
+	}
+	bzero(if_info_states, if_info_states_count * sizeof(struct if_info_state));
+
+	if (if_info_names != NULL)
+		bzero(if_info_names, if_info_names_size * sizeof(struct pcap_if_info *));
+	if_info_names_count = 0;
+	if_info_last = NULL;
+}
+
 
 /*
  * Returns zero if the packet doesn't match, non-zero if it matches
@@ -87,7 +329,7 @@ pktap_filter_packet(pcap_t *pcap, struct pcap_if_info *if_info,
 	}
 	
 	if (if_info == NULL) {
-		if_info = pcap_find_if_info_by_name(pcap, pktp_hdr->pth_ifname);
+		if_info = if_info_find_by_name(pcap, pktp_hdr->pth_ifname);
 		/*
 		 * New interface
 		 */
@@ -102,39 +344,32 @@ pktap_filter_packet(pcap_t *pcap, struct pcap_if_info *if_info,
 		}
 	}
 	
-	if (if_info->if_filter_program.bf_insns == NULL)
-		match = 1;
-	else {
-		/*
-		 * The actual data packet is past the packet tap header
-		 */
-		struct pcap_pkthdr tmp_hdr;
-        
-		bcopy(h, &tmp_hdr, sizeof(struct pcap_pkthdr));
-        
-		tmp_hdr.caplen -= pktp_hdr->pth_length;
-		tmp_hdr.len -= pktp_hdr->pth_length;
-
-		pkt_data = sp + pktp_hdr->pth_length;
-        
-		match = pcap_offline_filter(&if_info->if_filter_program, &tmp_hdr, pkt_data);
-	}
+	/*
+	 * The actual data packet is past the packet tap header
+	 */
+	pkt_data = sp + pktp_hdr->pth_length;
+	match = if_info_filter_packet(if_info, pkt_data,
+				      h->len - pktp_hdr->pth_length,
+				      h->caplen - pktp_hdr->pth_length);
+
 	/*
 	 * Filter on packet metadata
 	 */
-	if (match && pkt_meta_data_expression != NULL) {
+	if (match && pkt_meta_data_program != NULL) {
 		struct pkt_meta_data pmd;
 		
 		pmd.itf = &pktp_hdr->pth_ifname[0];
+		pmd.itf_key = if_info;
 		pmd.proc = &pktp_hdr->pth_comm[0];
 		pmd.eproc = &pktp_hdr->pth_ecomm[0];
 		pmd.pid = pktp_hdr->pth_pid;
 		pmd.epid = pktp_hdr->pth_epid;
 		pmd.svc = svc2str(pktp_hdr->pth_svc);
+		pmd.svc_code = pktp_hdr->pth_svc;
 		pmd.dir = (pktp_hdr->pth_flags & PTH_FLAG_DIR_IN) ? "in" :
 			(pktp_hdr->pth_flags & PTH_FLAG_DIR_OUT) ? "out" : "";
 		
-		match = evaluate_expression(pkt_meta_data_expression, &pmd);
+		match = evaluate_program(pkt_meta_data_program, &pmd);
 		if (match == 0)
 			packets_mtdt_fltr_drop++;
 	}
@@ -0,0 +1,557 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Payload content filter for --match
+ *
+ * Each pattern is either a string or, when prefixed with "0x", a sequence
+ * of bytes in hexadecimal. All the patterns are compiled into a single
+ * Aho-Corasick automaton so a payload is scanned once whatever the number
+ * of patterns. The automaton is a complete DFA: every state has its 256
+ * transitions resolved at compile time, so the scan does one table lookup
+ * per byte.
+ *
+ * While the automaton is in its initial state only the bytes that start a
+ * pattern matter, so the scan skips ahead to the next such byte. With few
+ * distinct first bytes this is done 16 bytes at a time with SSE2.
+ *
+ * The patterns are searched in the transport layer payload of IPv4 and
+ * IPv6 packets, and in the whole packet for other protocols.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sysexits.h>
+#include <err.h>
+#include <sys/types.h>
+
+#include <pcap.h>
+#ifdef DLT_PKTAP
+#include <net/pktap.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pktcontentfilter.h"
+
+#define MAX_FIRST_BYTES	4
+
+struct pattern {
+	u_char *bytes;
+	size_t len;
+	char *src;
+};
+
+struct pkt_content_filter {
+	struct pattern *patterns;
+	int npatterns;
+
+	int32_t (*delta)[256];		/* transitions */
+	u_char *accept;			/* states where a pattern ends */
+	int nstates;
+
+	u_char first[256];		/* bytes leaving the initial state */
+	u_char first_bytes[MAX_FIRST_BYTES];
+	int nfirst;
+};
+
+pkt_content_filter_t *
+new_content_filter(void)
+{
+	pkt_content_filter_t *filter;
+
+	filter = calloc(1, sizeof(pkt_content_filter_t));
+	if (filter == NULL)
+		err(EX_OSERR, "calloc()");
+	return (filter);
+}
+
+static int
+hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	return (tolower(c) - 'a' + 10);
+}
+
+void
+add_content_pattern(pkt_content_filter_t *filter, const char *src)
+{
+	struct pattern *pattern;
+	size_t i, len;
+
+	if (filter->delta != NULL)
+		errx(EX_SOFTWARE, "%s: filter already compiled", __func__);
+
+	pattern = realloc(filter->patterns,
+			  (filter->npatterns + 1) * sizeof(struct pattern));
+	if (pattern == NULL)
+		err(EX_OSERR, "realloc()");
+	filter->patterns = pattern;
+	pattern = &filter->patterns[filter->npatterns];
+
+	if ((pattern->src = strdup(src)) == NULL)
+		err(EX_OSERR, "strdup()");
+
+	if (src[0] == '0' && (src[1] == 'x' || src[1] == 'X')) {
+		src += 2;
+		len = strlen(src);
+		if (len == 0 || (len % 2) != 0)
+			errx(EX_USAGE, "match pattern \"%s\": odd number of hex digits",
+			     pattern->src);
+		for (i = 0; i < len; i++) {
+			if (!isxdigit((u_char)src[i]))
+				errx(EX_USAGE, "match pattern \"%s\": invalid hex digit",
+				     pattern->src);
+		}
+		len /= 2;
+		if ((pattern->bytes = malloc(len)) == NULL)
+			err(EX_OSERR, "malloc()");
+		for (i = 0; i < len; i++)
+			pattern->bytes[i] = (hexval(src[2 * i]) << 4) | hexval(src[2 * i + 1]);
+	} else {
+		len = strlen(src);
+		if (len == 0)
+			errx(EX_USAGE, "empty match pattern");
+		if ((pattern->bytes = malloc(len)) == NULL)
+			err(EX_OSERR, "malloc()");
+		memcpy(pattern->bytes, src, len);
+	}
+	pattern->len = len;
+	filter->npatterns++;
+}
+
+void
+compile_content_filter(pkt_content_filter_t *filter)
+{
+	int32_t *fail, *queue;
+	int maxstates, head, tail;
+	int i, c;
+	size_t j;
+
+	if (filter->npatterns == 0)
+		errx(EX_USAGE, "no match pattern");
+
+	maxstates = 1;
+	for (i = 0; i < filter->npatterns; i++)
+		maxstates += filter->patterns[i].len;
+
+	filter->delta = calloc(maxstates, sizeof(filter->delta[0]));
+	filter->accept = calloc(maxstates, sizeof(u_char));
+	fail = calloc(maxstates, sizeof(int32_t));
+	queue = calloc(maxstates, sizeof(int32_t));
+	if (filter->delta == NULL || filter->accept == NULL ||
+	    fail == NULL || queue == NULL)
+		err(EX_OSERR, "calloc()");
+
+	/*
+	 * Build the trie, -1 marks a missing edge
+	 */
+	memset(filter->delta[0], 0xff, sizeof(filter->delta[0]));
+	filter->nstates = 1;
+	for (i = 0; i < filter->npatterns; i++) {
+		struct pattern *pattern = &filter->patterns[i];
+		int32_t state = 0;
+
+		for (j = 0; j < pattern->len; j++) {
+			c = pattern->bytes[j];
+			if (filter->delta[state][c] == -1) {
+				memset(filter->delta[filter->nstates], 0xff,
+				       sizeof(filter->delta[0]));
+				filter->delta[state][c] = filter->nstates++;
+			}
+			state = filter->delta[state][c];
+		}
+		filter->accept[state] = 1;
+	}
+
+	/*
+	 * Turn the trie into a DFA breadth first: missing edges take the
+	 * transition of the failure state, which is always shallower
+	 */
+	head = tail = 0;
+	for (c = 0; c < 256; c++) {
+		int32_t next = filter->delta[0][c];
+
+		if (next == -1) {
+			filter->delta[0][c] = 0;
+		} else {
+			fail[next] = 0;
+			queue[tail++] = next;
+		}
+	}
+	while (head < tail) {
+		int32_t state = queue[head++];
+
+		/*
+		 * Once a pattern matched the scan stops, any state whose
+		 * failure chain holds a match is a match too
+		 */
+		if (filter->accept[fail[state]])
+			filter->accept[state] = 1;
+
+		for (c = 0; c < 256; c++) {
+			int32_t next = filter->delta[state][c];
+
+			if (next == -1) {
+				filter->delta[state][c] = filter->delta[fail[state]][c];
+			} else {
+				fail[next] = filter->delta[fail[state]][c];
+				queue[tail++] = next;
+			}
+		}
+	}
+	free(fail);
+	free(queue);
+
+	filter->nfirst = 0;
+	for (c = 0; c < 256; c++) {
+		if (filter->delta[0][c] == 0)
+			continue;
+		filter->first[c] = 1;
+		if (filter->nfirst < MAX_FIRST_BYTES)
+			filter->first_bytes[filter->nfirst] = c;
+		filter->nfirst++;
+	}
+}
+
+void
+print_content_filter(pkt_content_filter_t *filter)
+{
+	int i;
+
+	for (i = 0; i < filter->npatterns; i++)
+		printf("(%03d) match \"%s\" (%zu bytes)\n", i,
+		       filter->patterns[i].src, filter->patterns[i].len);
+	printf("%d states, %d first bytes\n", filter->nstates, filter->nfirst);
+}
+
+/*
+ * Returns the offset of the first byte at or after off that can start
+ * a pattern, len if there is none
+ */
+static u_int
+skip_to_first(pkt_content_filter_t *filter, const u_char *p, u_int off, u_int len)
+{
+	const u_char *q;
+
+	if (filter->nfirst == 1) {
+		q = memchr(p + off, filter->first_bytes[0], len - off);
+		return (q != NULL ? q - p : len);
+	}
+#ifdef __SSE2__
+	if (filter->nfirst <= MAX_FIRST_BYTES) {
+		__m128i v[MAX_FIRST_BYTES];
+		int i;
+
+		for (i = 0; i < MAX_FIRST_BYTES; i++)
+			v[i] = _mm_set1_epi8(filter->first_bytes[i < filter->nfirst ? i : 0]);
+		while (off + 16 <= len) {
+			__m128i b = _mm_loadu_si128((const __m128i *)(p + off));
+			__m128i eq;
+			int mask;
+
+			eq = _mm_or_si128(
+			    _mm_or_si128(_mm_cmpeq_epi8(b, v[0]), _mm_cmpeq_epi8(b, v[1])),
+			    _mm_or_si128(_mm_cmpeq_epi8(b, v[2]), _mm_cmpeq_epi8(b, v[3])));
+			mask = _mm_movemask_epi8(eq);
+			if (mask != 0)
+				return (off + __builtin_ctz(mask));
+			off += 16;
+		}
+	}
+#endif /* __SSE2__ */
+	while (off < len && filter->first[p[off]] == 0)
+		off++;
+	return (off);
+}
+
+static int
+scan(pkt_content_filter_t *filter, const u_char *p, u_int len)
+{
+	int32_t (*delta)[256] = filter->delta;
+	int32_t state = 0;
+	u_int off = 0;
+
+	while (off < len) {
+		if (state == 0) {
+			off = skip_to_first(filter, p, off, len);
+			if (off == len)
+				break;
+		}
+		state = delta[state][p[off++]];
+		if (filter->accept[state])
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Returns the transport layer payload of an IP packet, or the IP payload
+ * for fragments and protocols other than TCP and UDP
+ */
+static const u_char *
+ip_payload(const u_char *p, u_int len, u_int *plen)
+{
+	u_int hlen, proto;
+
+	if (len < 1)
+		return (NULL);
+
+	switch (p[0] >> 4) {
+	case 4:
+		if (len < 20)
+			return (NULL);
+		hlen = (p[0] & 0x0f) * 4;
+		if (hlen < 20 || hlen > len)
+			return (NULL);
+		/*
+		 * Leave out the link-layer padding
+		 */
+		if (((p[2] << 8) | p[3]) >= hlen && ((p[2] << 8) | p[3]) < len)
+			len = (p[2] << 8) | p[3];
+		if ((((p[6] << 8) | p[7]) & 0x1fff) != 0) {
+			*plen = len - hlen;
+			return (p + hlen);
+		}
+		proto = p[9];
+		break;
+
+	case 6:
+		if (len < 40)
+			return (NULL);
+		if (((p[4] << 8) | p[5]) + 40 < len)
+			len = ((p[4] << 8) | p[5]) + 40;
+		proto = p[6];
+		hlen = 40;
+		for (;;) {
+			switch (proto) {
+			case 0:		/* hop-by-hop options */
+			case 43:	/* routing */
+			case 60:	/* destination options */
+				if (hlen + 8 > len)
+					return (NULL);
+				proto = p[hlen];
+				hlen += (p[hlen + 1] + 1) * 8;
+				continue;
+			case 44:	/* fragment */
+				if (hlen + 8 > len)
+					return (NULL);
+				proto = p[hlen];
+				if ((((p[hlen + 2] << 8) | p[hlen + 3]) & 0xfff8) != 0) {
+					*plen = len - (hlen + 8);
+					return (p + hlen + 8);
+				}
+				hlen += 8;
+				continue;
+			}
+			break;
+		}
+		if (hlen > len)
+			return (NULL);
+		break;
+
+	default:
+		return (NULL);
+	}
+
+	switch (proto) {
+	case 6:		/* TCP */
+		if (hlen + 20 > len)
+			return (NULL);
+		hlen += (p[hlen + 12] >> 4) * 4;
+		break;
+	case 17:	/* UDP */
+		hlen += 8;
+		break;
+	}
+	if (hlen > len)
+		return (NULL);
+
+	*plen = len - hlen;
+	return (p + hlen);
+}
+
+const u_char *
+packet_network_header(int dlt, const u_char *p, u_int len, u_int *nlen)
+{
+	u_int type, off;
+
+	switch (dlt) {
+	case DLT_EN10MB:
+		if (len < 14)
+			return (NULL);
+		off = 12;
+		type = (p[off] << 8) | p[off + 1];
+		while ((type == 0x8100 || type == 0x88a8) && off + 6 <= len) {
+			off += 4;
+			type = (p[off] << 8) | p[off + 1];
+		}
+		off += 2;
+		if (type != 0x0800 && type != 0x86dd)
+			return (NULL);
+		break;
+
+	case DLT_NULL:
+#ifdef DLT_LOOP
+	case DLT_LOOP:
+#endif
+		/*
+		 * The address family is in host byte order of the capturing
+		 * machine, rely on the IP version instead
+		 */
+		if (len < 4)
+			return (NULL);
+		off = 4;
+		break;
+
+	case DLT_RAW:
+#ifdef DLT_IPV4
+	case DLT_IPV4:
+#endif
+#ifdef DLT_IPV6
+	case DLT_IPV6:
+#endif
+		off = 0;
+		break;
+
+#ifdef DLT_PKTAP
+	case DLT_PKTAP: {
+		const struct pktap_header *pth = (const struct pktap_header *)p;
+
+		if (len < sizeof(struct pktap_header) || pth->pth_length > len)
+			return (NULL);
+		return (packet_network_header(pth->pth_dlt, p + pth->pth_length,
+					      len - pth->pth_length, nlen));
+	}
+#endif /* DLT_PKTAP */
+
+	default:
+		return (NULL);
+	}
+	*nlen = len - off;
+	return (p + off);
+}
+
+const u_char *
+packet_transport_header(const u_char *p, u_int len, u_int *tlen, u_int *proto)
+{
+	u_int hlen, plen, nh, elen;
+
+	if (len < 1)
+		return (NULL);
+
+	switch (p[0] >> 4) {
+	case 4:
+		if (len < 20)
+			return (NULL);
+		hlen = (p[0] & 0x0f) * 4;
+		plen = (p[2] << 8) | p[3];
+		if (hlen < 20 || hlen > len || plen < hlen ||
+		    (((p[6] << 8) | p[7]) & 0x3fff) != 0)	/* MF or offset */
+			return (NULL);
+		plen -= hlen;
+		nh = p[9];
+		break;
+
+	case 6:
+		if (len < 40)
+			return (NULL);
+		plen = (p[4] << 8) | p[5];
+		nh = p[6];
+		hlen = 40;
+		while (nh == 0 || nh == 43 || nh == 60) {
+			/* hop-by-hop, routing and destination options */
+			if (hlen + 2 > len)
+				return (NULL);
+			elen = (p[hlen + 1] + 1) * 8;
+			if (elen > plen)
+				return (NULL);
+			nh = p[hlen];
+			hlen += elen;
+			plen -= elen;
+		}
+		if (nh == 44 || hlen > len)	/* fragment */
+			return (NULL);
+		break;
+
+	default:
+		return (NULL);
+	}
+
+	*tlen = plen;
+	*proto = nh;
+	return (p + hlen);
+}
+
+static const u_char *
+packet_payload(int dlt, const u_char *p, u_int len, u_int *plen)
+{
+	const u_char *nh;
+	u_int nlen;
+
+	if ((nh = packet_network_header(dlt, p, len, &nlen)) == NULL)
+		return (NULL);
+	return (ip_payload(nh, nlen, plen));
+}
+
+int
+evaluate_content_filter(pkt_content_filter_t *filter, int dlt,
+			const u_char *p, u_int caplen)
+{
+	const u_char *payload;
+	u_int len;
+
+	payload = packet_payload(dlt, p, caplen, &len);
+	if (payload == NULL) {
+		payload = p;
+		len = caplen;
+	}
+	return (scan(filter, payload, len));
+}
+
+void
+free_content_filter(pkt_content_filter_t *filter)
+{
+	int i;
+
+	if (filter == NULL)
+		return;
+	for (i = 0; i < filter->npatterns; i++) {
+		free(filter->patterns[i].bytes);
+		free(filter->patterns[i].src);
+	}
+	free(filter->patterns);
+	free(filter->delta);
+	free(filter->accept);
+	free(filter);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef tcpdump_pktcontentfilter_h
+#define tcpdump_pktcontentfilter_h
+
+struct pkt_content_filter;
+typedef struct pkt_content_filter pkt_content_filter_t;
+
+pkt_content_filter_t * new_content_filter(void);
+void add_content_pattern(pkt_content_filter_t *, const char *);
+void compile_content_filter(pkt_content_filter_t *);
+void print_content_filter(pkt_content_filter_t *);
+
+/*
+ * Returns non-zero if the payload of the packet contains any of the
+ * patterns, dlt is the link-layer type of the packet data
+ */
+int evaluate_content_filter(pkt_content_filter_t *, int, const u_char *, u_int);
+
+void free_content_filter(pkt_content_filter_t *);
+
+/*
+ * Returns the IPv4 or IPv6 header of a packet of link-layer type dlt and
+ * sets the length of the data from there, or returns NULL when the packet
+ * does not carry IP or the link-layer type is not known
+ */
+const u_char *packet_network_header(int, const u_char *, u_int, u_int *);
+
+/*
+ * Returns the TCP, UDP or other transport-layer header that follows the
+ * IPv4 or IPv6 header at p, of which len bytes were captured. Sets the
+ * length of the transport-layer data according to the IP header and its
+ * protocol. Returns NULL for fragments or when the IP header is cut short.
+ */
+const u_char *packet_transport_header(const u_char *, u_int, u_int *, u_int *);
+
+#endif
@@ -48,6 +48,8 @@
  *  svcexpre: "svc" compexpr
  *  direxpr: "dir" compexpr
  * 
+ * For evaluation the expression tree is compiled into a flat program of
+ * comparisons in the manner of BPF, see compile_expression()
  */
 
 #include <stdio.h>
@@ -55,6 +57,7 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sysexits.h>
 #include <err.h>
 
@@ -535,6 +538,508 @@ evaluate_expression(node_t *expression, struct pkt_meta_data *p)
 	return (match);
 }
 
+/*
+ * Compiled form of a metadata filter expression
+ *
+ * Each instruction compares one packet metadata field with a constant and
+ * continues at "jt" or "jf", so "and", "or" and "not" become jumps and
+ * are never evaluated recursively. The comparison strings are interned at
+ * compile time, so that a packet only needs to map its interface, process
+ * and service class names to an integer. That mapping is cached per
+ * interface, per process ID and per service class, so in the steady state
+ * a packet is evaluated without any string comparison.
+ */
+enum {
+	PMD_F_ITF,
+	PMD_F_PROC,
+	PMD_F_EPROC,
+	PMD_F_PID,
+	PMD_F_EPID,
+	PMD_F_SVC,
+	PMD_F_DIR,
+	PMD_NFIELDS,
+
+	PMD_F_RET = PMD_NFIELDS
+};
+
+/*
+ * Values of the "dir" field, zero is never produced by a packet
+ */
+#define PMD_DIR_NONE	1
+#define PMD_DIR_IN	2
+#define PMD_DIR_OUT	3
+#define PMD_DIR_OTHER	4
+
+/*
+ * String IDs start at 1, zero is for strings that are not in the program
+ */
+#define PMD_STR_UNKNOWN	0
+
+struct pmd_insn {
+	int		field;
+	int		jt;
+	int		jf;
+	uint32_t	k;
+};
+
+struct pmd_string {
+	char		*str;
+	uint32_t	id;
+};
+
+struct pmd_strtab {
+	struct pmd_string *slots;
+	uint32_t	mask;
+	int		fold;		/* case insensitive */
+};
+
+#define PMD_ITF_CACHE_SIZE	64	/* must be a power of 2 */
+#define PMD_PROC_CACHE_SIZE	256	/* must be a power of 2 */
+#define PMD_SVC_CACHE_SIZE	16	/* must be a power of 2 */
+#define PMD_PROC_NAME_LEN	32
+
+struct pmd_itf_cache {
+	const void	*key;
+	uint32_t	id;
+};
+
+struct pmd_proc_cache {
+	int		valid;
+	pid_t		pid;
+	uint32_t	id;
+	char		name[PMD_PROC_NAME_LEN];
+};
+
+struct pmd_svc_cache {
+	int		valid;
+	uint32_t	code;
+	uint32_t	id;
+};
+
+struct pkt_meta_data_program {
+	struct pmd_insn	*insns;
+	int		num_insns;
+
+	struct pmd_strtab names;	/* interface and process names */
+	struct pmd_strtab svcs;		/* service classes */
+	const char	**strings;	/* indexed by ID, for print_program() */
+	uint32_t	num_strings;
+
+	struct pmd_itf_cache itf_cache[PMD_ITF_CACHE_SIZE];
+	struct pmd_proc_cache proc_cache[PMD_PROC_CACHE_SIZE];
+	struct pmd_svc_cache svc_cache[PMD_SVC_CACHE_SIZE];
+};
+
+struct pmd_compiler {
+	struct pkt_meta_data_program *prog;
+	int		*labels;
+	int		num_labels;
+};
+
+#define PMD_LABEL_ACCEPT	0
+#define PMD_LABEL_REJECT	1
+
+static uint32_t
+pmd_hash(const char *str, int fold)
+{
+	uint32_t h = 2166136261U;
+	
+	for (; *str != 0; str++) {
+		h ^= (u_char)(fold ? tolower((u_char)*str) : *str);
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static struct pmd_string *
+pmd_strtab_find(struct pmd_strtab *tab, const char *str)
+{
+	uint32_t i = pmd_hash(str, tab->fold) & tab->mask;
+	
+	for (;; i = (i + 1) & tab->mask) {
+		struct pmd_string *slot = &tab->slots[i];
+
+		if (slot->str == NULL)
+			return (slot);
+		if ((tab->fold ? strcasecmp(slot->str, str) : strcmp(slot->str, str)) == 0)
+			return (slot);
+	}
+}
+
+static uint32_t
+pmd_strtab_lookup(struct pmd_strtab *tab, const char *str)
+{
+	return (pmd_strtab_find(tab, str)->id);
+}
+
+static uint32_t
+pmd_intern(struct pkt_meta_data_program *prog, struct pmd_strtab *tab,
+		   const char *str)
+{
+	struct pmd_string *slot = pmd_strtab_find(tab, str);
+	
+	if (slot->str == NULL) {
+		slot->str = strdup(str);
+		if (slot->str == NULL)
+			err(EX_OSERR, "strdup()");
+		slot->id = ++prog->num_strings;
+		prog->strings[slot->id] = slot->str;
+	}
+	return (slot->id);
+}
+
+static void
+pmd_strtab_init(struct pmd_strtab *tab, int num_terms, int fold)
+{
+	uint32_t size = 16;
+	
+	while (size < 2 * (uint32_t)num_terms)
+		size <<= 1;
+	tab->slots = calloc(size, sizeof(struct pmd_string));
+	if (tab->slots == NULL)
+		err(EX_OSERR, "calloc()");
+	tab->mask = size - 1;
+	tab->fold = fold;
+}
+
+static void
+pmd_strtab_free(struct pmd_strtab *tab)
+{
+	uint32_t i;
+	
+	if (tab->slots == NULL)
+		return;
+	for (i = 0; i <= tab->mask; i++)
+		free(tab->slots[i].str);
+	free(tab->slots);
+}
+
+static int
+pmd_count_nodes(node_t *expression, int *num_terms)
+{
+	int n = 1;
+	
+	if (expression->left_node != NULL)
+		n += pmd_count_nodes(expression->left_node, num_terms);
+	if (expression->right_node != NULL)
+		n += pmd_count_nodes(expression->right_node, num_terms);
+	if (expression->left_node == NULL && expression->right_node == NULL)
+		(*num_terms)++;
+	return (n);
+}
+
+static int
+pmd_new_label(struct pmd_compiler *c)
+{
+	c->labels[c->num_labels] = -1;
+	return (c->num_labels++);
+}
+
+static void
+pmd_emit(struct pmd_compiler *c, int field, uint32_t k, int jt, int jf)
+{
+	struct pmd_insn *insn = &c->prog->insns[c->prog->num_insns++];
+	
+	insn->field = field;
+	insn->k = k;
+	insn->jt = jt;
+	insn->jf = jf;
+}
+
+static uint32_t
+pmd_dir_value(const char *str)
+{
+	if (*str == 0)
+		return (PMD_DIR_NONE);
+	if (strcasecmp(str, "in") == 0)
+		return (PMD_DIR_IN);
+	if (strcasecmp(str, "out") == 0)
+		return (PMD_DIR_OUT);
+	return (PMD_DIR_OTHER);
+}
+
+/*
+ * Generate code that continues at label "t" when the expression
+ * matches and at label "f" otherwise
+ */
+static void
+pmd_gen(struct pmd_compiler *c, node_t *expression, int t, int f)
+{
+	struct pkt_meta_data_program *prog = c->prog;
+	int label;
+	int field;
+	uint32_t k;
+	
+	switch (expression->id) {
+		case TOK_AND:
+			label = pmd_new_label(c);
+			pmd_gen(c, expression->left_node, label, f);
+			c->labels[label] = prog->num_insns;
+			pmd_gen(c, expression->right_node, t, f);
+			return;
+		case TOK_OR:
+			label = pmd_new_label(c);
+			pmd_gen(c, expression->left_node, t, label);
+			c->labels[label] = prog->num_insns;
+			pmd_gen(c, expression->right_node, t, f);
+			return;
+		case TOK_NOT:
+			pmd_gen(c, expression->left_node, f, t);
+			return;
+		case TOK_IF:
+			field = PMD_F_ITF;
+			k = pmd_intern(prog, &prog->names, expression->str);
+			break;
+		case TOK_PROC:
+			field = PMD_F_PROC;
+			k = pmd_intern(prog, &prog->names, expression->str);
+			break;
+		case TOK_EPROC:
+			field = PMD_F_EPROC;
+			k = pmd_intern(prog, &prog->names, expression->str);
+			break;
+		case TOK_PID:
+			field = PMD_F_PID;
+			k = (uint32_t)expression->num;
+			break;
+		case TOK_EPID:
+			field = PMD_F_EPID;
+			k = (uint32_t)expression->num;
+			break;
+		case TOK_SVC:
+			field = PMD_F_SVC;
+			k = pmd_intern(prog, &prog->svcs, expression->str);
+			break;
+		case TOK_DIR:
+			field = PMD_F_DIR;
+			k = pmd_dir_value(expression->str);
+			break;
+		default:
+			errx(EX_SOFTWARE, "%s: unexpected node %d", __func__, expression->id);
+	}
+	if (expression->op == TOK_NEQ)
+		pmd_emit(c, field, k, f, t);
+	else
+		pmd_emit(c, field, k, t, f);
+}
+
+pkt_meta_data_program_t *
+compile_expression(node_t *expression)
+{
+	struct pkt_meta_data_program *prog;
+	struct pmd_compiler compiler;
+	int num_nodes, num_terms = 0;
+	int i;
+	
+	prog = calloc(1, sizeof(struct pkt_meta_data_program));
+	if (prog == NULL)
+		err(EX_OSERR, "calloc()");
+	
+	num_nodes = pmd_count_nodes(expression, &num_terms);
+	
+	prog->insns = calloc(num_terms + 2, sizeof(struct pmd_insn));
+	prog->strings = calloc(num_terms + 1, sizeof(char *));
+	compiler.labels = calloc(num_nodes + 2, sizeof(int));
+	if (prog->insns == NULL || prog->strings == NULL || compiler.labels == NULL)
+		err(EX_OSERR, "calloc()");
+	pmd_strtab_init(&prog->names, num_terms, 0);
+	pmd_strtab_init(&prog->svcs, num_terms, 1);
+	
+	compiler.prog = prog;
+	compiler.num_labels = 0;
+	(void) pmd_new_label(&compiler);	/* PMD_LABEL_ACCEPT */
+	(void) pmd_new_label(&compiler);	/* PMD_LABEL_REJECT */
+	
+	pmd_gen(&compiler, expression, PMD_LABEL_ACCEPT, PMD_LABEL_REJECT);
+	
+	compiler.labels[PMD_LABEL_ACCEPT] = prog->num_insns;
+	pmd_emit(&compiler, PMD_F_RET, 1, 0, 0);
+	compiler.labels[PMD_LABEL_REJECT] = prog->num_insns;
+	pmd_emit(&compiler, PMD_F_RET, 0, 0, 0);
+	
+	for (i = 0; i < prog->num_insns; i++) {
+		struct pmd_insn *insn = &prog->insns[i];
+		
+		if (insn->field == PMD_F_RET)
+			continue;
+		insn->jt = compiler.labels[insn->jt];
+		insn->jf = compiler.labels[insn->jf];
+	}
+	free(compiler.labels);
+	
+	return (prog);
+}
+
+static uint32_t
+pmd_load_itf(struct pkt_meta_data_program *prog, struct pkt_meta_data *p)
+{
+	struct pmd_itf_cache *entry;
+	uintptr_t key = (uintptr_t)p->itf_key;
+	
+	if (key == 0)
+		return (pmd_strtab_lookup(&prog->names, p->itf));
+	
+	entry = &prog->itf_cache[(key >> 4) & (PMD_ITF_CACHE_SIZE - 1)];
+	if (entry->key != p->itf_key) {
+		entry->key = p->itf_key;
+		entry->id = pmd_strtab_lookup(&prog->names, p->itf);
+	}
+	return (entry->id);
+}
+
+static uint32_t
+pmd_load_proc(struct pkt_meta_data_program *prog, pid_t pid, const char *name)
+{
+	struct pmd_proc_cache *entry;
+	
+	entry = &prog->proc_cache[(uint32_t)pid & (PMD_PROC_CACHE_SIZE - 1)];
+	/*
+	 * Process IDs get reused so the name is checked as well, but that is
+	 * a short bounded compare rather than a lookup among all names
+	 */
+	if (entry->valid && entry->pid == pid &&
+		strncmp(entry->name, name, PMD_PROC_NAME_LEN) == 0)
+		return (entry->id);
+	
+	if (strlen(name) >= PMD_PROC_NAME_LEN)
+		return (pmd_strtab_lookup(&prog->names, name));
+	
+	entry->valid = 1;
+	entry->pid = pid;
+	entry->id = pmd_strtab_lookup(&prog->names, name);
+	strlcpy(entry->name, name, PMD_PROC_NAME_LEN);
+	
+	return (entry->id);
+}
+
+static uint32_t
+pmd_load_svc(struct pkt_meta_data_program *prog, struct pkt_meta_data *p)
+{
+	struct pmd_svc_cache *entry;
+	
+	entry = &prog->svc_cache[p->svc_code & (PMD_SVC_CACHE_SIZE - 1)];
+	if (entry->valid == 0 || entry->code != p->svc_code) {
+		entry->valid = 1;
+		entry->code = p->svc_code;
+		entry->id = pmd_strtab_lookup(&prog->svcs, p->svc);
+	}
+	return (entry->id);
+}
+
+static uint32_t
+pmd_load_field(struct pkt_meta_data_program *prog, int field,
+			   struct pkt_meta_data *p)
+{
+	switch (field) {
+		case PMD_F_ITF:
+			return (pmd_load_itf(prog, p));
+		case PMD_F_PROC:
+			return (pmd_load_proc(prog, p->pid, p->proc));
+		case PMD_F_EPROC:
+			return (pmd_load_proc(prog, p->epid, p->eproc));
+		case PMD_F_PID:
+			return ((uint32_t)p->pid);
+		case PMD_F_EPID:
+			return ((uint32_t)p->epid);
+		case PMD_F_SVC:
+			return (pmd_load_svc(prog, p));
+		case PMD_F_DIR:
+			switch (p->dir[0]) {
+				case 0:
+					return (PMD_DIR_NONE);
+				case 'i':
+					return (PMD_DIR_IN);
+				case 'o':
+					return (PMD_DIR_OUT);
+			}
+			break;
+	}
+	return (PMD_STR_UNKNOWN);
+}
+
+/*
+ * Returns zero if the packet doesn't match, non-zero if it matches
+ */
+int
+evaluate_program(pkt_meta_data_program_t *prog, struct pkt_meta_data *p)
+{
+	struct pmd_insn *insn = &prog->insns[0];
+	uint32_t value[PMD_NFIELDS];
+	u_int loaded = 0;
+	
+	while (insn->field != PMD_F_RET) {
+		int field = insn->field;
+		
+		if ((loaded & (1 << field)) == 0) {
+			value[field] = pmd_load_field(prog, field, p);
+			loaded |= (1 << field);
+		}
+		insn = &prog->insns[value[field] == insn->k ? insn->jt : insn->jf];
+	}
+	return (insn->k);
+}
+
+/*
+ * Must be called when the interface keys passed in struct pkt_meta_data
+ * may be reused for other interfaces, for example after pcap_clear_if_infos()
+ */
+void
+flush_program_caches(pkt_meta_data_program_t *prog)
+{
+	if (prog == NULL)
+		return;
+	bzero(prog->itf_cache, sizeof(prog->itf_cache));
+	bzero(prog->proc_cache, sizeof(prog->proc_cache));
+	bzero(prog->svc_cache, sizeof(prog->svc_cache));
+}
+
+void
+print_program(pkt_meta_data_program_t *prog)
+{
+	static const char *field_names[] = {
+		"if", "proc", "eproc", "pid", "epid", "svc", "dir"
+	};
+	static const char *dir_names[] = {
+		"?", "\"\"", "in", "out", "?"
+	};
+	int i;
+	
+	for (i = 0; i < prog->num_insns; i++) {
+		struct pmd_insn *insn = &prog->insns[i];
+		
+		printf("(%03d) ", i);
+		switch (insn->field) {
+			case PMD_F_RET:
+				printf("%-8s#%u\n", "ret", insn->k);
+				continue;
+			case PMD_F_PID:
+			case PMD_F_EPID:
+				printf("%-8s#%d", field_names[insn->field], (int)insn->k);
+				break;
+			case PMD_F_DIR:
+				printf("%-8s%s", field_names[insn->field], dir_names[insn->k]);
+				break;
+			default:
+				printf("%-8s\"%s\"", field_names[insn->field],
+					   prog->strings[insn->k]);
+				break;
+		}
+		printf("\tjt %d\tjf %d\n", insn->jt, insn->jf);
+	}
+}
+
+void
+free_program(pkt_meta_data_program_t *prog)
+{
+	if (prog == NULL)
+		return;
+	pmd_strtab_free(&prog->names);
+	pmd_strtab_free(&prog->svcs);
+	free(prog->strings);
+	free(prog->insns);
+	free(prog);
+}
+
 void
 print_expression(node_t *expression)
 {
@@ -32,14 +32,19 @@
 struct node;
 typedef struct node node_t;
 
+struct pkt_meta_data_program;
+typedef struct pkt_meta_data_program pkt_meta_data_program_t;
+
 struct pkt_meta_data {
 	const char *itf;
+	const void *itf_key;	/* stable per interface, NULL if unknown */
 	const char *proc;
 	const char *eproc;
 	pid_t pid;
 	pid_t epid;
 	const char *dir;
 	const char *svc;
+	uint32_t svc_code;	/* -1 if unknown */
 };
 
 
@@ -48,4 +53,10 @@ void print_expression(node_t *);
 int evaluate_expression(node_t *, struct pkt_meta_data *);
 void free_expression(node_t *);
 
+pkt_meta_data_program_t * compile_expression(node_t *);
+void print_program(pkt_meta_data_program_t *);
+int evaluate_program(pkt_meta_data_program_t *, struct pkt_meta_data *);
+void flush_program_caches(pkt_meta_data_program_t *);
+void free_program(pkt_meta_data_program_t *);
+
 #endif
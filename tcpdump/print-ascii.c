@@ -46,6 +46,10 @@ static const char rcsid[] _U_ =
 #endif
 #include <tcpdump-stdinc.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "interface.h"
 
@@ -55,68 +59,167 @@ static const char rcsid[] _U_ =
 #define HEXDUMP_HEXSTUFF_PER_SHORT 5 /* 4 hex digits and a space */
 #define HEXDUMP_HEXSTUFF_PER_LINE \
 		(HEXDUMP_HEXSTUFF_PER_SHORT * HEXDUMP_SHORTS_PER_LINE)
+#define HEXDUMP_OFFSET_LENGTH sizeof("0x00000000: ")
+#define HEXDUMP_LINELENGTH \
+		(HEXDUMP_OFFSET_LENGTH + HEXDUMP_HEXSTUFF_PER_LINE + 2 + \
+		 HEXDUMP_BYTES_PER_LINE)
+
+/*
+ * The two hex digits of every byte value, the digits of byte b start
+ * at hex_pairs[2 * b]
+ */
+const char hex_pairs[] =
+    "000102030405060708090a0b0c0d0e0f"
+    "101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f"
+    "303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f"
+    "505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f"
+    "707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f"
+    "909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+    "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+    "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+    "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/* isgraph() in the C locale */
+#define ND_ISGRAPH(c)	((c) > 0x20 && (c) < 0x7f)
+
+static char *
+put_offset(char *cp, u_int oset)
+{
+	if (oset > 0xffff)
+		return (cp + snprintf(cp, HEXDUMP_OFFSET_LENGTH, "0x%04x: ", oset));
+	*cp++ = '0';
+	*cp++ = 'x';
+	memcpy(cp, &hex_pairs[2 * (oset >> 8)], 2);
+	memcpy(cp + 2, &hex_pairs[2 * (oset & 0xff)], 2);
+	cp[4] = ':';
+	cp[5] = ' ';
+	return (cp + 6);
+}
+
+/*
+ * Format n bytes as " xxxx" groups, with " xx" for an odd last byte
+ */
+static char *
+put_hexstuff(char *cp, const u_char *bp, u_int n)
+{
+#ifdef __SSE2__
+	if (n == HEXDUMP_BYTES_PER_LINE) {
+		const __m128i nibble = _mm_set1_epi8(0x0f);
+		const __m128i nine = _mm_set1_epi8(9);
+		const __m128i zero = _mm_set1_epi8('0');
+		const __m128i alpha = _mm_set1_epi8('a' - '0' - 10);
+		__m128i v, hi, lo, d0, d1;
+		char digits[2 * HEXDUMP_BYTES_PER_LINE];
+		int i;
+
+		v = _mm_loadu_si128((const __m128i *)bp);
+		hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+		lo = _mm_and_si128(v, nibble);
+		d0 = _mm_unpacklo_epi8(hi, lo);
+		d1 = _mm_unpackhi_epi8(hi, lo);
+		d0 = _mm_add_epi8(_mm_add_epi8(d0, zero),
+		    _mm_and_si128(_mm_cmpgt_epi8(d0, nine), alpha));
+		d1 = _mm_add_epi8(_mm_add_epi8(d1, zero),
+		    _mm_and_si128(_mm_cmpgt_epi8(d1, nine), alpha));
+		_mm_storeu_si128((__m128i *)digits, d0);
+		_mm_storeu_si128((__m128i *)(digits + 16), d1);
+		for (i = 0; i < HEXDUMP_SHORTS_PER_LINE; i++) {
+			*cp++ = ' ';
+			memcpy(cp, &digits[4 * i], 4);
+			cp += 4;
+		}
+		return (cp);
+	}
+#endif /* __SSE2__ */
+	for (; n >= 2; n -= 2, bp += 2) {
+		*cp++ = ' ';
+		memcpy(cp, &hex_pairs[2 * bp[0]], 2);
+		memcpy(cp + 2, &hex_pairs[2 * bp[1]], 2);
+		cp += 4;
+	}
+	if (n) {
+		*cp++ = ' ';
+		memcpy(cp, &hex_pairs[2 * bp[0]], 2);
+		cp += 2;
+	}
+	return (cp);
+}
+
+static char *
+put_asciistuff(char *cp, const u_char *bp, u_int n)
+{
+#ifdef __SSE2__
+	if (n == HEXDUMP_BYTES_PER_LINE) {
+		__m128i v, graph;
+
+		v = _mm_loadu_si128((const __m128i *)bp);
+		/* signed compares, bytes from 0x80 are negative */
+		graph = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x20)),
+		    _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+		v = _mm_or_si128(_mm_and_si128(graph, v),
+		    _mm_andnot_si128(graph, _mm_set1_epi8('.')));
+		_mm_storeu_si128((__m128i *)cp, v);
+		return (cp + HEXDUMP_BYTES_PER_LINE);
+	}
+#endif /* __SSE2__ */
+	while (n-- > 0) {
+		*cp++ = ND_ISGRAPH(*bp) ? *bp : '.';
+		bp++;
+	}
+	return (cp);
+}
 
 void
 ascii_print(register const u_char *cp, register u_int length)
 {
 	register int s;
+	char buf[ASCII_LINELENGTH], *bp;
 
 	putchar('\n');
 	while (length > 0) {
-		s = *cp++;
-		length--;
-		if (!isgraph(s) &&
-		    (s != '\t' && s != ' ' && s != '\n' && s != '\r'))
-			putchar('.');
-		else
-			putchar(s);
+		for (bp = buf; length > 0 && bp < &buf[sizeof(buf)]; length--) {
+			s = *cp++;
+			if (!ND_ISGRAPH(s) &&
+			    (s != '\t' && s != ' ' && s != '\n' && s != '\r'))
+				*bp++ = '.';
+			else
+				*bp++ = s;
+		}
+		(void)fwrite(buf, 1, bp - buf, stdout);
 	}
 }
 
+/*
+ * Each line is built in a buffer and written at once
+ */
 void
 hex_and_ascii_print_with_offset(register const char *ident,
     register const u_char *cp, register u_int length, register u_int oset)
 {
-	register u_int i;
-	register int s1, s2;
-	register int nshorts;
-	char hexstuff[HEXDUMP_SHORTS_PER_LINE*HEXDUMP_HEXSTUFF_PER_SHORT+1], *hsp;
-	char asciistuff[ASCII_LINELENGTH+1], *asp;
-
-	nshorts = length / sizeof(u_short);
-	i = 0;
-	hsp = hexstuff; asp = asciistuff;
-	while (--nshorts >= 0) {
-		s1 = *cp++;
-		s2 = *cp++;
-		(void)snprintf(hsp, sizeof(hexstuff) - (hsp - hexstuff),
-		    " %02x%02x", s1, s2);
-		hsp += HEXDUMP_HEXSTUFF_PER_SHORT;
-		*(asp++) = (isgraph(s1) ? s1 : '.');
-		*(asp++) = (isgraph(s2) ? s2 : '.');
-		i++;
-		if (i >= HEXDUMP_SHORTS_PER_LINE) {
-			*hsp = *asp = '\0';
-			(void)printf("%s0x%04x: %-*s  %s",
-			    ident, oset, HEXDUMP_HEXSTUFF_PER_LINE,
-			    hexstuff, asciistuff);
-			i = 0; hsp = hexstuff; asp = asciistuff;
-			oset += HEXDUMP_BYTES_PER_LINE;
-		}
-	}
-	if (length & 1) {
-		s1 = *cp++;
-		(void)snprintf(hsp, sizeof(hexstuff) - (hsp - hexstuff),
-		    " %02x", s1);
-		hsp += 3;
-		*(asp++) = (isgraph(s1) ? s1 : '.');
-		++i;
-	}
-	if (i > 0) {
-		*hsp = *asp = '\0';
-		(void)printf("%s0x%04x: %-*s  %s",
-		     ident, oset, HEXDUMP_HEXSTUFF_PER_LINE,
-		     hexstuff, asciistuff);
+	char line[HEXDUMP_LINELENGTH], *lp, *hsp;
+	u_int n;
+
+	while (length > 0) {
+		n = length < HEXDUMP_BYTES_PER_LINE ?
+		    length : HEXDUMP_BYTES_PER_LINE;
+		lp = put_offset(line, oset);
+		hsp = lp;
+		lp = put_hexstuff(lp, cp, n);
+		memset(lp, ' ', HEXDUMP_HEXSTUFF_PER_LINE - (lp - hsp) + 2);
+		lp = hsp + HEXDUMP_HEXSTUFF_PER_LINE + 2;
+		lp = put_asciistuff(lp, cp, n);
+		(void)fputs(ident, stdout);
+		(void)fwrite(line, 1, lp - line, stdout);
+		cp += n;
+		length -= n;
+		oset += HEXDUMP_BYTES_PER_LINE;
 	}
 }
 
@@ -134,23 +237,19 @@ void
 hex_print_with_offset(register const char *ident, register const u_char *cp, register u_int length,
 		      register u_int oset)
 {
-	register u_int i, s;
-	register int nshorts;
-
-	nshorts = (u_int) length / sizeof(u_short);
-	i = 0;
-	while (--nshorts >= 0) {
-		if ((i++ % 8) == 0) {
-			(void)printf("%s0x%04x: ", ident, oset);
-			oset += HEXDUMP_BYTES_PER_LINE;
-		}
-		s = *cp++;
-		(void)printf(" %02x%02x", s, *cp++);
-	}
-	if (length & 1) {
-		if ((i % 8) == 0)
-			(void)printf("%s0x%04x: ", ident, oset);
-		(void)printf(" %02x", *cp);
+	char line[HEXDUMP_LINELENGTH], *lp;
+	u_int n;
+
+	while (length > 0) {
+		n = length < HEXDUMP_BYTES_PER_LINE ?
+		    length : HEXDUMP_BYTES_PER_LINE;
+		lp = put_offset(line, oset);
+		lp = put_hexstuff(lp, cp, n);
+		(void)fputs(ident, stdout);
+		(void)fwrite(line, 1, lp - line, stdout);
+		cp += n;
+		length -= n;
+		oset += HEXDUMP_BYTES_PER_LINE;
 	}
 }
 
@@ -39,6 +39,25 @@ static const char rcsid[] _U_ =
 #include "addrtoname.h"
 #include "extract.h"                    /* must come after interface.h */
 
+/*
+ * Queries can be matched with their responses and summarized with
+ * --dns-stats
+ */
+#ifdef __APPLE__
+#define USE_DNS_STATS
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ip.h"
+#ifdef INET6
+#include "ip6.h"
+#endif
+#include "udp.h"
+#include "pktcontentfilter.h"
+#endif
+
 static const char *ns_ops[] = {
 	"", " inv_q", " stat", " op3", " notify", " update", " op6", " op7",
 	" op8", " updataA", " updateD", " updateDA",
@@ -84,13 +103,74 @@ ns_nskip(register const u_char *cp)
 	return (cp);
 }
 
+/*
+ * Names are put together in an ns_text before they are printed, so that
+ * ns_nprint() can remember them; a name too long for buf is printed in
+ * pieces and not remembered.
+ */
+#define NS_TEXTMAX	1024
+
+struct ns_text {
+	u_int len;
+	int flushed;
+	char buf[NS_TEXTMAX];
+};
+
+static void
+ns_tputc(struct ns_text *t, int c)
+{
+	if (t->len == sizeof(t->buf)) {
+		fwrite(t->buf, 1, t->len, stdout);
+		t->len = 0;
+		t->flushed = 1;
+	}
+	t->buf[t->len++] = c;
+}
+
+static void
+ns_tputs(struct ns_text *t, const char *s)
+{
+	while (*s != '\0')
+		ns_tputc(t, *s++);
+}
+
+static void
+ns_tflush(struct ns_text *t)
+{
+	fwrite(t->buf, 1, t->len, stdout);
+}
+
+/* same as fn_printn() */
+static int
+ns_tlabel(struct ns_text *t, register const u_char *s, register u_int n)
+{
+	register u_char c;
+
+	while (n > 0 && s < snapend) {
+		n--;
+		c = *s++;
+		if (!isascii(c)) {
+			c = toascii(c);
+			ns_tputc(t, 'M');
+			ns_tputc(t, '-');
+		}
+		if (!isprint(c)) {
+			c ^= 0x40;	/* DEL to ?, others to alpha */
+			ns_tputc(t, '^');
+		}
+		ns_tputc(t, c);
+	}
+	return (n == 0) ? 0 : 1;
+}
+
 /* print a <domain-name> */
 static const u_char *
-blabel_print(const u_char *cp)
+blabel_print(const u_char *cp, struct ns_text *t)
 {
 	int bitlen, slen, b;
 	const u_char *bitp, *lim;
 	char tc;
+	char num[16];
 
 	if (!TTEST2(*cp, 1))
 		return(NULL);
@@ -100,31 +180,38 @@ blabel_print(const u_char *cp)
 	lim = cp + 1 + slen;
 
 	/* print the bit string as a hex string */
-	printf("\\[x");
+	ns_tputs(t, "\\[x");
 	for (bitp = cp + 1, b = bitlen; bitp < lim && b > 7; b -= 8, bitp++) {
 		TCHECK(*bitp);
-		printf("%02x", *bitp);
+		snprintf(num, sizeof(num), "%02x", *bitp);
+		ns_tputs(t, num);
 	}
 	if (b > 4) {
 		TCHECK(*bitp);
 		tc = *bitp++;
-		printf("%02x", tc & (0xff << (8 - b)));
+		snprintf(num, sizeof(num), "%02x", tc & (0xff << (8 - b)));
+		ns_tputs(t, num);
 	} else if (b > 0) {
 		TCHECK(*bitp);
 		tc = *bitp++;
-		printf("%1x", ((tc >> 4) & 0x0f) & (0x0f << (4 - b)));
+		snprintf(num, sizeof(num), "%1x",
+		    ((tc >> 4) & 0x0f) & (0x0f << (4 - b)));
+		ns_tputs(t, num);
 	}
-	printf("/%d]", bitlen);
+	snprintf(num, sizeof(num), "/%d]", bitlen);
+	ns_tputs(t, num);
 	return lim;
 trunc:
-	printf(".../%d]", bitlen);
+	snprintf(num, sizeof(num), ".../%d]", bitlen);
+	ns_tputs(t, num);
 	return NULL;
 }
 
 static int
-labellen(const u_char *cp)
+labellen(const u_char *cp, struct ns_text *t)
 {
 	register u_int i;
+	char elts[16];
 
 	if (!TTEST2(*cp, 1))
 		return(-1);
@@ -132,7 +219,8 @@ labellen(const u_char *cp)
 	if ((i & INDIR_MASK) == EDNS0_MASK) {
 		int bitlen, elt;
 		if ((elt = (i & ~INDIR_MASK)) != EDNS0_ELT_BITLABEL) {
-			printf("<ELT %d>", elt);
+			snprintf(elts, sizeof(elts), "<ELT %d>", elt);
+			ns_tputs(t, elts);
 			return(-1);
 		}
 		if (!TTEST2(*(cp + 1), 1))
@@ -144,21 +232,131 @@ labellen(const u_char *cp)
 		return(i);
 }
 
+/*
+ * The text of the names printed from the message ns_print() is working
+ * on is remembered by the offset they start at, so that a name that a
+ * lot of records point to (the zone name in an AXFR, say) is only
+ * decoded once.  Only offsets where ns_nprint() started or where a
+ * pointer led are entered: a pointer may only go back to before the
+ * labels it ends, so the text from such an offset doesn't depend on how
+ * it was reached.  The text is kept in the per-packet scratch memory.
+ */
+#define NS_MAXHOPS	128	/* most pointers followed for one name */
+#define NS_NAMECACHE	4096	/* must be a power of 2 */
+
+struct ns_name {
+	u_int gen;
+	u_int off;		/* where the name starts */
+	u_int end;		/* where the labels at off end */
+	u_int hops;		/* pointers followed from off */
+	const char *text;
+};
+
+/* where ns_nprint() started or followed a pointer to */
+struct ns_seg {
+	u_int off;
+	u_int end;
+	u_int tpos;		/* in the ns_text */
+};
+
+static struct ns_name ns_names[NS_NAMECACHE];
+static u_int ns_names_count;
+static u_int ns_names_gen;
+static const u_char *ns_names_msg;
+
+static void
+ns_names_start(const u_char *bp)
+{
+	if (++ns_names_gen == 0) {
+		memset(ns_names, 0, sizeof(ns_names));
+		ns_names_gen = 1;
+	}
+	ns_names_count = 0;
+	ns_names_msg = bp;
+}
+
+static const struct ns_name *
+ns_name_lookup(u_int off)
+{
+	const struct ns_name *np;
+	u_int h;
+
+	for (h = off & (NS_NAMECACHE - 1);; h = (h + 1) & (NS_NAMECACHE - 1)) {
+		np = &ns_names[h];
+		if (np->gen != ns_names_gen)
+			return (NULL);
+		if (np->off == off)
+			return (np);
+	}
+}
+
+static void
+ns_name_save(const struct ns_text *t, const struct ns_seg *seg, int nseg,
+    u_int hops)
+{
+	struct ns_name *np;
+	char *text;
+	u_int h;
+	int n;
+
+	/* keep the table at most half full */
+	if (t->flushed || ns_names_count + nseg > NS_NAMECACHE / 2)
+		return;
+	if ((text = nd_scratch_alloc(gndo, t->len + 1)) == NULL)
+		return;
+	memcpy(text, t->buf, t->len);
+	text[t->len] = '\0';
+	for (n = 0; n < nseg; n++) {
+		h = seg[n].off & (NS_NAMECACHE - 1);
+		while (ns_names[h].gen == ns_names_gen &&
+		    ns_names[h].off != seg[n].off)
+			h = (h + 1) & (NS_NAMECACHE - 1);
+		np = &ns_names[h];
+		if (np->gen == ns_names_gen)
+			continue;
+		np->gen = ns_names_gen;
+		np->off = seg[n].off;
+		np->end = seg[n].end;
+		np->hops = hops - n;
+		np->text = text + seg[n].tpos;
+		ns_names_count++;
+	}
+}
+
 const u_char *
 ns_nprint(register const u_char *cp, register const u_char *bp)
 {
 	register u_int i, l;
 	register const u_char *rp = NULL;
 	register int compress = 0;
-	int chars_processed;
-	int elt;
-	int data_size = snapend - bp;
+	int elt, cacheable, nseg;
+	u_int off, max_offset, hops;
+	const struct ns_name *np;
+	struct ns_seg seg[NS_MAXHOPS + 1];
+	struct ns_text t;
+	char elts[16];
 
-	if ((l = labellen(cp)) == (u_int)-1)
-		return(NULL);
+	/*
+	 * A pointer has to point to before the labels it ends, which
+	 * rules out loops.
+	 */
+	max_offset = cp - bp;
+	cacheable = (bp == ns_names_msg);
+	if (cacheable && (np = ns_name_lookup(max_offset)) != NULL) {
+		fputs(np->text, stdout);
+		return (bp + np->end);
+	}
+	t.len = 0;
+	t.flushed = 0;
+	hops = 0;
+	seg[0].off = max_offset;
+	seg[0].tpos = 0;
+	nseg = 1;
+
+	if ((l = labellen(cp, &t)) == (u_int)-1)
+		goto fail;
 	if (!TTEST2(*cp, 1))
-		return(NULL);
-	chars_processed = 1;
+		goto fail;
 	if (((i = *cp++) & INDIR_MASK) != INDIR_MASK) {
 		compress = 0;
 		rp = cp + l;
@@ -172,59 +370,77 @@ ns_nprint(register const u_char *cp, register const u_char *bp)
 					compress = 1;
 				}
 				if (!TTEST2(*cp, 1))
-					return(NULL);
-				cp = bp + (((i << 8) | *cp) & 0x3fff);
-				if ((l = labellen(cp)) == (u_int)-1)
-					return(NULL);
+					goto fail;
+				seg[nseg - 1].end = cp + 1 - bp;
+				off = ((i << 8) | *cp) & 0x3fff;
+				if (off >= max_offset || hops == NS_MAXHOPS) {
+					ns_tputs(&t, "<BAD PTR>");
+					goto fail;
+				}
+				max_offset = off;
+				hops++;
+				cp = bp + off;
+				if (cacheable &&
+				    (np = ns_name_lookup(off)) != NULL &&
+				    hops + np->hops <= NS_MAXHOPS) {
+					ns_tputs(&t, np->text);
+					hops += np->hops;
+					goto done;
+				}
+				seg[nseg].off = off;
+				seg[nseg].tpos = t.len;
+				nseg++;
+				if ((l = labellen(cp, &t)) == (u_int)-1)
+					goto fail;
 				if (!TTEST2(*cp, 1))
-					return(NULL);
+					goto fail;
 				i = *cp++;
-				chars_processed++;
-
-				/*
-				 * If we've looked at every character in
-				 * the message, this pointer will make
-				 * us look at some character again,
-				 * which means we're looping.
-				 */
-				if (chars_processed >= data_size) {
-					printf("<LOOP>");
-					return (NULL);
-				}
 				continue;
 			}
 			if ((i & INDIR_MASK) == EDNS0_MASK) {
 				elt = (i & ~INDIR_MASK);
 				switch(elt) {
 				case EDNS0_ELT_BITLABEL:
-					if (blabel_print(cp) == NULL)
-						return (NULL);
+					if (blabel_print(cp, &t) == NULL)
+						goto fail;
 					break;
 				default:
 					/* unknown ELT */
-					printf("<ELT %d>", elt);
-					return(NULL);
+					snprintf(elts, sizeof(elts), "<ELT %d>", elt);
+					ns_tputs(&t, elts);
+					goto fail;
 				}
 			} else {
-				if (fn_printn(cp, l, snapend))
-					return(NULL);
+				if (ns_tlabel(&t, cp, l))
+					goto fail;
 			}
 
 			cp += l;
-			chars_processed += l;
-			putchar('.');
-			if ((l = labellen(cp)) == (u_int)-1)
-				return(NULL);
+			ns_tputc(&t, '.');
+			if ((l = labellen(cp, &t)) == (u_int)-1)
+				goto fail;
 			if (!TTEST2(*cp, 1))
-				return(NULL);
+				goto fail;
 			i = *cp++;
-			chars_processed++;
 			if (!compress)
 				rp += l + 1;
 		}
 	else
-		putchar('.');
+		ns_tputc(&t, '.');
+	if (i != 0) {
+		/* ran into the end of the capture */
+		ns_tflush(&t);
+		return (rp);
+	}
+	seg[nseg - 1].end = cp - bp;
+done:
+	if (cacheable)
+		ns_name_save(&t, seg, nseg, hops);
+	ns_tflush(&t);
 	return (rp);
+fail:
+	ns_tflush(&t);
+	return (NULL);
 }
 
 /* print a <character-string> */
@@ -584,6 +800,7 @@ ns_print(register const u_char *bp, u_int length, int is_mdns)
 	u_int16_t b2;
 
 	np = (const HEADER *)bp;
+	ns_names_start(bp);
 	TCHECK(*np);
 	/* get the byte-order right */
 	qdcount = EXTRACT_16BITS(&np->qdcount);
@@ -743,9 +960,368 @@ ns_print(register const u_char *bp, u_int length, int is_mdns)
 		}
 	}
 	printf(" (%d)", length);
+	ns_names_msg = NULL;
 	return;
 
   trunc:
 	printf("[|domain]");
+	ns_names_msg = NULL;
 	return;
 }
+
+#ifdef USE_DNS_STATS
+/*
+ * --dns-stats: queries over UDP are matched with their responses on the
+ * client, the server, the client port, the ID and a hash of the query
+ * name, and every dns_stats_interval seconds of packet time a line is
+ * printed for each server with the queries, retransmitted queries,
+ * responses by rcode, queries that got no response within DNSQ_TIMEOUT
+ * seconds, responses to queries that were not seen, and the average and
+ * maximum time from a query to its response.
+ *
+ * At most DNSQ_MAX queries and DNSSRV_MAX servers are kept track of;
+ * when there are too many queries the oldest one is counted as
+ * unanswered.
+ */
+
+#define DNSQ_MAX	65536
+#define DNSQ_HASHSIZE	16384
+#define DNSQ_TIMEOUT	10
+#define DNSSRV_MAX	4096
+#define DNSSRV_HASHSIZE	256
+
+struct dns_server {
+	struct dns_server *hnext;
+	struct dns_server *next;	/* in the order they were seen */
+	int		alen;		/* 4 or 16 */
+	u_char		addr[16];
+	u_long		queries;
+	u_long		retrans;
+	u_long		responses;
+	u_long		unanswered;
+	u_long		unmatched;
+	u_long		rcode[16];
+	u_int64_t	total;		/* microseconds */
+	u_int32_t	max;
+};
+
+struct dns_query {
+	struct dns_query *hnext;
+	struct dns_query *prev;		/* on dnsq_lru, oldest first */
+	struct dns_query *next;
+	u_int32_t	hash;
+	struct dns_server *server;
+	u_char		client[16];
+	u_int16_t	cport;
+	u_int16_t	id;
+	u_int32_t	qhash;
+	struct timeval	ts;
+};
+
+u_int dns_stats_interval;
+
+static struct dns_query *dnsq_hash[DNSQ_HASHSIZE];
+static struct dns_query dnsq_lru = { NULL, &dnsq_lru, &dnsq_lru };
+static struct dns_query *dnsq_free;
+static u_int dnsq_count;
+static struct dns_server *dnssrv_hash[DNSSRV_HASHSIZE];
+static struct dns_server *dnssrv_list, **dnssrv_tail = &dnssrv_list;
+static u_int dnssrv_count;
+static time_t dns_interval_start;
+
+static u_int32_t
+dns_hashfn(const u_char *p, int len, u_int32_t h)
+{
+	while (len-- > 0)
+		h = (h ^ *p++) * 16777619U;
+	return (h);
+}
+
+static struct dns_server *
+dns_server_lookup(const u_char *addr, int alen)
+{
+	struct dns_server *ds;
+	u_int h;
+
+	h = dns_hashfn(addr, alen, 2166136261U) & (DNSSRV_HASHSIZE - 1);
+	for (ds = dnssrv_hash[h]; ds != NULL; ds = ds->hnext) {
+		if (ds->alen == alen && memcmp(ds->addr, addr, alen) == 0)
+			return (ds);
+	}
+	if (dnssrv_count >= DNSSRV_MAX || (ds = calloc(1, sizeof(*ds))) == NULL)
+		return (NULL);
+	ds->alen = alen;
+	memcpy(ds->addr, addr, alen);
+	ds->hnext = dnssrv_hash[h];
+	dnssrv_hash[h] = ds;
+	*dnssrv_tail = ds;
+	dnssrv_tail = &ds->next;
+	dnssrv_count++;
+	return (ds);
+}
+
+static void
+dnsq_remove(struct dns_query *dq)
+{
+	struct dns_query **pp;
+
+	for (pp = &dnsq_hash[dq->hash & (DNSQ_HASHSIZE - 1)]; *pp != dq;
+	     pp = &(*pp)->hnext)
+		continue;
+	*pp = dq->hnext;
+	dq->prev->next = dq->next;
+	dq->next->prev = dq->prev;
+	dq->hnext = dnsq_free;
+	dnsq_free = dq;
+	dnsq_count--;
+}
+
+static void
+dnsq_expire(time_t now)
+{
+	while (dnsq_lru.next != &dnsq_lru &&
+	       now - dnsq_lru.next->ts.tv_sec > DNSQ_TIMEOUT) {
+		dnsq_lru.next->server->unanswered++;
+		dnsq_remove(dnsq_lru.next);
+	}
+}
+
+static struct dns_query *
+dnsq_lookup(u_int32_t hash, const struct dns_server *ds, const u_char *client,
+	    u_int cport, u_int id, u_int32_t qhash)
+{
+	struct dns_query *dq;
+
+	for (dq = dnsq_hash[hash & (DNSQ_HASHSIZE - 1)]; dq != NULL;
+	     dq = dq->hnext) {
+		if (dq->hash == hash && dq->server == ds &&
+		    dq->cport == cport && dq->id == id && dq->qhash == qhash &&
+		    memcmp(dq->client, client, ds->alen) == 0)
+			return (dq);
+	}
+	return (NULL);
+}
+
+/*
+ * Hash of the first query name, case insensitive, or 0 if there is no
+ * question or it cannot be read
+ */
+static u_int32_t
+dns_qname_hash(const u_char *cp, const u_char *ep, u_int qdcount)
+{
+	u_int32_t h = 2166136261U;
+	u_int i;
+
+	if (qdcount == 0)
+		return (0);
+	while (cp < ep && *cp != 0) {
+		if ((*cp & INDIR_MASK) != 0 || cp + 1 + *cp > ep)
+			return (0);
+		for (i = 0; i <= *cp; i++)
+			h = (h ^ tolower(cp[i])) * 16777619U;
+		cp += 1 + *cp;
+	}
+	return (h);
+}
+
+static void
+dns_stats_print(time_t start, time_t end)
+{
+	struct dns_server *ds;
+	char from[16], to[16];
+	struct tm *tm;
+	int i, n;
+
+	tm = localtime(&start);
+	strftime(from, sizeof(from), "%H:%M:%S", tm);
+	tm = localtime(&end);
+	strftime(to, sizeof(to), "%H:%M:%S", tm);
+	for (ds = dnssrv_list; ds != NULL; ds = ds->next) {
+		if (ds->queries == 0 && ds->responses == 0 &&
+		    ds->unanswered == 0 && ds->unmatched == 0)
+			continue;
+		printf("DNS %s-%s %s: %lu quer%s, %lu retransmitted, "
+		    "%lu response%s", from, to,
+#ifdef INET6
+		    ds->alen == 16 ? ip6addr_string(ds->addr) :
+#endif
+		    ipaddr_string(ds->addr),
+		    ds->queries, ds->queries == 1 ? "y" : "ies", ds->retrans,
+		    ds->responses, PLURAL_SUFFIX(ds->responses));
+		for (i = 0, n = 0; i < 16; i++) {
+			if (ds->rcode[i] == 0)
+				continue;
+			printf("%s%s %lu", n++ == 0 ? " (" : ", ",
+			    i == 0 ? "NoError" : ns_resp[i] + 1, ds->rcode[i]);
+		}
+		printf("%s, %lu unanswered, %lu unmatched", n != 0 ? ")" : "",
+		    ds->unanswered, ds->unmatched);
+		if (ds->responses != 0)
+			printf(", avg %.3f ms, max %.3f ms",
+			    (double)ds->total / ds->responses / 1000,
+			    (double)ds->max / 1000);
+		putchar('\n');
+	}
+	(void)fflush(stdout);
+}
+
+static void
+dns_stats_reset(void)
+{
+	struct dns_server *ds;
+
+	for (ds = dnssrv_list; ds != NULL; ds = ds->next) {
+		ds->queries = ds->retrans = ds->responses = 0;
+		ds->unanswered = ds->unmatched = 0;
+		memset(ds->rcode, 0, sizeof(ds->rcode));
+		ds->total = 0;
+		ds->max = 0;
+	}
+}
+
+/*
+ * Print the intervals that ended before now
+ */
+static void
+dns_stats_tick(time_t now)
+{
+	if (dns_interval_start == 0)
+		dns_interval_start = now - now % dns_stats_interval;
+	dnsq_expire(now);
+	if (now - dns_interval_start < (time_t)dns_stats_interval)
+		return;
+	dns_stats_print(dns_interval_start,
+	    dns_interval_start + dns_stats_interval);
+	dns_stats_reset();
+	dns_interval_start = now - now % dns_stats_interval;
+}
+
+/*
+ * Print the current interval, at the end of the capture, when the
+ * queries still waiting are counted as unanswered, or when asked with
+ * SIGINFO
+ */
+void
+dns_stats_report(int final)
+{
+	if (dns_interval_start == 0)
+		return;
+	if (final) {
+		while (dnsq_lru.next != &dnsq_lru) {
+			dnsq_lru.next->server->unanswered++;
+			dnsq_remove(dnsq_lru.next);
+		}
+	}
+	dns_stats_print(dns_interval_start, pkt_ts.tv_sec);
+}
+
+/*
+ * Account for a DNS packet with --dns-stats, bp2 is the IP header and
+ * length what was captured from there
+ */
+void
+dns_analyze(const u_char *bp2, u_int length)
+{
+	const struct ip *ip = (const struct ip *)bp2;
+	const struct udphdr *up;
+	const HEADER *np;
+	const u_char *src, *dst, *ep;
+	struct dns_server *ds;
+	struct dns_query *dq;
+	u_int len, proto, sport, dport, id;
+	u_int32_t qhash, h;
+	int alen;
+	int64_t usec;
+
+	up = (const struct udphdr *)packet_transport_header(bp2, length,
+	    &len, &proto);
+	if (up == NULL || proto != IPPROTO_UDP)
+		return;
+	if (IP_V(ip) == 4) {
+		src = (const u_char *)&ip->ip_src;
+		dst = (const u_char *)&ip->ip_dst;
+		alen = 4;
+	} else {
+#ifdef INET6
+		const struct ip6_hdr *ip6 = (const struct ip6_hdr *)bp2;
+
+		src = (const u_char *)&ip6->ip6_src;
+		dst = (const u_char *)&ip6->ip6_dst;
+		alen = 16;
+#else
+		return;
+#endif
+	}
+
+	np = (const HEADER *)(up + 1);
+	if (len < sizeof(*up) + sizeof(*np) || !TTEST(*np))
+		return;
+	sport = EXTRACT_16BITS(&up->uh_sport);
+	dport = EXTRACT_16BITS(&up->uh_dport);
+	if (DNS_OPCODE(np) != 0 ||
+	    (DNS_QR(np) ? sport : dport) != NAMESERVER_PORT)
+		return;
+
+	dns_stats_tick(pkt_ts.tv_sec);
+
+	ep = (const u_char *)up + len;
+	if (ep > snapend)
+		ep = snapend;
+	qhash = dns_qname_hash((const u_char *)(np + 1), ep,
+	    EXTRACT_16BITS(&np->qdcount));
+	id = EXTRACT_16BITS(&np->id);
+	if (DNS_QR(np)) {
+		/* response */
+		if ((ds = dns_server_lookup(src, alen)) == NULL)
+			return;
+		h = dns_hashfn(dst, alen, qhash ^ (dport << 16) ^ id);
+		if ((dq = dnsq_lookup(h, ds, dst, dport, id, qhash)) == NULL) {
+			ds->unmatched++;
+			return;
+		}
+		usec = (int64_t)(pkt_ts.tv_sec - dq->ts.tv_sec) * 1000000 +
+		    (pkt_ts.tv_usec - dq->ts.tv_usec);
+		if (usec < 0)
+			usec = 0;
+		ds->responses++;
+		ds->rcode[DNS_RCODE(np)]++;
+		ds->total += usec;
+		if (usec > ds->max)
+			ds->max = usec;
+		dnsq_remove(dq);
+		return;
+	}
+
+	/* query */
+	if ((ds = dns_server_lookup(dst, alen)) == NULL)
+		return;
+	ds->queries++;
+	h = dns_hashfn(src, alen, qhash ^ (sport << 16) ^ id);
+	if (dnsq_lookup(h, ds, src, sport, id, qhash) != NULL) {
+		ds->retrans++;
+		return;
+	}
+	if (dnsq_count >= DNSQ_MAX) {
+		dnsq_lru.next->server->unanswered++;
+		dnsq_remove(dnsq_lru.next);
+	}
+	if ((dq = dnsq_free) != NULL)
+		dnsq_free = dq->hnext;
+	else if ((dq = malloc(sizeof(*dq))) == NULL)
+		return;
+	dq->hash = h;
+	dq->server = ds;
+	memcpy(dq->client, src, alen);
+	dq->cport = sport;
+	dq->id = id;
+	dq->qhash = qhash;
+	dq->ts = pkt_ts;
+	dq->hnext = dnsq_hash[h & (DNSQ_HASHSIZE - 1)];
+	dnsq_hash[h & (DNSQ_HASHSIZE - 1)] = dq;
+	dq->prev = dnsq_lru.prev;
+	dq->next = &dnsq_lru;
+	dnsq_lru.prev->next = dq;
+	dnsq_lru.prev = dq;
+	dnsq_count++;
+}
+#endif /* USE_DNS_STATS */
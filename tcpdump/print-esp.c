@@ -287,6 +287,7 @@ struct sockaddr_storage {
 #ifdef HAVE_LIBCRYPTO
 struct sa_list {
 	struct sa_list	*next;
+	struct sa_list	*hnext;		/* in sa_hash */
 	struct sockaddr_storage daddr;
 	u_int32_t	spi;          /* if == 0, then IKEv2 */
 	int             initiator;
@@ -294,8 +295,11 @@ struct sa_list {
 	u_char          spir[8];
 #ifdef __APPLE__
 	CCCryptoCipherData    cipherData;
+	CCCryptorRef	ctx;		/* keyed on first use, CBC only */
 #else /* __APPLE__ */
 	const EVP_CIPHER *evp;
+	EVP_CIPHER_CTX	ctx;		/* keyed on first use, CBC only */
+	int		ctx_ready;
 #endif /* __APPLE__ */
 	int		ivlen;
 	int		authlen;
@@ -306,28 +310,123 @@ struct sa_list {
 };
 
 /*
- * this will adjust ndo_packetp and ndo_snapend to new buffer!
+ * The SAs by SPI and destination address, or by initiator SPI for IKEv2,
+ * newest first like ndo_sa_list_head
  */
-int esp_print_decrypt_buffer_by_ikev2(netdissect_options *ndo,
-				      int initiator,
-				      u_char spii[8], u_char spir[8],
-				      u_char *buf, u_char *end)
+#define SA_HASHSIZE	256
+
+static struct sa_list *sa_hash[SA_HASHSIZE];
+
+static u_int
+esp_sa_hash(u_int32_t spi, const u_char *p, int len)
+{
+	u_int32_t h = spi * 2654435761U;
+
+	while (len-- > 0)
+		h = (h ^ *p++) * 16777619U;
+	return (h & (SA_HASHSIZE - 1));
+}
+
+static u_int
+esp_sa_bucket(const struct sa_list *sa)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)&sa->daddr;
+#ifdef INET6
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)&sa->daddr;
+#endif
+
+	if (sa->spi == 0)
+		return (esp_sa_hash(0, sa->spii, sizeof(sa->spii)));
+#ifdef INET6
+	if (sin6->sin6_family == AF_INET6)
+		return (esp_sa_hash(sa->spi, (const u_char *)&sin6->sin6_addr,
+		    sizeof(struct in6_addr)));
+#endif
+	return (esp_sa_hash(sa->spi, (const u_char *)&sin->sin_addr,
+	    sizeof(struct in_addr)));
+}
+
+/*
+ * Decrypt len bytes at buf in place with the SA's cipher and the IV at iv.
+ * In CBC mode, which is what ESP uses, the context is keyed the first time
+ * the SA is used and then only given each packet's IV, since setting up
+ * the key schedule costs more than decrypting a packet; the other modes
+ * start from the key every time.
+ */
+static void
+esp_sa_decrypt(netdissect_options *ndo, struct sa_list *sa,
+	       const u_char *iv, u_char *buf, int len)
 {
-	struct sa_list *sa;
-	u_char *iv;
-	int len;
 #ifdef __APPLE__
+	CCCryptoCipherData cipherData;
 	CCCryptorRef    ctx;
 	size_t          dataMoved = 0;
+
+	if (len <= 0)
+		return;
+	if (sa->cipherData.mode != kCCModeCBC) {
+		ctx = NULL;
+		if (kCCSuccess != CCCryptorCreateFromCipherData(&sa->cipherData, kCCDecrypt, sa->secret, iv, &ctx))
+			(*ndo->ndo_warning)(ndo, "espkey init failed");
+		(void)CCCryptorUpdate(ctx, buf, len, buf, len, &dataMoved);
+		CCCryptorRelease(ctx);
+		return;
+	}
+	if (sa->ctx == NULL) {
+		/* ESP pads the payload itself, keep the last block */
+		cipherData = sa->cipherData;
+		cipherData.padding = ccNoPadding;
+		if (kCCSuccess != CCCryptorCreateFromCipherData(&cipherData, kCCDecrypt, sa->secret, iv, &sa->ctx)) {
+			(*ndo->ndo_warning)(ndo, "espkey init failed");
+			sa->ctx = NULL;
+			return;
+		}
+	} else
+		(void)CCCryptorReset(sa->ctx, iv);
+	(void)CCCryptorUpdate(sa->ctx, buf, len, buf, len, &dataMoved);
 #else /* __APPLE__ */
 	EVP_CIPHER_CTX ctx;
+
+	if (len <= 0)
+		return;
+	if (EVP_CIPHER_mode(sa->evp) != EVP_CIPH_CBC_MODE) {
+		memset(&ctx, 0, sizeof(ctx));
+		if (EVP_CipherInit(&ctx, sa->evp, sa->secret, NULL, 0) < 0)
+			(*ndo->ndo_warning)(ndo, "espkey init failed");
+		EVP_CipherInit(&ctx, NULL, NULL, iv, 0);
+		EVP_Cipher(&ctx, buf, buf, len);
+		EVP_CIPHER_CTX_cleanup(&ctx);
+		return;
+	}
+	if (!sa->ctx_ready) {
+		memset(&sa->ctx, 0, sizeof(sa->ctx));
+		if (EVP_CipherInit(&sa->ctx, sa->evp, sa->secret, NULL, 0) < 0)
+			(*ndo->ndo_warning)(ndo, "espkey init failed");
+		sa->ctx_ready = 1;
+	}
+	EVP_CipherInit(&sa->ctx, NULL, NULL, iv, 0);
+	EVP_Cipher(&sa->ctx, buf, buf, len);
 #endif /* __APPLE__ */
+}
+
+/*
+ * this will adjust ndo_packetp and ndo_snapend to new buffer, a decrypted
+ * copy in the packet's scratch memory!
+ */
+int esp_print_decrypt_buffer_by_ikev2(netdissect_options *ndo,
+				      int initiator,
+				      u_char spii[8], u_char spir[8],
+				      u_char *buf, u_char *end)
+{
+	struct sa_list *sa;
+	u_char *iv, *copy;
+	int len;
 
 	/* initiator arg is any non-zero value */
 	if(initiator) initiator=1;
 				       
 	/* see if we can find the SA, and if so, decode it */
-	for (sa = ndo->ndo_sa_list_head; sa != NULL; sa = sa->next) {
+	for (sa = sa_hash[esp_sa_hash(0, spii, 8)]; sa != NULL; sa = sa->hnext) {
 		if (sa->spi == 0
 		    && initiator == sa->initiator
 		    && memcmp(spii, sa->spii, 8) == 0
@@ -353,25 +452,13 @@ int esp_print_decrypt_buffer_by_ikev2(netdissect_options *ndo,
 
 	if(end <= buf) return 0;
 
-#ifdef __APPLE__
-	ctx = NULL;
-	if (kCCSuccess != CCCryptorCreateFromCipherData(&sa->cipherData, kCCDecrypt, sa->secret, iv, &ctx))
-		(*ndo->ndo_warning)(ndo, "espkey init failed");
-	
-	(void)CCCryptorUpdate(ctx, buf, len, buf, len, &dataMoved);
-	CCCryptorRelease(ctx);
-	ctx = NULL;
-#else /* __APPLE__ */
-	memset(&ctx, 0, sizeof(ctx));
-	if (EVP_CipherInit(&ctx, sa->evp, sa->secret, NULL, 0) < 0)
-		(*ndo->ndo_warning)(ndo, "espkey init failed");
-	EVP_CipherInit(&ctx, NULL, NULL, iv, 0);
-	EVP_Cipher(&ctx, buf, buf, len);
-	EVP_CIPHER_CTX_cleanup(&ctx);
-#endif /* __APPLE__ */
+	if ((copy = nd_scratch_alloc(ndo, len)) == NULL)
+		return 0;
+	memcpy(copy, buf, len);
+	esp_sa_decrypt(ndo, sa, iv, copy, len);
 
-	ndo->ndo_packetp = buf;
-	ndo->ndo_snapend = end;
+	ndo->ndo_packetp = copy;
+	ndo->ndo_snapend = copy + len;
 
 	return 1;
 	
@@ -383,12 +470,22 @@ static void esp_print_addsa(netdissect_options *ndo,
 	/* copy the "sa" */
 
 	struct sa_list *nsa;
+	u_int h;
 
 	nsa = (struct sa_list *)malloc(sizeof(struct sa_list));
 	if (nsa == NULL)
 		(*ndo->ndo_error)(ndo, "ran out of memory to allocate sa structure");
 
 	*nsa = *sa;
+#ifdef __APPLE__
+	nsa->ctx = NULL;
+#else /* __APPLE__ */
+	nsa->ctx_ready = 0;
+#endif /* __APPLE__ */
+
+	h = esp_sa_bucket(nsa);
+	nsa->hnext = sa_hash[h];
+	sa_hash[h] = nsa;
 
 	if (sa_def)
 		ndo->ndo_sa_default = nsa;
@@ -605,6 +702,7 @@ static void esp_print_decode_ikeline(netdissect_options *ndo, char *line,
 		return;
 	}
 
+	memset(&sa1, 0, sizeof(struct sa_list));
 	sa1.spi = 0;
 	sa1.initiator = (init[0] == 'I');
 	if(espprint_decode_hex(ndo, sa1.spii, sizeof(sa1.spii), icookie+2)!=8)
@@ -806,13 +904,7 @@ esp_print(netdissect_options *ndo,
 	int ivlen = 0;
 	u_char *ivoff;
 	u_char *p;
-#ifdef __APPLE__
-	CCCryptorRef    ctx;
-	size_t          dataMoved = 0;
-#else /* __APPLE__ */
-	EVP_CIPHER_CTX ctx;
-	int blocksz;
-#endif /* __APPLE__ */
+	u_int32_t spi;
 #endif
 
 	esp = (struct newesp *)bp;
@@ -853,6 +945,7 @@ esp_print(netdissect_options *ndo,
 		goto fail;
 
 	ip = (struct ip *)bp2;
+	spi = EXTRACT_32BITS(&esp->esp_spi);
 	switch (IP_V(ip)) {
 #ifdef INET6
 	case 6:
@@ -864,9 +957,10 @@ esp_print(netdissect_options *ndo,
 		len = sizeof(struct ip6_hdr) + EXTRACT_16BITS(&ip6->ip6_plen);
 
 		/* see if we can find the SA, and if so, decode it */
-		for (sa = ndo->ndo_sa_list_head; sa != NULL; sa = sa->next) {
+		for (sa = sa_hash[esp_sa_hash(spi, (const u_char *)&ip6->ip6_dst,
+		    sizeof(struct in6_addr))]; sa != NULL; sa = sa->hnext) {
 			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&sa->daddr;
-			if (sa->spi == EXTRACT_32BITS(&esp->esp_spi) &&
+			if (sa->spi == spi &&
 			    sin6->sin6_family == AF_INET6 &&
 			    memcmp(&sin6->sin6_addr, &ip6->ip6_dst,
 				   sizeof(struct in6_addr)) == 0) {
@@ -882,9 +976,10 @@ esp_print(netdissect_options *ndo,
 		len = EXTRACT_16BITS(&ip->ip_len);
 
 		/* see if we can find the SA, and if so, decode it */
-		for (sa = ndo->ndo_sa_list_head; sa != NULL; sa = sa->next) {
+		for (sa = sa_hash[esp_sa_hash(spi, (const u_char *)&ip->ip_dst,
+		    sizeof(struct in_addr))]; sa != NULL; sa = sa->hnext) {
 			struct sockaddr_in *sin = (struct sockaddr_in *)&sa->daddr;
-			if (sa->spi == EXTRACT_32BITS(&esp->esp_spi) &&
+			if (sa->spi == spi &&
 			    sin->sin_family == AF_INET &&
 			    sin->sin_addr.s_addr == ip->ip_dst.s_addr) {
 				break;
@@ -921,34 +1016,14 @@ esp_print(netdissect_options *ndo,
 
 #ifdef __APPLE__
 	if (sa->cipherData.algorithm != (CCAlgorithm)-1) {
-		ctx = NULL;
-		p = ivoff;
-		if (kCCSuccess != CCCryptorCreateFromCipherData(&sa->cipherData, kCCDecrypt, secret, p, &ctx))
-			(*ndo->ndo_warning)(ndo, "espkey init failed");
-		len = ep - (p + ivlen);
-		CCCryptorUpdate(ctx, p + ivlen, len, p + ivlen, len, &dataMoved);
-		CCCryptorRelease(ctx);
-		ctx = NULL;
-		advance = ivoff - (u_char *)esp + ivlen;
-	}
-	else
-		advance = sizeof(struct newesp);
 #else /* __APPLE__ */
 	if (sa->evp) {
-		memset(&ctx, 0, sizeof(ctx));
-		if (EVP_CipherInit(&ctx, sa->evp, secret, NULL, 0) < 0)
-			(*ndo->ndo_warning)(ndo, "espkey init failed");
-
-		blocksz = EVP_CIPHER_CTX_block_size(&ctx);
-
+#endif /* __APPLE__ */
 		p = ivoff;
-		EVP_CipherInit(&ctx, NULL, NULL, p, 0);
-		EVP_Cipher(&ctx, p + ivlen, p + ivlen, ep - (p + ivlen));
-		EVP_CIPHER_CTX_cleanup(&ctx);
+		esp_sa_decrypt(ndo, sa, p, p + ivlen, ep - (p + ivlen));
 		advance = ivoff - (u_char *)esp + ivlen;
 	} else
 		advance = sizeof(struct newesp);
-#endif /* __APPLE__ */
 
 	/* sanity check for pad length */
 	if (ep - bp < *(ep - 2))
@@ -40,6 +40,12 @@ static const char rcsid[] _U_ =
 #include "addrtoname.h"
 #include "extract.h"
 
+#ifdef __APPLE__
+#include <string.h>
+
+#include "ipreasm.h"
+#endif
+
 int
 frag6_print(register const u_char *bp, register const u_char *bp2)
 {
@@ -79,4 +85,64 @@ trunc:
 	return -1;
 #undef TCHECK
 }
+
+#ifdef __APPLE__
+/*
+ * With --ip-defrag, add the fragment to its datagram. Returns 0 when
+ * fragments are still missing, 1 when the datagram is complete, with
+ * its fragment header turned into the one of an atomic fragment, and -1
+ * when the fragment should be printed as usual.
+ */
+int
+frag6_reasm(const u_char *bp, const u_char *bp2, struct ip_reasm_done *done)
+{
+	const struct ip6_frag *dp;
+	const struct ip6_hdr *ip6;
+	struct ip6_hdr *rip6;
+	struct ip6_frag *rdp;
+	struct ip_reasm_key key;
+	const u_char *ep;
+	u_int off, more;
+
+	dp = (const struct ip6_frag *)bp;
+	ip6 = (const struct ip6_hdr *)bp2;
+
+	if (ip_reasm_limit == 0 || !TTEST(*dp))
+		return -1;
+	off = EXTRACT_16BITS(&dp->ip6f_offlg) & IP6F_OFF_MASK;
+	more = EXTRACT_16BITS(&dp->ip6f_offlg) & IP6F_MORE_FRAG;
+	ep = bp2 + sizeof(struct ip6_hdr) + EXTRACT_16BITS(&ip6->ip6_plen);
+	if ((off == 0 && !more) || ep < (const u_char *)(dp + 1) ||
+	    !TTEST2(*(const u_char *)(dp + 1), ep - (const u_char *)(dp + 1)))
+		return -1;
+
+	memset(&key, 0, sizeof(key));
+	memcpy(key.src, &ip6->ip6_src, sizeof(ip6->ip6_src));
+	memcpy(key.dst, &ip6->ip6_dst, sizeof(ip6->ip6_dst));
+	key.id = EXTRACT_32BITS(&dp->ip6f_ident);
+	key.family = 6;
+
+	switch (ip_reasm_add(&key, pkt_ts.tv_sec, off,
+	    (const u_char *)(dp + 1), ep - (const u_char *)(dp + 1), more,
+	    bp2, (const u_char *)(dp + 1) - bp2, done)) {
+
+	case -1:
+		return -1;
+
+	case 0:
+		frag6_print(bp, bp2);
+		if (off == 0)
+			fputs("[reassembling]", stdout);
+		else
+			fputs(" [reassembling]", stdout);
+		return 0;
+	}
+
+	rip6 = (struct ip6_hdr *)done->hdr;
+	rdp = (struct ip6_frag *)(done->hdr + done->hdrlen - sizeof(struct ip6_frag));
+	rip6->ip6_plen = htons(done->hdrlen - sizeof(struct ip6_hdr) + done->len);
+	rdp->ip6f_offlg = 0;
+	return 1;
+}
+#endif
 #endif /* INET6 */
@@ -41,6 +41,15 @@ static const char rcsid[] _U_ =
 #include "ip.h"
 #include "ipproto.h"
 
+/*
+ * Fragments can be put back together before the transport protocol is
+ * printed with --ip-defrag
+ */
+#ifdef __APPLE__
+#define USE_IP_REASSEMBLY
+#include "ipreasm.h"
+#endif
+
 struct tok ip_option_values[] = {
     { IPOPT_EOL, "EOL" },
     { IPOPT_NOP, "NOP" },
@@ -509,6 +518,79 @@ ip_print_inner(netdissect_options *ndo,
 	ip_print_demux(ndo, &ipd);
 }
 
+#ifdef USE_IP_REASSEMBLY
+/*
+ * Add a fragment to its datagram, and print the datagram as if it had
+ * not been fragmented once it is complete. Returns 0 when the fragment
+ * should be printed as usual.
+ */
+static int
+ip_print_reasm(netdissect_options *ndo,
+	       struct ip_print_demux_state *ipds, u_int hlen)
+{
+	struct ip_print_demux_state ipd;
+	struct ip_reasm_key key;
+	struct ip_reasm_done done;
+	struct protoent *proto;
+	const u_char *osnapend;
+	struct ip *ip;
+
+	if (ip_reasm_limit == 0 || (ipds->off & (IP_MF|IP_OFFMASK)) == 0 ||
+	    !ND_TTEST2(*(const u_char *)ipds->ip, hlen + ipds->len))
+		return (0);
+
+	memset(&key, 0, sizeof(key));
+	memcpy(key.src, &ipds->ip->ip_src, sizeof(ipds->ip->ip_src));
+	memcpy(key.dst, &ipds->ip->ip_dst, sizeof(ipds->ip->ip_dst));
+	key.id = EXTRACT_16BITS(&ipds->ip->ip_id);
+	key.proto = ipds->ip->ip_p;
+	key.family = 4;
+
+	switch (ip_reasm_add(&key, ndo->ndo_pkt_ts.tv_sec,
+	    (ipds->off & IP_OFFMASK) * 8, (const u_char *)ipds->ip + hlen,
+	    ipds->len, ipds->off & IP_MF, (const u_char *)ipds->ip, hlen,
+	    &done)) {
+
+	case -1:
+		return (0);
+
+	case 0:
+		if (qflag > 1)
+			return (1);
+		ND_PRINT((ndo, "%s > %s:", ipaddr_string(&ipds->ip->ip_src),
+			  ipaddr_string(&ipds->ip->ip_dst)));
+		if (!ndo->ndo_nflag && (proto = getprotobynumber(ipds->ip->ip_p)) != NULL)
+			ND_PRINT((ndo, " %s", proto->p_name));
+		else
+			ND_PRINT((ndo, " ip-proto-%d", ipds->ip->ip_p));
+		ND_PRINT((ndo, " [reassembling]"));
+		return (1);
+	}
+
+	ip = (struct ip *)done.hdr;
+	ip->ip_len = htons(done.hdrlen + done.len);
+	ip->ip_off = 0;
+
+	ipd.ip = ip;
+	ipd.cp = done.data;
+	ipd.len = done.len;
+	ipd.off = 0;
+	ipd.nh = ip->ip_p;
+	ipd.advance = 0;
+
+	osnapend = ndo->ndo_snapend;
+	ndo->ndo_snapend = done.data + done.len;
+	if (ipd.nh != IPPROTO_TCP && ipd.nh != IPPROTO_UDP &&
+	    ipd.nh != IPPROTO_SCTP && ipd.nh != IPPROTO_DCCP) {
+		ND_PRINT((ndo, "%s > %s: ", ipaddr_string(&ip->ip_src),
+			  ipaddr_string(&ip->ip_dst)));
+	}
+	ip_print_demux(ndo, &ipd);
+	ndo->ndo_snapend = osnapend;
+	ip_reasm_release(&done);
+	return (1);
+}
+#endif
 
 /*
  * print an IP datagram.
@@ -641,6 +723,11 @@ ip_print(netdissect_options *ndo,
 #endif
 	}
 
+#ifdef USE_IP_REASSEMBLY
+	if (ip_print_reasm(ndo, ipds, hlen))
+		return;
+#endif
+
 	/*
 	 * If this is fragment zero, hand it to the next higher
 	 * level protocol.
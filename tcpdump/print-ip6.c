@@ -44,6 +44,15 @@ static const char rcsid[] _U_ =
 #include "ip6.h"
 #include "ipproto.h"
 
+/*
+ * Fragments can be put back together before the next header is printed
+ * with --ip-defrag
+ */
+#ifdef __APPLE__
+#define USE_IP6_REASSEMBLY
+#include "ipreasm.h"
+#endif
+
 /*
  * Compute a V6-style checksum by building a pseudoheader.
  */
@@ -75,6 +84,9 @@ nextproto6_cksum(const struct ip6_hdr *ip6, const u_int8_t *data,
         return in_cksum(vec, 2);
 }
 
+static void ip6_print_nh(netdissect_options *, const struct ip6_hdr *,
+			 const u_char *, int, u_int, int, int);
+
 /*
  * print an IP6 datagram.
  */
@@ -82,13 +94,9 @@ void
 ip6_print(netdissect_options *ndo, const u_char *bp, u_int length)
 {
 	register const struct ip6_hdr *ip6;
-	register int advance;
 	u_int len;
 	const u_char *ipend;
-	register const u_char *cp;
 	register u_int payload_len;
-	int nh;
-	int fragmented = 0;
 	u_int flow;
 
 	ip6 = (const struct ip6_hdr *)bp;
@@ -139,9 +147,27 @@ ip6_print(netdissect_options *ndo, const u_char *bp, u_int length)
 	if (ipend < ndo->ndo_snapend)
 		ndo->ndo_snapend = ipend;
 
-	cp = (const u_char *)ip6;
-	advance = sizeof(struct ip6_hdr);
-	nh = ip6->ip6_nxt;
+	ip6_print_nh(ndo, ip6, (const u_char *)ip6, sizeof(struct ip6_hdr),
+		     len, ip6->ip6_nxt, 0);
+	return;
+trunc:
+	(void)ND_PRINT((ndo, "[|ip6]"));
+}
+
+/*
+ * Print the headers starting after the one at cp, which is advance bytes
+ * long and is followed by a header of type nh; len is the number of
+ * bytes from cp to the end of the datagram.
+ */
+static void
+ip6_print_nh(netdissect_options *ndo, const struct ip6_hdr *ip6,
+	     const u_char *cp, int advance, u_int len, int nh, int fragmented)
+{
+#ifdef USE_IP6_REASSEMBLY
+	struct ip_reasm_done done;
+	const u_char *osnapend;
+#endif
+
 	while (cp < ndo->ndo_snapend && advance > 0) {
 		cp += advance;
 		len -= advance;
@@ -163,6 +189,25 @@ ip6_print(netdissect_options *ndo, const u_char *bp, u_int length)
 			nh = *cp;
 			break;
 		case IPPROTO_FRAGMENT:
+#ifdef USE_IP6_REASSEMBLY
+			switch (frag6_reasm(cp, (const u_char *)ip6, &done)) {
+
+			case 0:
+				return;
+
+			case 1:
+				osnapend = ndo->ndo_snapend;
+				ndo->ndo_snapend = done.data + done.len;
+				cp = done.data - sizeof(struct ip6_frag);
+				advance = frag6_print(cp, done.hdr);
+				ip6_print_nh(ndo, (const struct ip6_hdr *)done.hdr,
+				    cp, advance, done.len + sizeof(struct ip6_frag),
+				    *cp, 0);
+				ndo->ndo_snapend = osnapend;
+				ip_reasm_release(&done);
+				return;
+			}
+#endif
 			advance = frag6_print(cp, (const u_char *)ip6);
 			if (ndo->ndo_snapend <= cp + advance)
 				return;
@@ -262,10 +307,6 @@ ip6_print(netdissect_options *ndo, const u_char *bp, u_int length)
 			return;
 		}
 	}
-
-	return;
-trunc:
-	(void)ND_PRINT((ndo, "[|ip6]"));
 }
 
 #endif /* INET6 */
@@ -2051,6 +2051,9 @@ ikev2_e_print(netdissect_options *ndo,
 	struct isakmp_gen e;
 	u_char *dat;
 	volatile int dlen;
+#ifdef HAVE_LIBCRYPTO
+	const u_char *opacketp, *osnapend;
+#endif
 
 	ND_TCHECK(*ext);
 	safememcpy(&e, ext, sizeof(e));
@@ -2070,6 +2073,8 @@ ikev2_e_print(netdissect_options *ndo,
 	
 #ifdef HAVE_LIBCRYPTO
 	/* try to decypt it! */
+	opacketp = ndo->ndo_packetp;
+	osnapend = ndo->ndo_snapend;
 	if(esp_print_decrypt_buffer_by_ikev2(ndo,
 					     base->flags & ISAKMP_FLAG_I,
 					     base->i_ck, base->r_ck,
@@ -2080,6 +2085,10 @@ ikev2_e_print(netdissect_options *ndo,
 		/* got it decrypted, print stuff inside. */
 		ikev2_sub_print(ndo, base, e.np, ext, ndo->ndo_snapend,
 				phase, doi, proto, depth+1);
+
+		/* back to the packet itself */
+		ndo->ndo_packetp = opacketp;
+		ndo->ndo_snapend = osnapend;
 	}
 #endif
 	
@@ -32,6 +32,7 @@ static const char rcsid[] _U_ =
 
 #include <pcap.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "interface.h"
@@ -47,6 +48,15 @@ static const char rcsid[] _U_ =
 #endif
 #include "rpc_auth.h"
 #include "rpc_msg.h"
+#include "callcache.h"
+
+/*
+ * Reply times can be summarized per server and procedure with
+ * --nfs-stats
+ */
+#ifdef __APPLE__
+#define USE_NFS_STATS
+#endif
 
 static void nfs_printfh(const u_int32_t *, const u_int);
 static int xid_map_enter(const struct sunrpc_msg *, const u_char *);
@@ -56,6 +66,10 @@ static void interp_reply(const struct sunrpc_msg *, u_int32_t, u_int32_t, int);
 static const u_int32_t *parse_post_op_attr(const u_int32_t *, int);
 static void print_sattr3(const struct nfsv3_sattr *sa3, int verbose);
 static void print_nfsaddr(const u_char *, const char *, const char *);
+#ifdef USE_NFS_STATS
+struct xid_map_entry;
+static void nfs_stats_reply(const struct xid_map_entry *);
+#endif
 
 /*
  * Mapping of old NFS Version 2 RPC numbers to generic numbers.
@@ -898,12 +912,13 @@ nfs_printfh(register const u_int32_t *dp, const u_int len)
 }
 
 /*
- * Maintain a small cache of recent client.XID.server/proc pairs, to allow
+ * Maintain a cache of outstanding client.XID.server/proc pairs, to allow
  * us to match up replies with requests and thus to know how to parse
  * the reply.
  */
 
 struct xid_map_entry {
+	struct callcache_entry ce;	/* on xid_pending or xid_answered */
 	u_int32_t	xid;		/* transaction ID (net order) */
 	int ipver;			/* IP version (4 or 6) */
 #ifdef INET6
@@ -915,20 +930,60 @@ struct xid_map_entry {
 #endif
 	u_int32_t	proc;		/* call proc number (host order) */
 	u_int32_t	vers;		/* program version (host order) */
+	struct timeval	ts;		/* when the call was last seen */
+	int		flags;
 };
 
+#define	XID_ANSWERED	0x01
+#define	XID_RETRANS	0x02		/* call seen more than once */
+
 /*
- * Map entries are kept in an array that we manage as a ring;
- * new entries are always added at the tail of the ring.  Initially,
- * all the entries are zero and hence don't match anything.
+ * Map entries are hashed on the XID and both addresses. Calls are kept
+ * on xid_pending, oldest first, until they get a reply or XIDMAP_IDLE
+ * seconds go by; answered calls are moved to xid_answered and kept
+ * for XIDMAP_LINGER seconds to decode retransmitted replies. When
+ * XIDMAP_MAX entries are in use the oldest answered one is reused
+ * first, then the oldest pending one.
  */
 
-#define	XIDMAPSIZE	64
+#define	XIDMAP_MAX	65536
+#define	XIDMAP_IDLE	60
+#define	XIDMAP_LINGER	5
+
+#define	XIDMAP_ENTRY(cep)	((struct xid_map_entry *)(cep))
+
+static struct callcache xid_map = CALLCACHE_INIT(struct xid_map_entry);
+static struct callcache_entry xid_pending = CALLCACHE_LIST_INIT(xid_pending);
+static struct callcache_entry xid_answered = CALLCACHE_LIST_INIT(xid_answered);
+
+static void
+xid_map_expire(time_t now)
+{
+	while (xid_pending.next != &xid_pending &&
+	       now - XIDMAP_ENTRY(xid_pending.next)->ts.tv_sec > XIDMAP_IDLE)
+		callcache_remove(&xid_map, xid_pending.next);
+	while (xid_answered.next != &xid_answered &&
+	       now - XIDMAP_ENTRY(xid_answered.next)->ts.tv_sec > XIDMAP_LINGER)
+		callcache_remove(&xid_map, xid_answered.next);
+}
 
-struct xid_map_entry xid_map[XIDMAPSIZE];
+static struct xid_map_entry *
+xid_map_lookup(u_int32_t hash, u_int32_t xid, int ipver, const void *client,
+	       const void *server, size_t alen)
+{
+	struct callcache_entry *ce;
+	struct xid_map_entry *xmep;
 
-int	xid_map_next = 0;
-int	xid_map_hint = 0;
+	for (ce = callcache_chain(&xid_map, hash); ce != NULL; ce = ce->hnext) {
+		xmep = XIDMAP_ENTRY(ce);
+		if (ce->hash == hash && xmep->xid == xid &&
+		    xmep->ipver == ipver &&
+		    memcmp(&xmep->client, client, alen) == 0 &&
+		    memcmp(&xmep->server, server, alen) == 0)
+			return (xmep);
+	}
+	return (NULL);
+}
 
 static int
 xid_map_enter(const struct sunrpc_msg *rp, const u_char *bp)
@@ -938,42 +993,56 @@ xid_map_enter(const struct sunrpc_msg *rp, const u_char *bp)
 	struct ip6_hdr *ip6 = NULL;
 #endif
 	struct xid_map_entry *xmep;
+	const void *client, *server;
+	size_t alen;
+	u_int32_t hash;
+	int ipver;
 
 	if (!TTEST(rp->rm_call.cb_vers))
 		return (0);
 	switch (IP_V((struct ip *)bp)) {
 	case 4:
 		ip = (struct ip *)bp;
+		ipver = 4;
+		client = &ip->ip_src;
+		server = &ip->ip_dst;
+		alen = sizeof(ip->ip_src);
 		break;
 #ifdef INET6
 	case 6:
 		ip6 = (struct ip6_hdr *)bp;
+		ipver = 6;
+		client = &ip6->ip6_src;
+		server = &ip6->ip6_dst;
+		alen = sizeof(ip6->ip6_src);
 		break;
 #endif
 	default:
 		return (1);
 	}
 
-	xmep = &xid_map[xid_map_next];
-
-	if (++xid_map_next >= XIDMAPSIZE)
-		xid_map_next = 0;
-
-	xmep->xid = rp->rm_xid;
-	if (ip) {
-		xmep->ipver = 4;
-		memcpy(&xmep->client, &ip->ip_src, sizeof(ip->ip_src));
-		memcpy(&xmep->server, &ip->ip_dst, sizeof(ip->ip_dst));
-	}
-#ifdef INET6
-	else if (ip6) {
-		xmep->ipver = 6;
-		memcpy(&xmep->client, &ip6->ip6_src, sizeof(ip6->ip6_src));
-		memcpy(&xmep->server, &ip6->ip6_dst, sizeof(ip6->ip6_dst));
+	xid_map_expire(pkt_ts.tv_sec);
+	hash = callcache_hashfn(rp->rm_xid, client, server, alen);
+	xmep = xid_map_lookup(hash, rp->rm_xid, ipver, client, server, alen);
+	if (xmep != NULL) {
+		callcache_unlink(&xmep->ce);
+		xmep->flags = XID_RETRANS;
+	} else {
+		if (xid_map.count >= XIDMAP_MAX)
+			callcache_remove(&xid_map,
+			    xid_answered.next != &xid_answered ?
+			    xid_answered.next : xid_pending.next);
+		if ((xmep = XIDMAP_ENTRY(callcache_enter(&xid_map, hash))) == NULL)
+			return (1);
+		xmep->xid = rp->rm_xid;
+		xmep->ipver = ipver;
+		memcpy(&xmep->client, client, alen);
+		memcpy(&xmep->server, server, alen);
 	}
-#endif
 	xmep->proc = EXTRACT_32BITS(&rp->rm_call.cb_proc);
 	xmep->vers = EXTRACT_32BITS(&rp->rm_call.cb_vers);
+	xmep->ts = pkt_ts;
+	callcache_append(&xid_pending, &xmep->ce);
 	return (1);
 }
 
@@ -985,60 +1054,209 @@ static int
 xid_map_find(const struct sunrpc_msg *rp, const u_char *bp, u_int32_t *proc,
 	     u_int32_t *vers)
 {
-	int i;
 	struct xid_map_entry *xmep;
-	u_int32_t xid = rp->rm_xid;
 	struct ip *ip = (struct ip *)bp;
 #ifdef INET6
 	struct ip6_hdr *ip6 = (struct ip6_hdr *)bp;
 #endif
-	int cmp;
-
-	/* Start searching from where we last left off */
-	i = xid_map_hint;
-	do {
-		xmep = &xid_map[i];
-		cmp = 1;
-		if (xmep->ipver != IP_V(ip) || xmep->xid != xid)
-			goto nextitem;
-		switch (xmep->ipver) {
-		case 4:
-			if (memcmp(&ip->ip_src, &xmep->server,
-				   sizeof(ip->ip_src)) != 0 ||
-			    memcmp(&ip->ip_dst, &xmep->client,
-				   sizeof(ip->ip_dst)) != 0) {
-				cmp = 0;
-			}
-			break;
+
+	switch (IP_V(ip)) {
+	case 4:
+		xmep = xid_map_lookup(callcache_hashfn(rp->rm_xid, &ip->ip_dst,
+		    &ip->ip_src, sizeof(ip->ip_src)), rp->rm_xid, 4,
+		    &ip->ip_dst, &ip->ip_src, sizeof(ip->ip_src));
+		break;
 #ifdef INET6
-		case 6:
-			if (memcmp(&ip6->ip6_src, &xmep->server,
-				   sizeof(ip6->ip6_src)) != 0 ||
-			    memcmp(&ip6->ip6_dst, &xmep->client,
-				   sizeof(ip6->ip6_dst)) != 0) {
-				cmp = 0;
-			}
-			break;
+	case 6:
+		xmep = xid_map_lookup(callcache_hashfn(rp->rm_xid, &ip6->ip6_dst,
+		    &ip6->ip6_src, sizeof(ip6->ip6_src)), rp->rm_xid, 6,
+		    &ip6->ip6_dst, &ip6->ip6_src, sizeof(ip6->ip6_src));
+		break;
 #endif
-		default:
-			cmp = 0;
-			break;
-		}
-		if (cmp) {
-			/* match */
-			xid_map_hint = i;
-			*proc = xmep->proc;
-			*vers = xmep->vers;
-			return 0;
-		}
-	nextitem:
-		if (++i >= XIDMAPSIZE)
-			i = 0;
-	} while (i != xid_map_hint);
+	default:
+		xmep = NULL;
+		break;
+	}
+	if (xmep == NULL)
+		return (-1);
+
+	if (!(xmep->flags & XID_ANSWERED)) {
+#ifdef USE_NFS_STATS
+		if (nfs_stats && !(xmep->flags & XID_RETRANS))
+			nfs_stats_reply(xmep);
+#endif
+		xmep->flags |= XID_ANSWERED;
+		xmep->ts = pkt_ts;
+		callcache_unlink(&xmep->ce);
+		callcache_append(&xid_answered, &xmep->ce);
+	}
+	*proc = xmep->proc;
+	*vers = xmep->vers;
+	return 0;
+}
 
-	/* search failed */
-	return (-1);
+#ifdef USE_NFS_STATS
+/*
+ * Reply times for --nfs-stats, per server and procedure, from a call to
+ * its first reply. Calls that were sent more than once are left out, as
+ * it is not known which one was answered.
+ */
+
+#define	NFSLAT_NBUCKET	14
+#define	NFSSRV_HASHSIZE	64
+
+static const u_int32_t nfslat_bound[NFSLAT_NBUCKET - 1] = {
+	100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000,
+	100000, 200000, 500000, 1000000
+};
+
+static const char *nfslat_label[NFSLAT_NBUCKET] = {
+	"<100us", "<200us", "<500us", "<1ms", "<2ms", "<5ms", "<10ms",
+	"<20ms", "<50ms", "<100ms", "<200ms", "<500ms", "<1s", ">=1s"
+};
+
+static struct tok nfsproc_str[] = {
+	{ NFSPROC_NULL,		"null" },
+	{ NFSPROC_GETATTR,	"getattr" },
+	{ NFSPROC_SETATTR,	"setattr" },
+	{ NFSPROC_LOOKUP,	"lookup" },
+	{ NFSPROC_ACCESS,	"access" },
+	{ NFSPROC_READLINK,	"readlink" },
+	{ NFSPROC_READ,		"read" },
+	{ NFSPROC_WRITE,	"write" },
+	{ NFSPROC_CREATE,	"create" },
+	{ NFSPROC_MKDIR,	"mkdir" },
+	{ NFSPROC_SYMLINK,	"symlink" },
+	{ NFSPROC_MKNOD,	"mknod" },
+	{ NFSPROC_REMOVE,	"remove" },
+	{ NFSPROC_RMDIR,	"rmdir" },
+	{ NFSPROC_RENAME,	"rename" },
+	{ NFSPROC_LINK,		"link" },
+	{ NFSPROC_READDIR,	"readdir" },
+	{ NFSPROC_READDIRPLUS,	"readdirplus" },
+	{ NFSPROC_FSSTAT,	"fsstat" },
+	{ NFSPROC_FSINFO,	"fsinfo" },
+	{ NFSPROC_PATHCONF,	"pathconf" },
+	{ NFSPROC_COMMIT,	"commit" },
+	{ NQNFSPROC_GETLEASE,	"getlease" },
+	{ NQNFSPROC_VACATED,	"vacated" },
+	{ NQNFSPROC_EVICTED,	"evicted" },
+	{ NFSPROC_NOOP,		"nop" },
+	{ 0,			NULL }
+};
+
+struct nfs_lat {
+	u_long		count;
+	u_int64_t	total;		/* microseconds */
+	u_int32_t	max;
+	u_long		hist[NFSLAT_NBUCKET];
+};
+
+struct nfs_server {
+	struct nfs_server *hnext;
+	struct nfs_server *next;	/* in the order they were seen */
+	int		ipver;
+#ifdef INET6
+	struct in6_addr	addr;
+#else
+	struct in_addr	addr;
+#endif
+	struct nfs_lat	lat[NFS_NPROCS];
+};
+
+int nfs_stats;
+
+static struct nfs_server *nfs_server_hash[NFSSRV_HASHSIZE];
+static struct nfs_server *nfs_server_list, **nfs_server_tail = &nfs_server_list;
+
+static struct nfs_server *
+nfs_server_lookup(int ipver, const void *addr)
+{
+	struct nfs_server *ns;
+	size_t alen;
+	u_int h;
+
+	alen = ipver == 4 ? sizeof(struct in_addr) : sizeof(ns->addr);
+	h = callcache_hashfn(0, addr, addr, alen) & (NFSSRV_HASHSIZE - 1);
+	for (ns = nfs_server_hash[h]; ns != NULL; ns = ns->hnext) {
+		if (ns->ipver == ipver && memcmp(&ns->addr, addr, alen) == 0)
+			return (ns);
+	}
+	if ((ns = calloc(1, sizeof(*ns))) == NULL)
+		return (NULL);
+	ns->ipver = ipver;
+	memcpy(&ns->addr, addr, alen);
+	ns->hnext = nfs_server_hash[h];
+	nfs_server_hash[h] = ns;
+	*nfs_server_tail = ns;
+	nfs_server_tail = &ns->next;
+	return (ns);
+}
+
+static void
+nfs_stats_reply(const struct xid_map_entry *xmep)
+{
+	struct nfs_server *ns;
+	struct nfs_lat *nl;
+	u_int32_t proc = xmep->proc;
+	int64_t usec;
+	u_int i;
+
+	if (xmep->vers != NFS_VER3 && proc < NFS_NPROCS)
+		proc = nfsv3_procid[proc];
+	usec = (int64_t)(pkt_ts.tv_sec - xmep->ts.tv_sec) * 1000000 +
+	    (pkt_ts.tv_usec - xmep->ts.tv_usec);
+	if (proc >= NFS_NPROCS || usec < 0 || usec > 0xffffffffLL ||
+	    (ns = nfs_server_lookup(xmep->ipver, &xmep->server)) == NULL)
+		return;
+
+	nl = &ns->lat[proc];
+	nl->count++;
+	nl->total += usec;
+	if (usec > nl->max)
+		nl->max = usec;
+	for (i = 0; i < NFSLAT_NBUCKET - 1 && usec >= nfslat_bound[i]; i++)
+		continue;
+	nl->hist[i]++;
+}
+
+/*
+ * Print the reply times of each server, at the end of the capture or
+ * when asked with SIGINFO
+ */
+void
+nfs_stats_report(void)
+{
+	struct nfs_server *ns;
+	struct nfs_lat *nl;
+	u_int proc, i;
+
+	for (ns = nfs_server_list; ns != NULL; ns = ns->next) {
+#ifdef INET6
+		if (ns->ipver == 6)
+			printf("NFS server %s:\n", ip6addr_string(&ns->addr));
+		else
+#endif
+			printf("NFS server %s:\n", ipaddr_string(&ns->addr));
+		for (proc = 0; proc < NFS_NPROCS; proc++) {
+			nl = &ns->lat[proc];
+			if (nl->count == 0)
+				continue;
+			printf("  %-11s %lu, avg %.3f ms, max %.3f ms:",
+			    tok2str(nfsproc_str, "proc-%u", proc), nl->count,
+			    (double)nl->total / nl->count / 1000,
+			    (double)nl->max / 1000);
+			for (i = 0; i < NFSLAT_NBUCKET; i++) {
+				if (nl->hist[i] != 0)
+					printf(" %s %lu", nfslat_label[i],
+					    nl->hist[i]);
+			}
+			putchar('\n');
+		}
+	}
+	(void)fflush(stdout);
 }
+#endif /* USE_NFS_STATS */
 
 /*
  * Routines for parsing reply packets
@@ -48,11 +48,13 @@ static const char rcsid[] _U_ =
 #include <pcap.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "interface.h"
 #include "extract.h"
 #include "addrtoname.h"
 #include "ppp.h"
+#include "hdlc.h"
 #include "chdlc.h"
 #include "ethertype.h"
 #include "oui.h"
@@ -1266,11 +1268,16 @@ trunc:
 static void
 ppp_hdlc(const u_char *p, int length)
 {
-	u_char *b, *s, *t, c;
-	int i, proto;
+	u_char *b, *t;
+	int proto;
 	const void *se;
 
-	b = (u_int8_t *)malloc(length);
+	/* the frame may have been cut short by the snapshot length */
+	if (length > snapend - p)
+		length = snapend - p;
+	if (length <= 0)
+		return;
+	b = (u_int8_t *)nd_scratch_alloc(gndo, length);
 	if (b == NULL)
 		return;
 
@@ -1279,17 +1286,7 @@ ppp_hdlc(const u_char *p, int length)
 	 * Do this so that we dont overwrite the original packet
 	 * contents.
 	 */
-	for (s = (u_char *)p, t = b, i = length; i > 0; i--) {
-		c = *s++;
-		if (c == 0x7d) {
-			if (i > 1) {
-				i--;
-				c = *s++ ^ 0x20;
-			} else
-				continue;
-		}
-		*t++ = c;
-	}
+	t = ppp_hdlc_unescape(b, p, p + length);
 
 	se = snapend;
 	snapend = t;
@@ -1324,7 +1321,6 @@ ppp_hdlc(const u_char *p, int length)
 
 cleanup:
         snapend = se;
-	free(b);
         return;
 }
 
@@ -51,8 +51,12 @@ static const char rcsid[] _U_ =
 #include "extract.h"
 
 #include "rx.h"
+#include "callcache.h"
 
 #include "ip.h"
+#ifdef INET6
+#include "ip6.h"
+#endif
 
 static struct tok rx_types[] = {
 	{ RX_PACKET_TYPE_DATA,		"data" },
@@ -400,22 +404,43 @@ static struct tok rx_ack_reasons[] = {
  */
 
 struct rx_cache_entry {
+	struct callcache_entry ce;	/* on rx_cache_lru, oldest first */
 	u_int32_t	callnum;	/* Call number (net order) */
+	int		ipver;		/* IP version (4 or 6) */
+#ifdef INET6
+	struct in6_addr	client;		/* client IP address (net order) */
+	struct in6_addr	server;		/* server IP address (net order) */
+#else
 	struct in_addr	client;		/* client IP address (net order) */
 	struct in_addr	server;		/* server IP address (net order) */
+#endif
 	int		dport;		/* server port (host order) */
 	u_short		serviceId;	/* Service identifier (net order) */
 	u_int32_t	opcode;		/* RX opcode (host order) */
+	time_t		last;		/* when the call or a reply was seen */
 };
 
-#define RX_CACHE_SIZE	64
+/*
+ * A call is looked up by everything above but the opcode; call numbers
+ * only count up within a connection, so the server port and service are
+ * part of the key.  Calls stay on rx_cache_lru in the order they were
+ * last seen, a reply counting too, as a retransmitted reply is decoded
+ * with the same call.  Calls that have seen nothing for RX_CACHE_IDLE
+ * seconds are dropped, and the least recently used one when there are
+ * RX_CACHE_MAX of them.
+ */
+
+#define RX_CACHE_MAX		65536
+#define RX_CACHE_IDLE		300
 
-static struct rx_cache_entry	rx_cache[RX_CACHE_SIZE];
+#define RX_CACHE_ENTRY(cep)	((struct rx_cache_entry *)(cep))
 
-static int	rx_cache_next = 0;
-static int	rx_cache_hint = 0;
-static void	rx_cache_insert(const u_char *, const struct ip *, int);
-static int	rx_cache_find(const struct rx_header *, const struct ip *,
+static struct callcache	rx_cache = CALLCACHE_INIT(struct rx_cache_entry);
+static struct callcache_entry	rx_cache_lru = CALLCACHE_LIST_INIT(rx_cache_lru);
+static u_long	rx_cache_misses;	/* replies whose call was not found */
+
+static void	rx_cache_insert(const u_char *, const u_char *, int);
+static int	rx_cache_find(const struct rx_header *, const u_char *,
 			      int, int32_t *);
 
 static void fs_print(const u_char *, int);
@@ -513,7 +538,7 @@ rx_print(register const u_char *bp, int length, int sport, int dport,
 		 * have a chance to print out replies
 		 */
 
-		rx_cache_insert(bp, (const struct ip *) bp2, dport);
+		rx_cache_insert(bp, bp2, dport);
 
 		switch (dport) {
 			case FS_RX_PORT:	/* AFS file service */
@@ -552,8 +577,7 @@ rx_print(register const u_char *bp, int length, int sport, int dport,
 					EXTRACT_32BITS(&rxh->seq) == 1) ||
 		    rxh->type == RX_PACKET_TYPE_ABORT) &&
 		   (rxh->flags & RX_CLIENT_INITIATED) == 0 &&
-		   rx_cache_find(rxh, (const struct ip *) bp2,
-				 sport, &opcode)) {
+		   rx_cache_find(rxh, bp2, sport, &opcode)) {
 
 		switch (sport) {
 			case FS_RX_PORT:	/* AFS file service */
@@ -595,70 +619,152 @@ rx_print(register const u_char *bp, int length, int sport, int dport,
 }
 
 /*
- * Insert an entry into the cache.  Taken from print-nfs.c
+ * The call number, port and service are folded into the transaction ID
+ * that callcache_hashfn() mixes with the addresses
+ */
+static u_int32_t
+rx_cache_hashfn(u_int32_t callnum, const void *client, const void *server,
+		size_t alen, int dport, u_short serviceId)
+{
+	return (callcache_hashfn(callnum ^ (dport << 16) ^ serviceId, client,
+	    server, alen));
+}
+
+static struct rx_cache_entry *
+rx_cache_lookup(u_int32_t hash, u_int32_t callnum, int ipver,
+		const void *client, const void *server, size_t alen, int dport,
+		u_short serviceId)
+{
+	struct callcache_entry *ce;
+	struct rx_cache_entry *rxent;
+
+	for (ce = callcache_chain(&rx_cache, hash); ce != NULL; ce = ce->hnext) {
+		rxent = RX_CACHE_ENTRY(ce);
+		if (ce->hash == hash && rxent->callnum == callnum &&
+		    rxent->ipver == ipver && rxent->dport == dport &&
+		    rxent->serviceId == serviceId &&
+		    memcmp(&rxent->client, client, alen) == 0 &&
+		    memcmp(&rxent->server, server, alen) == 0)
+			return (rxent);
+	}
+	return (NULL);
+}
+
+/*
+ * Point client and server at the source and destination addresses of
+ * the IP header, returns the IP version or 0 if it is not known
  */
+static int
+rx_cache_addrs(const u_char *bp2, const void **src, const void **dst,
+	       size_t *alen)
+{
+	const struct ip *ip = (const struct ip *) bp2;
+#ifdef INET6
+	const struct ip6_hdr *ip6 = (const struct ip6_hdr *) bp2;
+#endif
+
+	switch (IP_V(ip)) {
+	case 4:
+		*src = &ip->ip_src;
+		*dst = &ip->ip_dst;
+		*alen = sizeof(ip->ip_src);
+		return (4);
+#ifdef INET6
+	case 6:
+		*src = &ip6->ip6_src;
+		*dst = &ip6->ip6_dst;
+		*alen = sizeof(ip6->ip6_src);
+		return (6);
+#endif
+	default:
+		return (0);
+	}
+}
 
 static void
-rx_cache_insert(const u_char *bp, const struct ip *ip, int dport)
+rx_cache_insert(const u_char *bp, const u_char *bp2, int dport)
 {
 	struct rx_cache_entry *rxent;
 	const struct rx_header *rxh = (const struct rx_header *) bp;
+	const void *client, *server;
+	size_t alen;
+	u_int32_t hash;
+	int ipver;
 
 	if (snapend - bp + 1 <= (int)(sizeof(struct rx_header) + sizeof(int32_t)))
 		return;
+	if ((ipver = rx_cache_addrs(bp2, &client, &server, &alen)) == 0)
+		return;
 
-	rxent = &rx_cache[rx_cache_next];
-
-	if (++rx_cache_next >= RX_CACHE_SIZE)
-		rx_cache_next = 0;
-
-	rxent->callnum = rxh->callNumber;
-	rxent->client = ip->ip_src;
-	rxent->server = ip->ip_dst;
-	rxent->dport = dport;
-	rxent->serviceId = rxh->serviceId;
+	while (rx_cache_lru.next != &rx_cache_lru &&
+	       pkt_ts.tv_sec - RX_CACHE_ENTRY(rx_cache_lru.next)->last >
+	       RX_CACHE_IDLE)
+		callcache_remove(&rx_cache, rx_cache_lru.next);
+
+	hash = rx_cache_hashfn(rxh->callNumber, client, server, alen, dport,
+	    rxh->serviceId);
+	rxent = rx_cache_lookup(hash, rxh->callNumber, ipver, client, server,
+	    alen, dport, rxh->serviceId);
+	if (rxent != NULL)
+		callcache_unlink(&rxent->ce);
+	else {
+		if (rx_cache.count >= RX_CACHE_MAX)
+			callcache_remove(&rx_cache, rx_cache_lru.next);
+		if ((rxent = RX_CACHE_ENTRY(callcache_enter(&rx_cache,
+		    hash))) == NULL)
+			return;
+		rxent->callnum = rxh->callNumber;
+		rxent->ipver = ipver;
+		memcpy(&rxent->client, client, alen);
+		memcpy(&rxent->server, server, alen);
+		rxent->dport = dport;
+		rxent->serviceId = rxh->serviceId;
+	}
 	rxent->opcode = EXTRACT_32BITS(bp + sizeof(struct rx_header));
+	rxent->last = pkt_ts.tv_sec;
+	callcache_append(&rx_cache_lru, &rxent->ce);
 }
 
 /*
- * Lookup an entry in the cache.  Also taken from print-nfs.c
+ * Lookup an entry in the cache.
  *
  * Note that because this is a reply, we're looking at the _source_
  * port.
  */
 
 static int
-rx_cache_find(const struct rx_header *rxh, const struct ip *ip, int sport,
+rx_cache_find(const struct rx_header *rxh, const u_char *bp2, int sport,
 	      int32_t *opcode)
 {
-	int i;
 	struct rx_cache_entry *rxent;
-	u_int32_t clip = ip->ip_dst.s_addr;
-	u_int32_t sip = ip->ip_src.s_addr;
+	const void *client, *server;
+	size_t alen;
+	int ipver;
 
-	/* Start the search where we last left off */
-
-	i = rx_cache_hint;
-	do {
-		rxent = &rx_cache[i];
-		if (rxent->callnum == rxh->callNumber &&
-		    rxent->client.s_addr == clip &&
-		    rxent->server.s_addr == sip &&
-		    rxent->serviceId == rxh->serviceId &&
-		    rxent->dport == sport) {
-
-			/* We got a match! */
+	if ((ipver = rx_cache_addrs(bp2, &server, &client, &alen)) == 0)
+		return(0);
+	rxent = rx_cache_lookup(rx_cache_hashfn(rxh->callNumber, client,
+	    server, alen, sport, rxh->serviceId), rxh->callNumber, ipver,
+	    client, server, alen, sport, rxh->serviceId);
+	if (rxent == NULL) {
+		/* Our search failed */
+		rx_cache_misses++;
+		return(0);
+	}
 
-			rx_cache_hint = i;
-			*opcode = rxent->opcode;
-			return(1);
-		}
-		if (++i > RX_CACHE_SIZE)
-			i = 0;
-	} while (i != rx_cache_hint);
+	/* We got a match! */
+	rxent->last = pkt_ts.tv_sec;
+	callcache_unlink(&rxent->ce);
+	callcache_append(&rx_cache_lru, &rxent->ce);
+	*opcode = rxent->opcode;
+	return(1);
+}
 
-	/* Our search failed */
-	return(0);
+void
+rx_cache_stats(u_int *entries, u_long *misses)
+{
+	*entries = rx_cache.count;
+	*misses = rx_cache_misses;
 }
 
 /*
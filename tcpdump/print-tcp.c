@@ -56,6 +56,27 @@ __RCSID("$NetBSD: print-tcp.c,v 1.8 2007/07/24 11:53:48 drochner Exp $");
 
 #include "nameser.h"
 
+/*
+ * Segments can be put back together into whole PDUs with --reassemble,
+ * and connections summarized with --tcp-stats
+ */
+#ifdef __APPLE__
+#define USE_TCP_REASSEMBLY
+#define USE_TCP_FLOW_STATS
+#endif
+
+#ifdef USE_TCP_REASSEMBLY
+#include "tcpreasm.h"
+#define TCP_REASSEMBLE	(tcp_reasm_limit != 0)
+#else
+#define TCP_REASSEMBLE	0
+#endif
+
+#ifdef USE_TCP_FLOW_STATS
+#include "tcpflow.h"
+#include "pktcontentfilter.h"
+#endif
+
 #ifdef HAVE_LIBCRYPTO
 #include <CommonCrypto/CommonDigest.h>
 #include <signature.h>
@@ -65,6 +86,11 @@ static int tcp_verify_signature(const struct ip *ip, const struct tcphdr *tp,
 #endif
 
 static void print_tcp_rst_data(register const u_char *sp, u_int length);
+#ifdef USE_TCP_REASSEMBLY
+struct tcp_seq_hash;
+static int tcp_reasm_print(struct tcp_seq_hash *, int, u_int, u_int,
+                           u_int32_t, const u_char *, u_int);
+#endif
 
 #define MAX_RST_DATA_LEN	30
 
@@ -80,20 +106,65 @@ struct tha {
         u_int port;
 };
 
+/*
+ * Relative sequence number state, one entry per conversation.
+ *
+ * The entries are found through an open addressing table of (hash,
+ * entry) pairs, so a lookup touches one cache line of slots and then
+ * the entry it is after.  Each entry is also on one of two lists in
+ * the order it was last used: live conversations, and those that have
+ * been reset or closed in both directions.  A conversation is forgotten
+ * once it has been idle for TSEQ_IDLE seconds, or TSEQ_LINGER seconds
+ * after it closed so the last ACKs still print relative numbers, and
+ * the least recently used one goes when the table reaches its limit.
+ */
 struct tcp_seq_hash {
         struct tcp_seq_hash *nxt;
+        struct tcp_seq_hash *prv;
         struct tha addr;
         tcp_seq seq;
         tcp_seq ack;
+        u_int32_t hash;
+        u_int32_t last;         /* time of the last segment */
+        u_int flags;
+#ifdef USE_TCP_REASSEMBLY
+        struct tcp_stream *rs;  /* both directions, with --reassemble */
+#endif
+#ifdef USE_TCP_FLOW_STATS
+        struct tcp_flow *fs;    /* with --tcp-stats */
+#endif
+};
+
+#define TSEQ_FIN        0x01    /* FIN seen from the src side */
+#define TSEQ_FIN_REV    0x02    /* FIN seen from the dst side */
+#define TSEQ_CLOSED     0x04    /* on tseq_closed */
+#define TSEQ_V6         0x08    /* addr holds IPv6 addresses */
+#define TSEQ_REPORTED   0x10    /* flow summary printed */
+
+#define TSEQ_IDLE       (2 * 60 * 60)
+#define TSEQ_LINGER     (2 * 60)
+#define TSEQ_LIMIT      (256 * 1024)
+#define TSEQ_BLOCK      1024    /* entries allocated at a time */
+
+struct tseq_slot {
+        u_int32_t hash;
+        struct tcp_seq_hash *th;
 };
 
-#define TSEQ_HASHSIZE 919
+static struct tseq_slot *tseq_slots;
+static u_int tseq_mask;
+static u_int tseq_count;
+static u_int tseq_limit = TSEQ_LIMIT;
+static u_long tseq_evicted;
+static struct tcp_seq_hash *tseq_free;
+
+/* list heads; only nxt and prv are used */
+static struct tcp_seq_hash tseq_live = { &tseq_live, &tseq_live };
+static struct tcp_seq_hash tseq_closed = { &tseq_closed, &tseq_closed };
 
 /* These tcp optinos do not have the size octet */
 #define ZEROLENOPT(o) ((o) == TCPOPT_EOL || (o) == TCPOPT_NOP)
 
-static struct tcp_seq_hash tcp_seq_hash[TSEQ_HASHSIZE];
-
 struct tok tcp_flag_values[] = {
         { TH_FIN, "F" },
         { TH_SYN, "S" },
@@ -138,6 +209,321 @@ struct tok mptcp_subtypes[] = {
 	{ 0, NULL }
 };
 
+void
+tcp_set_state_limit(u_int limit)
+{
+        tseq_limit = limit;
+}
+
+void
+tcp_state_stats(u_int *tracked, u_long *evicted)
+{
+        *tracked = tseq_count;
+        *evicted = tseq_evicted;
+}
+
+static u_int32_t
+tseq_hashfn(const struct tha *tha)
+{
+        const u_int32_t *w = (const u_int32_t *)tha;
+        u_int32_t h = 0, k;
+        u_int i;
+
+        for (i = 0; i < sizeof(*tha) / sizeof(*w); i++) {
+                k = w[i] * 0xcc9e2d51;
+                k = (k << 15 | k >> 17) * 0x1b873593;
+                h ^= k;
+                h = (h << 13 | h >> 19) * 5 + 0xe6546b64;
+        }
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35;
+        h ^= h >> 16;
+        return (h);
+}
+
+static struct tcp_seq_hash *
+tseq_lookup(const struct tha *tha, u_int32_t h)
+{
+        register struct tseq_slot *sp;
+        register u_int i;
+
+        if (tseq_slots == NULL)
+                return (NULL);
+        for (i = h & tseq_mask; (sp = &tseq_slots[i])->th != NULL;
+             i = (i + 1) & tseq_mask)
+                if (sp->hash == h &&
+                    memcmp(&sp->th->addr, tha, sizeof(*tha)) == 0)
+                        return (sp->th);
+        return (NULL);
+}
+
+static void
+tseq_grow(void)
+{
+        struct tseq_slot *slots;
+        u_int i, j, size, mask;
+
+        size = tseq_slots != NULL ? (tseq_mask + 1) * 2 : 1024;
+        mask = size - 1;
+        slots = (struct tseq_slot *)calloc(size, sizeof(*slots));
+        if (slots == NULL)
+                error("tcp_print: calloc");
+        if (tseq_slots != NULL) {
+                for (i = 0; i <= tseq_mask; i++) {
+                        if (tseq_slots[i].th == NULL)
+                                continue;
+                        for (j = tseq_slots[i].hash & mask; slots[j].th != NULL;
+                             j = (j + 1) & mask)
+                                continue;
+                        slots[j] = tseq_slots[i];
+                }
+                free(tseq_slots);
+        }
+        tseq_slots = slots;
+        tseq_mask = mask;
+}
+
+static void
+tseq_unlink(register struct tcp_seq_hash *th)
+{
+        th->prv->nxt = th->nxt;
+        th->nxt->prv = th->prv;
+}
+
+static void
+tseq_append(register struct tcp_seq_hash *list, register struct tcp_seq_hash *th)
+{
+        th->nxt = list;
+        th->prv = list->prv;
+        list->prv->nxt = th;
+        list->prv = th;
+}
+
+#ifdef USE_TCP_FLOW_STATS
+static void tcp_flow_report(struct tcp_seq_hash *, int);
+#endif
+
+static void
+tseq_remove(struct tcp_seq_hash *th)
+{
+        register u_int i, j, k;
+
+        for (i = th->hash & tseq_mask; tseq_slots[i].th != th;
+             i = (i + 1) & tseq_mask)
+                continue;
+        /*
+         * Move back the entries after the hole that could no longer
+         * be reached from their home slot.
+         */
+        for (j = i;;) {
+                j = (j + 1) & tseq_mask;
+                if (tseq_slots[j].th == NULL)
+                        break;
+                k = tseq_slots[j].hash & tseq_mask;
+                if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                        continue;
+                tseq_slots[i] = tseq_slots[j];
+                i = j;
+        }
+        tseq_slots[i].th = NULL;
+
+#ifdef USE_TCP_REASSEMBLY
+        if (th->rs != NULL) {
+                tcp_stream_free(&th->rs[0]);
+                tcp_stream_free(&th->rs[1]);
+                free(th->rs);
+        }
+#endif
+#ifdef USE_TCP_FLOW_STATS
+        if (th->fs != NULL) {
+                tcp_flow_report(th, 1);
+                tcp_flow_free(th->fs);
+        }
+#endif
+        tseq_unlink(th);
+        th->nxt = tseq_free;
+        tseq_free = th;
+        tseq_count--;
+        tseq_evicted++;
+}
+
+static void
+tseq_expire(u_int32_t now)
+{
+        while (tseq_live.nxt != &tseq_live &&
+               (int32_t)(now - tseq_live.nxt->last) > TSEQ_IDLE)
+                tseq_remove(tseq_live.nxt);
+        while (tseq_closed.nxt != &tseq_closed &&
+               (int32_t)(now - tseq_closed.nxt->last) > TSEQ_LINGER)
+                tseq_remove(tseq_closed.nxt);
+}
+
+/*
+ * Note the segment flags and move the conversation to the end of its
+ * list. Returns 1 if the conversation was just closed.
+ */
+static int
+tseq_touch(register struct tcp_seq_hash *th, u_int flags, int rev,
+           u_int32_t now)
+{
+        int closed = 0;
+
+        if (flags & TH_FIN)
+                th->flags |= rev ? TSEQ_FIN_REV : TSEQ_FIN;
+        if (!(th->flags & TSEQ_CLOSED) &&
+            ((flags & TH_RST) ||
+             (th->flags & (TSEQ_FIN | TSEQ_FIN_REV)) ==
+             (TSEQ_FIN | TSEQ_FIN_REV))) {
+                th->flags |= TSEQ_CLOSED;
+                closed = 1;
+        }
+        th->last = now;
+        tseq_unlink(th);
+        tseq_append((th->flags & TSEQ_CLOSED) ?
+            &tseq_closed : &tseq_live, th);
+        return (closed);
+}
+
+static struct tcp_seq_hash *
+tseq_insert(const struct tha *tha, u_int32_t h)
+{
+        register struct tcp_seq_hash *th;
+        register u_int i;
+
+        if (tseq_count >= tseq_limit)
+                tseq_remove(tseq_closed.nxt != &tseq_closed ?
+                    tseq_closed.nxt : tseq_live.nxt);
+        if (tseq_slots == NULL || (tseq_count + 1) * 4 > (tseq_mask + 1) * 3)
+                tseq_grow();
+        if (tseq_free == NULL) {
+                th = (struct tcp_seq_hash *)calloc(TSEQ_BLOCK, sizeof(*th));
+                if (th == NULL)
+                        error("tcp_print: calloc");
+                for (i = 0; i < TSEQ_BLOCK; i++) {
+                        th[i].nxt = tseq_free;
+                        tseq_free = &th[i];
+                }
+        }
+        th = tseq_free;
+        tseq_free = th->nxt;
+        memset(th, 0, sizeof(*th));
+        th->addr = *tha;
+        th->hash = h;
+
+        for (i = h & tseq_mask; tseq_slots[i].th != NULL;
+             i = (i + 1) & tseq_mask)
+                continue;
+        tseq_slots[i].hash = h;
+        tseq_slots[i].th = th;
+        tseq_append(&tseq_live, th);
+        tseq_count++;
+        return (th);
+}
+
+/*
+ * Fill in the key of the conversation of a segment and return whether
+ * the segment goes from its dst to its src
+ */
+static int
+tcp_conv_key(struct tha *tha, const u_char *bp2, u_int sport, u_int dport)
+{
+        const struct ip *ip = (const struct ip *)bp2;
+#ifdef INET6
+        const struct ip6_hdr *ip6;
+#endif
+        const void *src, *dst;
+        register int rev;
+
+#ifdef INET6
+        if (IP_V(ip) == 6)
+                ip6 = (const struct ip6_hdr *)bp2;
+        else
+                ip6 = NULL;
+
+        rev = 0;
+        if (ip6) {
+                src = &ip6->ip6_src;
+                dst = &ip6->ip6_dst;
+                if (sport > dport)
+                        rev = 1;
+                else if (sport == dport) {
+                        if (memcmp(src, dst, sizeof ip6->ip6_dst) > 0)
+                                rev = 1;
+                }
+                if (rev) {
+                        memcpy(&tha->src, dst, sizeof ip6->ip6_dst);
+                        memcpy(&tha->dst, src, sizeof ip6->ip6_src);
+                        tha->port = dport << 16 | sport;
+                } else {
+                        memcpy(&tha->dst, dst, sizeof ip6->ip6_dst);
+                        memcpy(&tha->src, src, sizeof ip6->ip6_src);
+                        tha->port = sport << 16 | dport;
+                }
+        } else {
+                /*
+                 * Zero out the tha structure; the src and dst
+                 * fields are big enough to hold an IPv6
+                 * address, but we only have IPv4 addresses
+                 * and thus must clear out the remaining 124
+                 * bits.
+                 *
+                 * XXX - should we just clear those bytes after
+                 * copying the IPv4 addresses, rather than
+                 * zeroing out the entire structure and then
+                 * overwriting some of the zeroes?
+                 *
+                 * XXX - this could fail if we see TCP packets
+                 * with an IPv6 address with the lower 124 bits
+                 * all zero and also see TCP packes with an
+                 * IPv4 address with the same 32 bits as the
+                 * upper 32 bits of the IPv6 address in question.
+                 * Can that happen?  Is it likely enough to be
+                 * an issue?
+                 */
+                memset(tha, 0, sizeof(*tha));
+                src = &ip->ip_src;
+                dst = &ip->ip_dst;
+                if (sport > dport)
+                        rev = 1;
+                else if (sport == dport) {
+                        if (memcmp(src, dst, sizeof ip->ip_dst) > 0)
+                                rev = 1;
+                }
+                if (rev) {
+                        memcpy(&tha->src, dst, sizeof ip->ip_dst);
+                        memcpy(&tha->dst, src, sizeof ip->ip_src);
+                        tha->port = dport << 16 | sport;
+                } else {
+                        memcpy(&tha->dst, dst, sizeof ip->ip_dst);
+                        memcpy(&tha->src, src, sizeof ip->ip_src);
+                        tha->port = sport << 16 | dport;
+                }
+        }
+#else
+        rev = 0;
+        src = &ip->ip_src;
+        dst = &ip->ip_dst;
+        if (sport > dport)
+                rev = 1;
+        else if (sport == dport) {
+                if (memcmp(src, dst, sizeof ip->ip_dst) > 0)
+                        rev = 1;
+        }
+        if (rev) {
+                memcpy(&tha->src, dst, sizeof ip->ip_dst);
+                memcpy(&tha->dst, src, sizeof ip->ip_src);
+                tha->port = dport << 16 | sport;
+        } else {
+                memcpy(&tha->dst, dst, sizeof ip->ip_dst);
+                memcpy(&tha->src, src, sizeof ip->ip_src);
+                tha->port = sport << 16 | dport;
+        }
+#endif
+        return (rev);
+}
+
 static int tcp_cksum(register const struct ip *ip,
 		     register const struct tcphdr *tp,
 		     register u_int len)
@@ -159,6 +545,7 @@ tcp_print(register const u_char *bp, register u_int length,
         u_int32_t seq, ack, thseq, thack;
         u_int utoval;
         int threv;
+        register struct tcp_seq_hash *th = NULL;
 #ifdef INET6
         register const struct ip6_hdr *ip6;
 #endif
@@ -272,127 +659,58 @@ tcp_print(register const u_char *bp, register u_int length,
         flags = tp->th_flags;
         printf("Flags [%s]", bittok2str_nosep(tcp_flag_values, "none", flags));
 
-        if (!Sflag && (flags & TH_ACK)) {
-                register struct tcp_seq_hash *th;
-                const void *src, *dst;
+        /*
+         * The conversation is also looked up with -S when reassembling,
+         * as the streams hang off it.
+         */
+        if ((!Sflag || TCP_REASSEMBLE) && (flags & TH_ACK)) {
                 register int rev;
                 struct tha tha;
+                u_int32_t h, now;
                 /*
                  * Find (or record) the initial sequence numbers for
                  * this conversation.  (we pick an arbitrary
                  * collating order so there's only one entry for
                  * both directions).
                  */
-#ifdef INET6
-                rev = 0;
-                if (ip6) {
-                        src = &ip6->ip6_src;
-                        dst = &ip6->ip6_dst;
-                        if (sport > dport)
-                                rev = 1;
-                        else if (sport == dport) {
-                                if (memcmp(src, dst, sizeof ip6->ip6_dst) > 0)
-                                        rev = 1;
-                        }
-                        if (rev) {
-                                memcpy(&tha.src, dst, sizeof ip6->ip6_dst);
-                                memcpy(&tha.dst, src, sizeof ip6->ip6_src);
-                                tha.port = dport << 16 | sport;
-                        } else {
-                                memcpy(&tha.dst, dst, sizeof ip6->ip6_dst);
-                                memcpy(&tha.src, src, sizeof ip6->ip6_src);
-                                tha.port = sport << 16 | dport;
-                        }
-                } else {
-                        /*
-                         * Zero out the tha structure; the src and dst
-                         * fields are big enough to hold an IPv6
-                         * address, but we only have IPv4 addresses
-                         * and thus must clear out the remaining 124
-                         * bits.
-                         *
-                         * XXX - should we just clear those bytes after
-                         * copying the IPv4 addresses, rather than
-                         * zeroing out the entire structure and then
-                         * overwriting some of the zeroes?
-                         *
-                         * XXX - this could fail if we see TCP packets
-                         * with an IPv6 address with the lower 124 bits
-                         * all zero and also see TCP packes with an
-                         * IPv4 address with the same 32 bits as the
-                         * upper 32 bits of the IPv6 address in question.
-                         * Can that happen?  Is it likely enough to be
-                         * an issue?
-                         */
-                        memset(&tha, 0, sizeof(tha));
-                        src = &ip->ip_src;
-                        dst = &ip->ip_dst;
-                        if (sport > dport)
-                                rev = 1;
-                        else if (sport == dport) {
-                                if (memcmp(src, dst, sizeof ip->ip_dst) > 0)
-                                        rev = 1;
-                        }
-                        if (rev) {
-                                memcpy(&tha.src, dst, sizeof ip->ip_dst);
-                                memcpy(&tha.dst, src, sizeof ip->ip_src);
-                                tha.port = dport << 16 | sport;
-                        } else {
-                                memcpy(&tha.dst, dst, sizeof ip->ip_dst);
-                                memcpy(&tha.src, src, sizeof ip->ip_src);
-                                tha.port = sport << 16 | dport;
-                        }
-                }
-#else
-                rev = 0;
-                src = &ip->ip_src;
-                dst = &ip->ip_dst;
-                if (sport > dport)
-                        rev = 1;
-                else if (sport == dport) {
-                        if (memcmp(src, dst, sizeof ip->ip_dst) > 0)
-                                rev = 1;
-                }
-                if (rev) {
-                        memcpy(&tha.src, dst, sizeof ip->ip_dst);
-                        memcpy(&tha.dst, src, sizeof ip->ip_src);
-                        tha.port = dport << 16 | sport;
-                } else {
-                        memcpy(&tha.dst, dst, sizeof ip->ip_dst);
-                        memcpy(&tha.src, src, sizeof ip->ip_src);
-                        tha.port = sport << 16 | dport;
-                }
-#endif
+                rev = tcp_conv_key(&tha, bp2, sport, dport);
 
                 threv = rev;
-                for (th = &tcp_seq_hash[tha.port % TSEQ_HASHSIZE];
-                     th->nxt; th = th->nxt)
-                        if (memcmp((char *)&tha, (char *)&th->addr,
-                                   sizeof(th->addr)) == 0)
-                                break;
+                now = (u_int32_t)pkt_ts.tv_sec;
+                tseq_expire(now);
+                h = tseq_hashfn(&tha);
+                th = tseq_lookup(&tha, h);
 
-                if (!th->nxt || (flags & TH_SYN)) {
+                if (th == NULL || (flags & TH_SYN)) {
                         /* didn't find it or new conversation */
-                        if (th->nxt == NULL) {
-                                th->nxt = (struct tcp_seq_hash *)
-                                        calloc(1, sizeof(*th));
-                                if (th->nxt == NULL)
-                                        error("tcp_print: calloc");
-                        }
-                        th->addr = tha;
+                        if (th == NULL)
+                                th = tseq_insert(&tha, h);
+                        th->flags = 0;
                         if (rev)
                                 th->ack = seq, th->seq = ack - 1;
                         else
                                 th->seq = seq, th->ack = ack - 1;
-                } else {
+#ifdef USE_TCP_REASSEMBLY
+                        if (th->rs != NULL) {
+                                tcp_stream_free(&th->rs[0]);
+                                tcp_stream_free(&th->rs[1]);
+                        }
+#endif
+                } else if (!Sflag) {
                         if (rev)
                                 seq -= th->ack, ack -= th->seq;
                         else
                                 seq -= th->seq, ack -= th->ack;
                 }
 
-                thseq = th->seq;
-                thack = th->ack;
+                (void)tseq_touch(th, flags, rev, now);
+
+                if (Sflag)
+                        thseq = thack = threv = 0;
+                else {
+                        thseq = th->seq;
+                        thack = th->ack;
+                }
         } else {
                 /*fool gcc*/
                 thseq = thack = threv = 0;
@@ -969,6 +1287,14 @@ tcp_print(register const u_char *bp, register u_int length,
                 return;
         }
 
+#ifdef USE_TCP_REASSEMBLY
+        if (th != NULL && TCP_REASSEMBLE &&
+            tcp_reasm_print(th, threv, sport, dport,
+            EXTRACT_32BITS(&tp->th_seq) + ((flags & TH_SYN) ? 1 : 0),
+            bp, length))
+                return;
+#endif
+
         if (sport == TELNET_PORT || dport == TELNET_PORT) {
                 if (!qflag && vflag)
                         telnet_print(bp, length);
@@ -1013,6 +1339,290 @@ tcp_print(register const u_char *bp, register u_int length,
                 putchar('>');
 }
 
+#ifdef USE_TCP_REASSEMBLY
+/*
+ * PDU framing for --reassemble
+ */
+static int
+bgp_frame(const u_char *p, u_int len)
+{
+        static const u_char marker[16] = {
+                0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+        };
+        u_int plen;
+
+        if (len < 19)
+                return (memcmp(p, marker, len) == 0 ? 0 : -1);
+        plen = EXTRACT_16BITS(p + 16);
+        if (memcmp(p, marker, 16) != 0 || plen < 19)
+                return (-1);
+        return (plen);
+}
+
+static void
+bgp_pdu_print(const u_char *p, u_int len)
+{
+        bgp_print(p, len);
+}
+
+/* DNS and RPC records both start with their length */
+static int
+dns_frame(const u_char *p, u_int len)
+{
+        u_int plen;
+
+        if (len < 2)
+                return (0);
+        plen = EXTRACT_16BITS(p);
+        if (plen < 12)          /* DNS header */
+                return (-1);
+        return (plen + 2);
+}
+
+static void
+dns_pdu_print(const u_char *p, u_int len)
+{
+        ns_print(p + 2, len - 2, 0);
+}
+
+#ifdef TCPDUMP_DO_SMB
+/* NetBIOS session header, 17 bits of length */
+static int
+nbt_frame(const u_char *p, u_int len)
+{
+        if (len < 4)
+                return (0);
+        if (p[1] & 0xfe)
+                return (-1);
+        return (((p[1] & 0x01) << 16 | EXTRACT_16BITS(p + 2)) + 4);
+}
+
+static void
+nbt_pdu_print(const u_char *p, u_int len)
+{
+        nbt_tcp_print(p, len);
+}
+
+/* SMB direct over TCP, 24 bits of length */
+static int
+smb_frame(const u_char *p, u_int len)
+{
+        if (len < 4)
+                return (0);
+        if (p[0] != 0)
+                return (-1);
+        return (EXTRACT_24BITS(p + 1) + 4);
+}
+
+static void
+smb_pdu_print(const u_char *p, u_int len)
+{
+        smb_tcp_print(p, len);
+}
+#endif
+
+static int
+msdp_frame(const u_char *p, u_int len)
+{
+        u_int plen;
+
+        if (len < 3)
+                return (0);
+        plen = EXTRACT_16BITS(p + 1);
+        if (plen < 3)
+                return (-1);
+        return (plen);
+}
+
+static int
+rpki_rtr_frame(const u_char *p, u_int len)
+{
+        u_int32_t plen;
+
+        if (len < 8)
+                return (0);
+        plen = EXTRACT_32BITS(p + 4);
+        if (plen < 8 || plen > INT32_MAX)
+                return (-1);
+        return (plen);
+}
+
+static int
+ldp_frame(const u_char *p, u_int len)
+{
+        if (len < 4)
+                return (0);
+        if (EXTRACT_16BITS(p) != 1)     /* version */
+                return (-1);
+        return (EXTRACT_16BITS(p + 2) + 4);
+}
+
+/*
+ * In the order tcp_print() tries the ports; those without a framer are
+ * never reassembled.
+ */
+static const struct tcp_pdu_type {
+        u_int16_t port;
+        tcp_pdu_framer framer;
+        tcp_pdu_printer printer;
+} tcp_pdu_types[] = {
+        { TELNET_PORT,          NULL,           NULL },
+        { BGP_PORT,             bgp_frame,      bgp_pdu_print },
+        { PPTP_PORT,            NULL,           NULL },
+#ifdef TCPDUMP_DO_SMB
+        { NETBIOS_SSN_PORT,     nbt_frame,      nbt_pdu_print },
+        { SMB_PORT,             smb_frame,      smb_pdu_print },
+#endif
+        { BEEP_PORT,            NULL,           NULL },
+        { NAMESERVER_PORT,      dns_frame,      dns_pdu_print },
+        { MULTICASTDNS_PORT,    dns_frame,      dns_pdu_print },
+        { MSDP_PORT,            msdp_frame,     msdp_print },
+        { RPKI_RTR_PORT,        rpki_rtr_frame, rpki_rtr_print },
+        { LDP_PORT,             ldp_frame,      ldp_print },
+        { 0,                    NULL,           NULL }
+};
+
+/*
+ * Feed the payload to the stream of its direction. Returns 1 when it
+ * was taken care of, 0 when it should be printed as usual.
+ */
+static int
+tcp_reasm_print(struct tcp_seq_hash *th, int rev, u_int sport, u_int dport,
+                u_int32_t seq, const u_char *bp, u_int length)
+{
+        const struct tcp_pdu_type *pt;
+        int n;
+
+        for (pt = tcp_pdu_types; pt->port != 0; pt++)
+                if (sport == pt->port || dport == pt->port)
+                        break;
+        if (pt->framer == NULL)
+                return (0);
+
+        if (th->rs == NULL) {
+                th->rs = (struct tcp_stream *)calloc(2, sizeof(*th->rs));
+                if (th->rs == NULL)
+                        return (0);
+        }
+        n = tcp_stream_segment(&th->rs[rev], seq, bp, length, pt->framer,
+            pt->printer);
+        if (n < 0)
+                return (0);
+        if (n == 0)
+                fputs(" [reassembling]", stdout);
+        return (1);
+}
+#endif /* USE_TCP_REASSEMBLY */
+
+#ifdef USE_TCP_FLOW_STATS
+/*
+ * Print the summary of a conversation; if final it is not printed again
+ */
+static void
+tcp_flow_report(struct tcp_seq_hash *th, int final)
+{
+        char src[128], dst[128];
+        const char *srcaddr, *dstaddr;
+
+        if (th->fs == NULL || (th->flags & TSEQ_REPORTED))
+                return;
+#ifdef INET6
+        if (th->flags & TSEQ_V6) {
+                srcaddr = ip6addr_string(&th->addr.src);
+                dstaddr = ip6addr_string(&th->addr.dst);
+        } else
+#endif
+        {
+                srcaddr = ipaddr_string(&th->addr.src);
+                dstaddr = ipaddr_string(&th->addr.dst);
+        }
+        (void)snprintf(src, sizeof(src), "%s.%s", srcaddr,
+            tcpport_string(th->addr.port >> 16));
+        (void)snprintf(dst, sizeof(dst), "%s.%s", dstaddr,
+            tcpport_string(th->addr.port & 0xffff));
+        tcp_flow_print(th->fs, src, dst);
+        if (final)
+                th->flags |= TSEQ_REPORTED;
+}
+
+/*
+ * Print the summaries of the conversations that are not over yet, at
+ * the end of the capture or when asked with SIGINFO
+ */
+void
+tcp_flow_report_all(int final)
+{
+        register struct tcp_seq_hash *th;
+
+        for (th = tseq_live.nxt; th != &tseq_live; th = th->nxt)
+                tcp_flow_report(th, final);
+        for (th = tseq_closed.nxt; th != &tseq_closed; th = th->nxt)
+                tcp_flow_report(th, final);
+        (void)fflush(stdout);
+}
+
+/*
+ * Account for a TCP segment with --tcp-stats, bp2 is the IP header and
+ * length what was captured from there
+ */
+void
+tcp_analyze(const u_char *bp2, u_int length)
+{
+        const struct tcphdr *tp;
+        register struct tcp_seq_hash *th;
+        struct tha tha;
+        u_int len, proto, flags, v6;
+        u_int32_t h, now;
+        int rev;
+
+        tp = (const struct tcphdr *)packet_transport_header(bp2, length,
+            &len, &proto);
+        if (tp == NULL || proto != IPPROTO_TCP)
+                return;
+        v6 = (IP_V((const struct ip *)bp2) == 6);
+#ifndef INET6
+        if (v6)
+                return;
+#endif
+
+        if (!TTEST(*tp) || TH_OFF(tp) * 4 < sizeof(*tp) ||
+            TH_OFF(tp) * 4 > len)
+                return;
+        flags = tp->th_flags;
+        len -= TH_OFF(tp) * 4;
+
+        rev = tcp_conv_key(&tha, bp2, EXTRACT_16BITS(&tp->th_sport),
+            EXTRACT_16BITS(&tp->th_dport));
+        now = (u_int32_t)pkt_ts.tv_sec;
+        tseq_expire(now);
+        h = tseq_hashfn(&tha);
+        th = tseq_lookup(&tha, h);
+        if (th != NULL && (flags & (TH_SYN | TH_ACK)) == TH_SYN &&
+            (th->flags & TSEQ_CLOSED)) {
+                /* the ports are used again for a new connection */
+                tcp_flow_report(th, 1);
+                tcp_flow_free(th->fs);
+                th->fs = NULL;
+                th->flags = 0;
+        }
+        if (th == NULL)
+                th = tseq_insert(&tha, h);
+        if (th->fs == NULL) {
+                if ((th->fs = tcp_flow_new()) == NULL)
+                        error("tcp_analyze: calloc");
+                th->flags = v6 ? TSEQ_V6 : 0;
+        }
+
+        tcp_flow_segment(th->fs, rev,
+            (u_int64_t)pkt_ts.tv_sec * 1000000 + pkt_ts.tv_usec, flags,
+            EXTRACT_32BITS(&tp->th_seq), EXTRACT_32BITS(&tp->th_ack),
+            EXTRACT_16BITS(&tp->th_win), len);
+        if (tseq_touch(th, flags, rev, now))
+                tcp_flow_report(th, 1);
+}
+#endif /* USE_TCP_FLOW_STATS */
+
 /*
  * RFC1122 says the following on data in RST segments:
  *
@@ -1050,58 +1660,155 @@ print_tcp_rst_data(register const u_char *sp, u_int length)
 }
 
 #ifdef HAVE_LIBCRYPTO
+/*
+ * TCP-MD5 results for each sender and receiver, printed at the end of
+ * the capture
+ */
+#define TCPSIG_HASHSIZE 256
+#define TCPSIG_MAX      4096
+
+struct tcp_sig_peer {
+        struct tcp_sig_peer *hnext;
+        struct tcp_sig_peer *next;      /* in the order they were seen */
+        struct tha addr;                /* port is 0 */
+        int v6;
+        u_long count[3];                /* by tcp_verify_signature() result */
+};
+
+static struct tcp_sig_peer *tcp_sig_hash[TCPSIG_HASHSIZE];
+static struct tcp_sig_peer *tcp_sig_list, **tcp_sig_tail = &tcp_sig_list;
+static u_int tcp_sig_npeers;
+
+static void
+tcp_sig_count(const struct ip *ip, int result)
+{
+        struct tcp_sig_peer *sp;
+        struct tha tha;
+        u_int32_t h;
+        int v6 = 0;
+
+        memset(&tha, 0, sizeof(tha));
+#ifdef INET6
+        if (IP_V(ip) == 6) {
+                const struct ip6_hdr *ip6 = (const struct ip6_hdr *)ip;
+
+                memcpy(&tha.src, &ip6->ip6_src, sizeof(ip6->ip6_src));
+                memcpy(&tha.dst, &ip6->ip6_dst, sizeof(ip6->ip6_dst));
+                v6 = 1;
+        } else
+#endif
+        if (IP_V(ip) == 4) {
+                memcpy(&tha.src, &ip->ip_src, sizeof(ip->ip_src));
+                memcpy(&tha.dst, &ip->ip_dst, sizeof(ip->ip_dst));
+        } else
+                return;
+
+        h = tseq_hashfn(&tha) & (TCPSIG_HASHSIZE - 1);
+        for (sp = tcp_sig_hash[h]; sp != NULL; sp = sp->hnext)
+                if (sp->v6 == v6 && memcmp(&sp->addr, &tha, sizeof(tha)) == 0)
+                        break;
+        if (sp == NULL) {
+                if (tcp_sig_npeers >= TCPSIG_MAX ||
+                    (sp = calloc(1, sizeof(*sp))) == NULL)
+                        return;
+                sp->addr = tha;
+                sp->v6 = v6;
+                sp->hnext = tcp_sig_hash[h];
+                tcp_sig_hash[h] = sp;
+                *tcp_sig_tail = sp;
+                tcp_sig_tail = &sp->next;
+                tcp_sig_npeers++;
+        }
+        sp->count[result]++;
+}
+
+void
+tcp_signature_report(void)
+{
+        struct tcp_sig_peer *sp;
+        const char *src, *dst;
+
+        for (sp = tcp_sig_list; sp != NULL; sp = sp->next) {
+#ifdef INET6
+                if (sp->v6) {
+                        src = ip6addr_string(&sp->addr.src);
+                        dst = ip6addr_string(&sp->addr.dst);
+                } else
+#endif
+                {
+                        src = ipaddr_string(&sp->addr.src);
+                        dst = ipaddr_string(&sp->addr.dst);
+                }
+                printf("TCP-MD5 %s > %s: %lu valid, %lu invalid, "
+                    "%lu not checked\n", src, dst,
+                    sp->count[SIGNATURE_VALID], sp->count[SIGNATURE_INVALID],
+                    sp->count[CANT_CHECK_SIGNATURE]);
+        }
+        (void)fflush(stdout);
+}
+
+/*
+ * RFC 2385: MD5 over the pseudo-header, the TCP header without options
+ * and with a zero checksum, the data and the secret.  The pseudo-header
+ * holds the segment length, so nothing can be hashed ahead of time; the
+ * headers are laid out in one buffer to hash them in a single update.
+ */
 static int
 tcp_verify_signature(const struct ip *ip, const struct tcphdr *tp,
                      const u_char *data, int length, const u_char *rcvsig)
 {
+        static const char *secret;
+        static size_t secretlen;
         struct tcphdr tp1;
+        u_char hdr[40 + sizeof(struct tcphdr)];
         u_char sig[TCP_SIGLEN];
-        char zero_proto = 0;
         CC_MD5_CTX ctx;
-        u_int16_t savecsum, tlen;
+        u_int hlen, tlen;
+        int result;
 #ifdef INET6
-        struct ip6_hdr *ip6;
-        u_int32_t len32;
-        u_int8_t nxt;
+        const struct ip6_hdr *ip6;
 #endif
 
 	if (data + length > snapend) {
 		printf("snaplen too short, ");
-		return (CANT_CHECK_SIGNATURE);
+		result = CANT_CHECK_SIGNATURE;
+		goto done;
 	}
 
-        tp1 = *tp;
-
         if (sigsecret == NULL) {
 		printf("shared secret not supplied with -M, ");
-                return (CANT_CHECK_SIGNATURE);
+		result = CANT_CHECK_SIGNATURE;
+		goto done;
+        }
+        if (secret != sigsecret) {
+                secret = sigsecret;
+                secretlen = strlen(secret);
         }
 
-        CC_MD5_Init(&ctx);
         /*
-         * Step 1: Update MD5 hash with IP pseudo-header.
+         * Step 1: IP pseudo-header.
          */
         if (IP_V(ip) == 4) {
-                CC_MD5_Update(&ctx, (char *)&ip->ip_src, sizeof(ip->ip_src));
-                CC_MD5_Update(&ctx, (char *)&ip->ip_dst, sizeof(ip->ip_dst));
-                CC_MD5_Update(&ctx, (char *)&zero_proto, sizeof(zero_proto));
-                CC_MD5_Update(&ctx, (char *)&ip->ip_p, sizeof(ip->ip_p));
-                tlen = EXTRACT_16BITS(&ip->ip_len) - IP_HL(ip) * 4;
-                tlen = htons(tlen);
-                CC_MD5_Update(&ctx, (char *)&tlen, sizeof(tlen));
+                memcpy(hdr, &ip->ip_src, sizeof(ip->ip_src));
+                memcpy(hdr + 4, &ip->ip_dst, sizeof(ip->ip_dst));
+                hdr[8] = 0;
+                hdr[9] = ip->ip_p;
+                tlen = (EXTRACT_16BITS(&ip->ip_len) - IP_HL(ip) * 4) & 0xffff;
+                hdr[10] = tlen >> 8;
+                hdr[11] = tlen;
+                hlen = 12;
 #ifdef INET6
         } else if (IP_V(ip) == 6) {
-                ip6 = (struct ip6_hdr *)ip;
-                CC_MD5_Update(&ctx, (char *)&ip6->ip6_src, sizeof(ip6->ip6_src));
-                CC_MD5_Update(&ctx, (char *)&ip6->ip6_dst, sizeof(ip6->ip6_dst));
-                len32 = htonl(EXTRACT_16BITS(&ip6->ip6_plen));
-                CC_MD5_Update(&ctx, (char *)&len32, sizeof(len32));
-                nxt = 0;
-                CC_MD5_Update(&ctx, (char *)&nxt, sizeof(nxt));
-                CC_MD5_Update(&ctx, (char *)&nxt, sizeof(nxt));
-                CC_MD5_Update(&ctx, (char *)&nxt, sizeof(nxt));
-                nxt = IPPROTO_TCP;
-                CC_MD5_Update(&ctx, (char *)&nxt, sizeof(nxt));
+                ip6 = (const struct ip6_hdr *)ip;
+                memcpy(hdr, &ip6->ip6_src, sizeof(ip6->ip6_src));
+                memcpy(hdr + 16, &ip6->ip6_dst, sizeof(ip6->ip6_dst));
+                tlen = EXTRACT_16BITS(&ip6->ip6_plen);
+                hdr[32] = hdr[33] = 0;
+                hdr[34] = tlen >> 8;
+                hdr[35] = tlen;
+                hdr[36] = hdr[37] = hdr[38] = 0;
+                hdr[39] = IPPROTO_TCP;
+                hlen = 40;
 #endif
         } else {
 #ifdef INET6
@@ -1113,28 +1820,32 @@ tcp_verify_signature(const struct ip *ip, const struct tcphdr *tp,
         }
 
         /*
-         * Step 2: Update MD5 hash with TCP header, excluding options.
-         * The TCP checksum must be set to zero.
+         * Step 2: TCP header, excluding options, with a zero checksum.
          */
-        savecsum = tp1.th_sum;
+        tp1 = *tp;
         tp1.th_sum = 0;
-        CC_MD5_Update(&ctx, (char *)&tp1, sizeof(struct tcphdr));
-        tp1.th_sum = savecsum;
+        memcpy(hdr + hlen, &tp1, sizeof(struct tcphdr));
+
+        CC_MD5_Init(&ctx);
+        CC_MD5_Update(&ctx, hdr, hlen + sizeof(struct tcphdr));
         /*
-         * Step 3: Update MD5 hash with TCP segment data, if present.
+         * Step 3: TCP segment data, if present.
          */
         if (length > 0)
                 CC_MD5_Update(&ctx, data, length);
         /*
-         * Step 4: Update MD5 hash with shared secret.
+         * Step 4: shared secret.
          */
-        CC_MD5_Update(&ctx, sigsecret, strlen(sigsecret));
+        CC_MD5_Update(&ctx, secret, secretlen);
         CC_MD5_Final(sig, &ctx);
 
         if (memcmp(rcvsig, sig, TCP_SIGLEN) == 0)
-                return (SIGNATURE_VALID);
+                result = SIGNATURE_VALID;
         else
-                return (SIGNATURE_INVALID);
+                result = SIGNATURE_INVALID;
+done:
+        tcp_sig_count(ip, result);
+        return (result);
 }
 #endif /* HAVE_LIBCRYPTO */
 
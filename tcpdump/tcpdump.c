@@ -63,7 +63,10 @@ extern int SIZE_BUF;
 #ifdef __APPLE__
 #define __APPLE_PCAP_NG_API
 #include <sys/ioctl.h>
+#include <getopt.h>
 #include "pktmetadatafilter.h"
+#include "pktcontentfilter.h"
+#include "namecache.h"
 #endif /* __APPLE__ */
 #include <pcap.h>
 #ifdef DLT_PKTAP
@@ -74,6 +77,12 @@ extern int SIZE_BUF;
 #include <pcap/pcap-ng.h>
 #include <pcap/pcap-util.h>
 #endif
+#ifdef __APPLE__
+#include "bpf_jit.h"
+#include "tcpreasm.h"
+#include "tcpflow.h"
+#include "ipreasm.h"
+#endif /* __APPLE__ */
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -123,6 +132,7 @@ static int Lflag;			/* list available data link types and exit */
 static int Jflag;			/* list available time stamp types */
 #endif
 static char *zflag = NULL;		/* compress each savefile using a specified command (like gzip or bzip2) */
+static char *fanout_file = NULL;	/* rules to write packets to several savefiles */
 
 static int infodelay;
 static int infoprint;
@@ -150,9 +160,22 @@ static void ndo_warning(netdissect_options *ndo, const char *fmt, ...);
 #ifdef __APPLE__
 
 node_t *pkt_meta_data_expression = NULL;
+pkt_meta_data_program_t *pkt_meta_data_program = NULL;
+pkt_content_filter_t *pkt_content_filter = NULL;
+static int resolve_wait_ms = 0;		/* hold output for a new name this long */
+static char *name_cache_file = NULL;
+
+static int content_match(pcap_t *, const struct pcap_pkthdr *, const u_char *);
 
 char *open_special_device(char *);
 int pktap_filter_packet(pcap_t *, struct pcap_if_info *, const struct pcap_pkthdr *, const u_char *);
+int if_info_filter_packet(struct pcap_if_info *, const u_char *, u_int, u_int);
+void if_info_states_flush(void);
+struct pcap_if_info *if_info_find_by_id(pcap_t *, int);
+
+#else /* __APPLE__ */
+
+#define content_match(pcap, h, sp) 1
 
 #endif /* __APPLE__ */
 
@@ -422,6 +445,10 @@ static int print_packet(struct print_info *, const struct pcap_pkthdr *, const u
 static int print_pcap_ng_block(struct print_info *, const struct pcap_pkthdr *, const u_char *);
 #ifdef __APPLE__
 static int print_pktap_packet(struct print_info *, const struct pcap_pkthdr *, const u_char *);
+static int analyze_packet(struct print_info *, const struct pcap_pkthdr *, const u_char *);
+#ifdef DLT_PCAPNG
+static int analyze_pcap_ng_block(struct print_info *, const struct pcap_pkthdr *, const u_char *);
+#endif
 #endif
 
 struct dump_info;
@@ -433,6 +460,13 @@ struct dump_info {
 	pcap_t	*pcap;
 	pcap_dumper_t *dumper;
 	dump_handler_func_t dumper_func;
+	int	rotate_size;		/* rotate after this many bytes (-C) */
+	int	rotate_seconds;		/* rotate after this many seconds (-G) */
+	int	rotate_files;		/* recycle after this number of files (-W) */
+	int	rotate_chars;		/* digits of the file number */
+	int	size_count;		/* file number of the size rotation */
+	int	time_count;		/* number of files created by time rotation */
+	time_t	rotate_time;		/* last time the file was rotated */
 };
 
 int handle_pcap_dump(struct dump_info *, const struct pcap_pkthdr *, const u_char *);
@@ -440,6 +474,29 @@ int handle_bpf_exthdr_dump(struct dump_info *, const struct pcap_pkthdr *, const
 int handle_pcap_ng_dump(struct dump_info *, const struct pcap_pkthdr *, const u_char *);
 int handle_pktap_dump(struct dump_info *, const struct pcap_pkthdr *, const u_char *);
 
+#ifdef __APPLE__
+/*
+ * With --fanout every rule writes the packets that match its filter
+ * expression to its own savefile, so a single capture can feed several
+ * savefiles. Rules with the same filter program share its result.
+ */
+struct fanout_rule {
+	struct bpf_program fcode;
+	bpf_jit_filter_t *filter;
+	int	same_filter;		/* earlier rule with the same program or -1 */
+	u_int	result;
+	struct dump_info dumpinfo;
+};
+
+static struct fanout_rule *fanout_rules = NULL;
+static int fanout_count = 0;
+static int fanout_active = 0;		/* rules that have not reached their -W limit */
+
+static void fanout_open(pcap_t *, const char *, bpf_u_int32);
+static void fanout_set_pcap(pcap_t *);
+static void fanout_close(void);
+static void fanout_packet(u_char *, const struct pcap_pkthdr *, const u_char *);
+#endif /* __APPLE__ */
 
 #ifdef HAVE_PCAP_SET_TSTAMP_TYPE
 static void
@@ -548,6 +605,35 @@ show_dlts_and_exit(const char *device, pcap_t *pd)
 #define Q_FLAG
 #endif
 
+#ifdef __APPLE__
+#define OPTION_FANOUT	128
+#define OPTION_MATCH	129
+#define OPTION_RESOLVE_WAIT	130
+#define OPTION_NAME_CACHE	131
+#define OPTION_NAME_LIMIT	132
+#define OPTION_TCP_STATE_LIMIT	133
+#define OPTION_REASSEMBLE	134
+#define OPTION_TCP_STATS	135
+#define OPTION_IP_DEFRAG	136
+#define OPTION_NFS_STATS	137
+#define OPTION_DNS_STATS	138
+
+static const struct option longopts[] = {
+	{ "dns-stats", required_argument, NULL, OPTION_DNS_STATS },
+	{ "fanout", required_argument, NULL, OPTION_FANOUT },
+	{ "ip-defrag", no_argument, NULL, OPTION_IP_DEFRAG },
+	{ "match", required_argument, NULL, OPTION_MATCH },
+	{ "resolve-wait", required_argument, NULL, OPTION_RESOLVE_WAIT },
+	{ "name-cache", required_argument, NULL, OPTION_NAME_CACHE },
+	{ "name-limit", required_argument, NULL, OPTION_NAME_LIMIT },
+	{ "nfs-stats", no_argument, NULL, OPTION_NFS_STATS },
+	{ "tcp-state-limit", required_argument, NULL, OPTION_TCP_STATE_LIMIT },
+	{ "reassemble", no_argument, NULL, OPTION_REASSEMBLE },
+	{ "tcp-stats", no_argument, NULL, OPTION_TCP_STATS },
+	{ NULL, 0, NULL, 0 }
+};
+#endif /* __APPLE__ */
+
 #ifdef HAVE_PCAP_CREATE
 #define I_FLAG		"I"
 #else /* HAVE_PCAP_CREATE */
@@ -651,18 +737,19 @@ getWflagChars(int x)
 
 
 static void
-MakeFilename(char *buffer, char *orig_name, int cnt, int max_chars)
+MakeFilename(char *buffer, char *orig_name, int cnt, int max_chars,
+	     const time_t *rotate_time)
 {
         char *filename = malloc(PATH_MAX + 1);
         if (filename == NULL)
             error("Makefilename: malloc");
 
         /* Process with strftime if Gflag is set. */
-        if (Gflag != 0) {
+        if (rotate_time != NULL) {
           struct tm *local_tm;
 
           /* Convert Gflag_time to a usable format */
-          if ((local_tm = localtime(&Gflag_time)) == NULL) {
+          if ((local_tm = localtime(rotate_time)) == NULL) {
                   error("MakeTimedFilename: localtime");
           }
 
@@ -717,6 +804,11 @@ get_print_info(int type)
 				error("packet printing is not supported for link type %d: use -w", type);
 		}
 	}
+#ifdef __APPLE__
+	if (tcp_flow_stats || dns_stats_interval)
+		printinfo.printer_func = analyze_packet;
+	else
+#endif /* __APPLE__ */
 #ifdef DLT_PCAPNG
 	if (type == DLT_PCAPNG)
 		printinfo.printer_func = print_pcap_ng_block;
@@ -813,8 +905,13 @@ main(int argc, char **argv)
 	smiInit("tcpdump");
 #endif
 
+#define SHORTOPTS "@1aAb" B_FLAG "c:C:d" D_FLAG "eE:fF:" g_FLAG " G:hHi:" I_FLAG j_FLAG J_FLAG "kKlLm:M:nNoOpPq" Q_FLAG "r:Rs:StT:u" U_FLAG "vV:w:W:xXy:Yz:Z:"
 	while (
-	    (op = getopt(argc, argv, "@1aAb" B_FLAG "c:C:d" D_FLAG "eE:fF:" g_FLAG " G:hHi:" I_FLAG j_FLAG J_FLAG "kKlLm:M:nNoOpPq" Q_FLAG "r:Rs:StT:u" U_FLAG "vV:w:W:xXy:Yz:Z:")) != -1)
+#ifdef __APPLE__
+	    (op = getopt_long(argc, argv, SHORTOPTS, longopts, NULL)) != -1)
+#else
+	    (op = getopt(argc, argv, SHORTOPTS)) != -1)
+#endif
 		switch (op) {
 
 		case 'a':
@@ -1103,8 +1200,66 @@ main(int argc, char **argv)
 			pkt_meta_data_expression = parse_expression(optarg);
 			if (pkt_meta_data_expression == NULL)
 				error("invalid expression \"%s\"", optarg);
+			pkt_meta_data_program = compile_expression(pkt_meta_data_expression);
 			break;
 		}				
+
+		case OPTION_FANOUT:
+			fanout_file = optarg;
+			break;
+
+		case OPTION_MATCH:
+			if (pkt_content_filter == NULL)
+				pkt_content_filter = new_content_filter();
+			add_content_pattern(pkt_content_filter, optarg);
+			break;
+
+		case OPTION_RESOLVE_WAIT:
+			resolve_wait_ms = atoi(optarg);
+			if (resolve_wait_ms < 0)
+				error("invalid resolve wait %s", optarg);
+			break;
+
+		case OPTION_NAME_CACHE:
+			name_cache_file = optarg;
+			break;
+
+		case OPTION_NAME_LIMIT:
+			i = atoi(optarg);
+			if (i < 1024)
+				error("invalid name limit %s", optarg);
+			set_name_limit(i);
+			break;
+
+		case OPTION_TCP_STATE_LIMIT:
+			i = atoi(optarg);
+			if (i < 1024)
+				error("invalid TCP state limit %s", optarg);
+			tcp_set_state_limit(i);
+			break;
+
+		case OPTION_REASSEMBLE:
+			tcp_reasm_limit = TCP_REASM_LIMIT;
+			break;
+
+		case OPTION_TCP_STATS:
+			tcp_flow_stats = 1;
+			break;
+
+		case OPTION_IP_DEFRAG:
+			ip_reasm_limit = IP_REASM_LIMIT;
+			break;
+
+		case OPTION_NFS_STATS:
+			nfs_stats = 1;
+			break;
+
+		case OPTION_DNS_STATS:
+			i = atoi(optarg);
+			if (i < 1)
+				error("invalid DNS statistics interval %s", optarg);
+			dns_stats_interval = i;
+			break;
 #endif
 		case 'r':
 			RFileName = optarg;
@@ -1312,6 +1467,14 @@ main(int argc, char **argv)
 	if (VFileName != NULL && RFileName != NULL)
 		error("-V and -r are mutually exclusive.");
 
+	if (WFileName != NULL && fanout_file != NULL)
+		error("-w and --fanout are mutually exclusive.");
+
+#ifdef __APPLE__
+	if (pkt_content_filter != NULL)
+		compile_content_filter(pkt_content_filter);
+#endif /* __APPLE__ */
+
 #ifdef WITH_CHROOT
 	/* if run as root, prepare for chrooting */
 	if (getuid() == 0 || geteuid() == 0) {
@@ -1627,11 +1790,28 @@ main(int argc, char **argv)
 			error("%s", pcap_geterr(pd));
 
 	if (dflag) {
+#ifdef __APPLE__
+		if (pkt_meta_data_program != NULL)
+			print_program(pkt_meta_data_program);
+		if (pkt_content_filter != NULL)
+			print_content_filter(pkt_content_filter);
+#endif /* __APPLE__ */
 		bpf_dump(&fcode, dflag);
 		pcap_close(pd);
 		exit(0);
 	}
+#ifdef __APPLE__
+	if (name_cache_file != NULL)
+		namecache_open(name_cache_file);
+#endif /* __APPLE__ */
 	init_addrtoname(localnet, netmask);
+#ifdef __APPLE__
+	/*
+	 * Don't let a slow resolver stall a live capture
+	 */
+	if (!nflag && RFileName == NULL && WFileName == NULL && fanout_file == NULL)
+		init_async_resolver(resolve_wait_ms);
+#endif /* __APPLE__ */
         init_checksum();
 
 #ifndef WIN32	
@@ -1696,8 +1876,11 @@ main(int argc, char **argv)
 #endif /* HAVE_CAP_NG_H */
 
 	if (getuid() == 0 || geteuid() == 0) {
-		if (username || chroot_dir)
+		if (username || chroot_dir) {
+			/* the name tables are built lazily, from files */
+			load_addrtoname_tables();
 			droproot(username, chroot_dir);
+		}
 	}
 #endif /* WIN32 */
 
@@ -1710,6 +1893,8 @@ main(int argc, char **argv)
 
 	if (WFileName) {
 		pcap_dumper_t *p;
+
+		memset(&dumpinfo, 0, sizeof(dumpinfo));
 		/* Do not exceed the default PATH_MAX for files. */
 		dumpinfo.CurrentFileName = (char *)malloc(PATH_MAX + 1);
 
@@ -1718,9 +1903,11 @@ main(int argc, char **argv)
 
 		/* We do not need numbering for dumpfiles if Cflag isn't set. */
 		if (Cflag != 0)
-		  MakeFilename(dumpinfo.CurrentFileName, WFileName, 0, WflagChars);
+		  MakeFilename(dumpinfo.CurrentFileName, WFileName, 0, WflagChars,
+			       Gflag != 0 ? &Gflag_time : NULL);
 		else
-		  MakeFilename(dumpinfo.CurrentFileName, WFileName, 0, 0);
+		  MakeFilename(dumpinfo.CurrentFileName, WFileName, 0, 0,
+			       Gflag != 0 ? &Gflag_time : NULL);
 
 #ifdef __APPLE__
 		if (Pflag)
@@ -1737,6 +1924,11 @@ main(int argc, char **argv)
 
 		if (Cflag != 0 || Gflag != 0)
 			dumpinfo.WFileName = WFileName;
+		dumpinfo.rotate_size = Cflag;
+		dumpinfo.rotate_seconds = Gflag;
+		dumpinfo.rotate_files = Wflag;
+		dumpinfo.rotate_chars = WflagChars;
+		dumpinfo.rotate_time = Gflag_time;
 
 		callback = dump_packet;
 		dumpinfo.pcap = pd;
@@ -1760,6 +1952,12 @@ main(int argc, char **argv)
 		if (Uflag)
 			pcap_dump_flush(p);
 #endif
+#ifdef __APPLE__
+	} else if (fanout_file != NULL) {
+		fanout_open(pd, fanout_file, netmask);
+		callback = fanout_packet;
+		pcap_userdata = NULL;
+#endif /* __APPLE__ */
 	} else {
 		dlt = pcap_datalink(pd);
 		printinfo = get_print_info(dlt);
@@ -1778,7 +1976,7 @@ main(int argc, char **argv)
 		(void)setsignal(SIGNAL_REQ_INFO, requestinfo);
 #endif
 
-	if (vflag > 0 && WFileName) {
+	if (vflag > 0 && (WFileName || fanout_file)) {
 		/*
 		 * When capturing to a file, "-v" means tcpdump should,
 		 * every 10 seconds, "v"erbosely report the number of
@@ -1801,7 +1999,7 @@ main(int argc, char **argv)
 		 * to a file from the -V file).  Print a message to
 		 * the standard error on UN*X.
 		 */
-		if (!vflag && !WFileName) {
+		if (!vflag && !WFileName && !fanout_file) {
 			(void)fprintf(stderr,
 			    "%s: verbose output suppressed, use -v or -vv for full protocol decode\n",
 			    program_name);
@@ -1822,7 +2020,7 @@ main(int argc, char **argv)
 #endif /* WIN32 */
 	do {
 		status = pcap_loop(pd, -1, callback, pcap_userdata);
-		if (WFileName == NULL) {
+		if (WFileName == NULL && fanout_file == NULL) {
 			/*
 			 * We're printing packets.  Flush the printed output,
 			 * so it doesn't get intermingled with error output.
@@ -1867,7 +2065,7 @@ main(int argc, char **argv)
 				if (pd == NULL)
 					error("%s", ebuf);
 				new_dlt = pcap_datalink(pd);
-				if (WFileName && new_dlt != dlt)
+				if ((WFileName || fanout_file) && new_dlt != dlt)
 					error("%s: new dlt does not match original", RFileName);
 				dlt_name = pcap_datalink_val_to_name(new_dlt);
 				if (dlt_name == NULL) {
@@ -1882,6 +2080,10 @@ main(int argc, char **argv)
 				gndo->ndo_pcap = pd;
 				if (WFileName)
 					dumpinfo.pcap = pd;
+#ifdef __APPLE__
+				else if (fanout_file)
+					fanout_set_pcap(pd);
+#endif /* __APPLE__ */
 				else
 					printinfo.pcap = pd;
 #if defined(DLT_PCAPNG) && defined(DLT_PKTAP)
@@ -1901,12 +2103,28 @@ main(int argc, char **argv)
 		}
 	} while (ret != NULL);
 	
+#ifdef __APPLE__
+	if (tcp_flow_stats)
+		tcp_flow_report_all(1);
+	if (dns_stats_interval)
+		dns_stats_report(1);
+	if (nfs_stats)
+		nfs_stats_report();
+#endif /* __APPLE__ */
+#ifdef HAVE_LIBCRYPTO
+	if (sigsecret != NULL)
+		tcp_signature_report();
+#endif
 	if (WFileName != NULL) {
 		if (Pflag)
 			pcap_ng_dump_close(dumpinfo.dumper);
 		else
 			pcap_dump_close(dumpinfo.dumper);
 	}
+#ifdef __APPLE__
+	if (fanout_file != NULL)
+		fanout_close();
+#endif /* __APPLE__ */
 	exit(status == -1 ? 1 : 0);
 }
 
@@ -2004,6 +2222,50 @@ info(register int verbose)
 		(void)fprintf(stderr, "%u drop%s by metadata filter", packets_mtdt_fltr_drop,
 					  PLURAL_SUFFIX(packets_mtdt_fltr_drop));
 	}
+	if (vflag) {
+		u_int tcp_tracked;
+		u_long tcp_evicted;
+
+		tcp_state_stats(&tcp_tracked, &tcp_evicted);
+		if (tcp_tracked != 0 || tcp_evicted != 0) {
+			if (!verbose)
+				fputs(", ", stderr);
+			else
+				putc('\n', stderr);
+			(void)fprintf(stderr, "%u TCP connection%s tracked, %lu forgotten",
+			    tcp_tracked, PLURAL_SUFFIX(tcp_tracked), tcp_evicted);
+		}
+	}
+	if (vflag) {
+		u_int rx_calls;
+		u_long rx_misses;
+
+		rx_cache_stats(&rx_calls, &rx_misses);
+		if (rx_calls != 0 || rx_misses != 0) {
+			if (!verbose)
+				fputs(", ", stderr);
+			else
+				putc('\n', stderr);
+			(void)fprintf(stderr, "%u RX call%s tracked, %lu repl%s without a call",
+			    rx_calls, PLURAL_SUFFIX(rx_calls), rx_misses,
+			    rx_misses == 1 ? "y" : "ies");
+		}
+	}
+#ifdef __APPLE__
+	if (ip_reasm_limit != 0) {
+		u_long ip_complete, ip_incomplete, ip_overlaps;
+
+		ip_reasm_stats(&ip_complete, &ip_incomplete, &ip_overlaps);
+		if (!verbose)
+			fputs(", ", stderr);
+		else
+			putc('\n', stderr);
+		(void)fprintf(stderr, "%lu IP datagram%s reassembled, %lu incomplete, "
+		    "%lu overlapping fragment%s", ip_complete,
+		    PLURAL_SUFFIX(ip_complete), ip_incomplete, ip_overlaps,
+		    PLURAL_SUFFIX(ip_overlaps));
+	}
+#endif /* __APPLE__ */
 	if (stat.ps_ifdrop != 0) {
 		if (!verbose)
 			fputs(", ", stderr);
@@ -2013,6 +2275,18 @@ info(register int verbose)
 		    stat.ps_ifdrop, PLURAL_SUFFIX(stat.ps_ifdrop));
 	} else
 		putc('\n', stderr);
+#ifdef __APPLE__
+	if (!verbose && tcp_flow_stats)
+		tcp_flow_report_all(0);
+	if (!verbose && dns_stats_interval)
+		dns_stats_report(0);
+	if (!verbose && nfs_stats)
+		nfs_stats_report();
+#endif /* __APPLE__ */
+#ifdef HAVE_LIBCRYPTO
+	if (!verbose && sigsecret != NULL)
+		tcp_signature_report();
+#endif
 	infoprint = 0;
 }
 
@@ -2055,16 +2329,17 @@ compress_savefile(const char *filename)
 }
 #endif /* HAVE_FORK && HAVE_VFORK */
 
-static void
-dump_packet(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
+/*
+ * Write a packet to the savefile of a dump_info, rotating the savefile
+ * first as needed. Returns 1 when the packet was written.
+ */
+static int
+dump_savefile(struct dump_info *dump_info, const struct pcap_pkthdr *h,
+	      const u_char *sp)
 {
-	struct dump_info *dump_info;
-
-	++infodelay;
+	int result;
 
-	dump_info = (struct dump_info *)user;
-	
-	if (dump_info->WFileName && (Cflag != 0 || Gflag != 0)) {
+	if (dump_info->WFileName && (dump_info->rotate_size != 0 || dump_info->rotate_seconds != 0)) {
 		/*
 		 * XXX - this won't force the file to rotate on the specified time
 		 * boundary, but it will rotate on the first packet received after the
@@ -2073,7 +2348,7 @@ dump_packet(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
 		 * first thereby cancelling the Cflag boundary (since the file should
 		 * be 0).
 		 */
-		if (Gflag != 0) {
+		if (dump_info->rotate_seconds != 0) {
 			/* Check if it is time to rotate */
 			time_t t;
 			
@@ -2085,11 +2360,11 @@ dump_packet(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
 			
 			
 			/* If the time is greater than the specified window, rotate */
-			if (t - Gflag_time >= Gflag) {
+			if (t - dump_info->rotate_time >= dump_info->rotate_seconds) {
 				/* Update the Gflag_time */
-				Gflag_time = t;
+				dump_info->rotate_time = t;
 				/* Update Gflag_count */
-				Gflag_count++;
+				dump_info->time_count++;
 				/*
 				 * Close the current file and open a new one.
 				 */
@@ -2108,9 +2383,21 @@ dump_packet(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
 				 * Check to see if we've exceeded the Wflag (when
 				 * not using Cflag).
 				 */
-				if (Cflag == 0 && Wflag > 0 && Gflag_count >= Wflag) {
+				if (dump_info->rotate_size == 0 && dump_info->rotate_files > 0 && dump_info->time_count >= dump_info->rotate_files) {
+#ifdef __APPLE__
+					/*
+					 * With --fanout only this rule is done,
+					 * the other rules keep writing
+					 */
+					if (fanout_file != NULL) {
+						(void)fprintf(stderr, "%s: Maximum file limit reached: %d\n",
+									  dump_info->WFileName, dump_info->rotate_files);
+						dump_info->dumper = NULL;
+						return (0);
+					}
+#endif /* __APPLE__ */
 					(void)fprintf(stderr, "Maximum file limit reached: %d\n",
-								  Wflag);
+								  dump_info->rotate_files);
 					exit(0);
 					/* NOTREACHED */
 				}
@@ -2125,11 +2412,12 @@ dump_packet(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
 				 * rotation: e.g. 0
 				 * We also don't need numbering if Cflag is not set.
 				 */
-				if (Cflag != 0)
+				if (dump_info->rotate_size != 0)
 					MakeFilename(dump_info->CurrentFileName, dump_info->WFileName, 0,
-								 WflagChars);
+								 dump_info->rotate_chars, &dump_info->rotate_time);
 				else
-					MakeFilename(dump_info->CurrentFileName, dump_info->WFileName, 0, 0);
+					MakeFilename(dump_info->CurrentFileName, dump_info->WFileName, 0, 0,
+								 &dump_info->rotate_time);
 				
 				if (Pflag)
 					dump_info->dumper = pcap_ng_dump_open(dump_info->pcap, dump_info->CurrentFileName);
@@ -2145,7 +2433,7 @@ dump_packet(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
 		 * larger than Cflag - the last packet written to the
 		 * file could put it over Cflag.
 		 */
-		if (Cflag != 0 && pcap_dump_ftell(dump_info->dumper) > Cflag) {
+		if (dump_info->rotate_size != 0 && pcap_dump_ftell(dump_info->dumper) > dump_info->rotate_size) {
 			/*
 			 * Close the current file and open a new one.
 			 */
@@ -2160,17 +2448,18 @@ dump_packet(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
 			if (zflag != NULL)
 				compress_savefile(dump_info->CurrentFileName);
 			
-			Cflag_count++;
-			if (Wflag > 0) {
-				if (Cflag_count >= Wflag)
-					Cflag_count = 0;
+			dump_info->size_count++;
+			if (dump_info->rotate_files > 0) {
+				if (dump_info->size_count >= dump_info->rotate_files)
+					dump_info->size_count = 0;
 			}
 			if (dump_info->CurrentFileName != NULL)
 				free(dump_info->CurrentFileName);
 			dump_info->CurrentFileName = (char *)malloc(PATH_MAX + 1);
 			if (dump_info->CurrentFileName == NULL)
 				error("dump_packet_and_trunc: malloc");
-			MakeFilename(dump_info->CurrentFileName, dump_info->WFileName, Cflag_count, WflagChars);
+			MakeFilename(dump_info->CurrentFileName, dump_info->WFileName, dump_info->size_count, dump_info->rotate_chars,
+				     dump_info->rotate_seconds != 0 ? &dump_info->rotate_time : NULL);
 
 #ifdef HAVE_CAP_NG_H
 			capng_update(CAPNG_ADD, CAPNG_EFFECTIVE, CAP_DAC_OVERRIDE);
@@ -2192,14 +2481,29 @@ dump_packet(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
 		}
 	}
 	
-	if (dump_info->dumper_func(dump_info, h, sp) == 1)
-		packets_captured++;
+	result = dump_info->dumper_func(dump_info, h, sp);
 
 #ifdef HAVE_PCAP_DUMP_FLUSH
 	if (Uflag)
 		pcap_dump_flush(dump_info->dumper);
 #endif
 
+	return (result);
+}
+
+static void
+dump_packet(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
+{
+	struct dump_info *dump_info;
+
+	++infodelay;
+
+	dump_info = (struct dump_info *)user;
+
+	if (content_match(dump_info->pcap, h, sp) &&
+	    dump_savefile(dump_info, h, sp) == 1)
+		packets_captured++;
+
 	--infodelay;
 	if (infoprint)
 		info(0);
@@ -2208,6 +2512,224 @@ dump_packet(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
 		pcap_breakloop(dump_info->pcap);
 }
 
+#ifdef __APPLE__
+/*
+ * Each line of the rules file has the name of the savefile, optionally
+ * followed by -C, -G and -W rotation options, and then the filter
+ * expression for that savefile. Empty lines and lines starting with '#'
+ * are ignored.
+ */
+static void
+fanout_open(pcap_t *pcap, const char *fname, bpf_u_int32 mask)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t linecap = 0;
+	int lineno = 0;
+	int dlt, i;
+
+	dlt = pcap_datalink(pcap);
+#if defined(DLT_PCAPNG) && defined(DLT_PKTAP)
+	if (dlt == DLT_PCAPNG || dlt == DLT_PKTAP)
+		error("--fanout is not supported with link-type %s",
+		      pcap_datalink_val_to_name(dlt));
+#endif /* DLT_PCAPNG && DLT_PKTAP */
+
+	if ((fp = fopen(fname, "r")) == NULL)
+		error("can't open %s: %s", fname, pcap_strerror(errno));
+
+	while (getline(&line, &linecap, fp) != -1) {
+		struct fanout_rule *rule;
+		struct dump_info *di;
+		char *cp, *path, *opt, *val, *end;
+		long num;
+
+		lineno++;
+		cp = line + strspn(line, " \t");
+		cp[strcspn(cp, "\r\n")] = '\0';
+		if (*cp == '\0' || *cp == '#')
+			continue;
+
+		rule = realloc(fanout_rules, (fanout_count + 1) * sizeof(struct fanout_rule));
+		if (rule == NULL)
+			error("%s: realloc", __func__);
+		fanout_rules = rule;
+		rule = &fanout_rules[fanout_count];
+		memset(rule, 0, sizeof(struct fanout_rule));
+		di = &rule->dumpinfo;
+
+		path = strsep(&cp, " \t");
+		if ((di->WFileName = strdup(path)) == NULL)
+			error("%s: strdup", __func__);
+
+		/*
+		 * Rotation options come before the expression
+		 */
+		for (;;) {
+			if (cp == NULL)
+				break;
+			cp += strspn(cp, " \t");
+			if (cp[0] != '-' || strchr("CGW", cp[1]) == NULL ||
+			    (cp[2] != ' ' && cp[2] != '\t'))
+				break;
+			opt = strsep(&cp, " \t");
+			if (cp != NULL)
+				cp += strspn(cp, " \t");
+			val = strsep(&cp, " \t");
+			if (val == NULL || *val == '\0')
+				error("%s:%d: option %s requires an argument",
+				      fname, lineno, opt);
+			num = strtol(val, &end, 10);
+			if (*end != '\0' || num < 0 || num > INT_MAX ||
+			    (opt[1] == 'C' && num > INT_MAX / 1000000))
+				error("%s:%d: invalid value %s for %s",
+				      fname, lineno, val, opt);
+
+			switch (opt[1]) {
+			case 'C':
+				di->rotate_size = num * 1000000;
+				break;
+			case 'G':
+				di->rotate_seconds = num;
+				if ((di->rotate_time = time(NULL)) == (time_t)-1)
+					error("%s: can't get current time: %s",
+					      __func__, pcap_strerror(errno));
+				break;
+			case 'W':
+				di->rotate_files = num;
+				di->rotate_chars = getWflagChars(num);
+				break;
+			}
+		}
+
+		if (pcap_compile(pcap, &rule->fcode, cp != NULL ? cp : "",
+				 Oflag, mask) < 0)
+			error("%s:%d: %s", fname, lineno, pcap_geterr(pcap));
+
+		rule->same_filter = -1;
+		for (i = 0; i < fanout_count; i++) {
+			if (fanout_rules[i].same_filter == -1 &&
+			    fanout_rules[i].fcode.bf_len == rule->fcode.bf_len &&
+			    memcmp(fanout_rules[i].fcode.bf_insns, rule->fcode.bf_insns,
+				   rule->fcode.bf_len * sizeof(struct bpf_insn)) == 0) {
+				rule->same_filter = i;
+				break;
+			}
+		}
+		fanout_count++;
+	}
+	if (ferror(fp))
+		error("error reading %s: %s", fname, pcap_strerror(errno));
+	free(line);
+	fclose(fp);
+
+	if (fanout_count == 0)
+		error("no rules in %s", fname);
+
+	for (i = 0; i < fanout_count; i++) {
+		struct fanout_rule *rule = &fanout_rules[i];
+		struct dump_info *di = &rule->dumpinfo;
+
+		if (rule->same_filter == -1 &&
+		    (rule->filter = bpf_jit_compile(&rule->fcode)) == NULL)
+			error("%s: bpf_jit_compile: %s", __func__, pcap_strerror(errno));
+
+		if ((di->CurrentFileName = (char *)malloc(PATH_MAX + 1)) == NULL)
+			error("%s: malloc", __func__);
+		MakeFilename(di->CurrentFileName, di->WFileName, 0,
+			     di->rotate_size != 0 ? di->rotate_chars : 0,
+			     di->rotate_seconds != 0 ? &di->rotate_time : NULL);
+
+		di->pcap = pcap;
+		if (Pflag) {
+			di->dumper = pcap_ng_dump_open(pcap, di->CurrentFileName);
+			di->dumper_func = handle_bpf_exthdr_dump;
+		} else {
+			di->dumper = pcap_dump_open(pcap, di->CurrentFileName);
+			di->dumper_func = handle_pcap_dump;
+		}
+		if (di->dumper == NULL)
+			error("%s", pcap_geterr(pcap));
+	}
+	fanout_active = fanout_count;
+}
+
+static void
+fanout_set_pcap(pcap_t *pcap)
+{
+	int i;
+
+	for (i = 0; i < fanout_count; i++)
+		fanout_rules[i].dumpinfo.pcap = pcap;
+}
+
+static void
+fanout_close(void)
+{
+	int i;
+
+	for (i = 0; i < fanout_count; i++) {
+		/* closed already when the rule reached its -W limit */
+		if (fanout_rules[i].dumpinfo.dumper == NULL)
+			continue;
+		if (Pflag)
+			pcap_ng_dump_close(fanout_rules[i].dumpinfo.dumper);
+		else
+			pcap_dump_close(fanout_rules[i].dumpinfo.dumper);
+	}
+}
+
+static void
+fanout_packet(u_char *user _U_, const struct pcap_pkthdr *h, const u_char *sp)
+{
+	struct fanout_rule *rule;
+	int i, saved = 0;
+
+	++infodelay;
+
+	if (!content_match(fanout_rules[0].dumpinfo.pcap, h, sp))
+		goto done;
+
+	for (i = 0; i < fanout_count; i++) {
+		rule = &fanout_rules[i];
+
+		if (rule->same_filter != -1)
+			rule->result = fanout_rules[rule->same_filter].result;
+		else
+			rule->result = bpf_jit_filter(rule->filter, sp, h->len, h->caplen);
+		if (rule->result == 0 || rule->dumpinfo.dumper == NULL)
+			continue;
+
+		if (dump_savefile(&rule->dumpinfo, h, sp) == 1)
+			saved = 1;
+		else if (rule->dumpinfo.dumper == NULL)
+			fanout_active--;
+	}
+	if (saved)
+		packets_captured++;
+
+done:
+	--infodelay;
+	if (infoprint)
+		info(0);
+
+	if (packets_captured >= max_packet_cnt || fanout_active == 0)
+		pcap_breakloop(fanout_rules[0].dumpinfo.pcap);
+}
+
+/*
+ * Returns zero if the packet doesn't contain any of the --match patterns
+ */
+static int
+content_match(pcap_t *pcap, const struct pcap_pkthdr *h, const u_char *sp)
+{
+	if (pkt_content_filter == NULL)
+		return (1);
+	return (evaluate_content_filter(pkt_content_filter, pcap_datalink(pcap),
+					sp, h->caplen));
+}
+#endif /* __APPLE__ */
+
 char *
 svc2str(uint32_t svc)
 {
@@ -2289,6 +2811,8 @@ handle_pcap_ng_dump(struct dump_info *dump_info, const struct pcap_pkthdr *h,
 	switch (pcap_ng_block_get_type(block)) {
 		case PCAPNG_BT_SHB: {
 			pcap_clear_if_infos(dump_info->pcap);
+			flush_program_caches(pkt_meta_data_program);
+			if_info_states_flush();
 			
 			pcap_ng_dump_block(dump_info->dumper, block);
 			
@@ -2393,7 +2917,7 @@ handle_pcap_ng_dump(struct dump_info *dump_info, const struct pcap_pkthdr *h,
 	 */
 	pkt_data = pcap_ng_block_packet_get_data_ptr(block);
 	
-	if_info = pcap_find_if_info_by_id(dump_info->pcap, if_id);
+	if_info = if_info_find_by_id(dump_info->pcap, if_id);
 	if (if_info == NULL) {
 		error("%s: unknown interface id %u", __func__, if_id);
 		abort();
@@ -2402,8 +2926,7 @@ handle_pcap_ng_dump(struct dump_info *dump_info, const struct pcap_pkthdr *h,
 	/*
 	 * Evaluate the per-interface BPF filter expression
 	 */
-	if (if_info->if_filter_program.bf_insns != NULL &&
-		pcap_offline_filter(&if_info->if_filter_program, h, pkt_data) == 0)
+	if (if_info_filter_packet(if_info, pkt_data, h->len, h->caplen) == 0)
 		goto done;
 	
 	if (pcap_ng_block_get_option(block, pack_flags_code, &option_info) == 1) {
@@ -2420,19 +2943,21 @@ handle_pcap_ng_dump(struct dump_info *dump_info, const struct pcap_pkthdr *h,
 	/*
 	 * Evaluate the packet metadata expression
 	 */
-	if (pkt_meta_data_expression != NULL) {
+	if (pkt_meta_data_program != NULL) {
 		struct pkt_meta_data pmd;
 		
 		pmd.itf = &if_info->if_name[0];
+		pmd.itf_key = if_info;
 		pmd.proc = (proc_info != NULL) ? proc_info->proc_name : "";
 		pmd.eproc = (e_proc_info != NULL) ? e_proc_info->proc_name : "";
 		pmd.pid = (proc_info != NULL) ? proc_info->proc_pid : -1;
 		pmd.epid = (e_proc_info != NULL) ? e_proc_info->proc_pid : -1;
 		pmd.svc = (pkt_svc != -1) ? svc2str(pkt_svc) : "";
+		pmd.svc_code = pkt_svc;
 		pmd.dir =  (packet_flags & 3) == 2 ? "out" :
 		(packet_flags & 3) == 1 ? "in" : "";
 		
-		if (evaluate_expression(pkt_meta_data_expression, &pmd) == 0) {
+		if (evaluate_program(pkt_meta_data_program, &pmd) == 0) {
 			packets_mtdt_fltr_drop++;
 			goto done;
 		}
@@ -2466,7 +2991,8 @@ print_callback(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
 	
 	++infodelay;
 	
-	print_info->printer_func(print_info, h, sp);
+	if (content_match(print_info->pcap, h, sp))
+		print_info->printer_func(print_info, h, sp);
 
 	--infodelay;
 	if (infoprint)
@@ -2560,6 +3086,8 @@ print_packet(struct print_info *print_info, const struct pcap_pkthdr *h, const u
 	 * Rather than pass it all the way down, we set this global.
 	 */
 	snapend = sp + h->caplen;
+	pkt_ts = h->ts;
+	nd_scratch_reset(gndo);
 	
 	if(print_info->ndo_type) {
 		hdrlen = (*print_info->p.ndo_printer)(print_info->ndo, h, sp);
@@ -2575,6 +3103,40 @@ print_packet(struct print_info *print_info, const struct pcap_pkthdr *h, const u
 }
 
 #ifdef __APPLE__
+/*
+ * With --tcp-stats or --dns-stats the packets are not printed, only the
+ * TCP segments or DNS messages are accounted for and summarized
+ */
+static void
+analyze_link(int dlt, const struct pcap_pkthdr *h, const u_char *p)
+{
+	const u_char *nh;
+	u_int nlen;
+
+	snapend = p + h->caplen;
+	pkt_ts = h->ts;
+	nh = packet_network_header(dlt, p, h->caplen, &nlen);
+	if (nh != NULL && tcp_flow_stats)
+		tcp_analyze(nh, nlen);
+	if (nh != NULL && dns_stats_interval)
+		dns_analyze(nh, nlen);
+}
+
+static int
+analyze_packet(struct print_info *print_info, const struct pcap_pkthdr *h, const u_char *sp)
+{
+	int dlt = pcap_datalink(print_info->pcap);
+
+#ifdef DLT_PCAPNG
+	if (dlt == DLT_PCAPNG)
+		return (analyze_pcap_ng_block(print_info, h, sp));
+#endif /* DLT_PCAPNG */
+	packets_captured++;
+	analyze_link(dlt, h, sp);
+
+	return (1);
+}
+
 static int
 print_pktap_packet(struct print_info *print_info, const struct pcap_pkthdr *h, const u_char *sp)
 {
@@ -2618,6 +3180,8 @@ print_pcap_ng_block(struct print_info *print_info, const struct pcap_pkthdr *h,
 			struct pcapng_section_header_fields *shbp = pcap_ng_get_section_header_fields(block);
 			
 			pcap_clear_if_infos(print_info->pcap);
+			flush_program_caches(pkt_meta_data_program);
+			if_info_states_flush();
 			if (vflag) {
 				printf("Section Header Block version %u.%u",
 					   shbp->major_version, shbp->minor_version);
@@ -2742,7 +3306,7 @@ print_pcap_ng_block(struct print_info *print_info, const struct pcap_pkthdr *h,
 	 */
 	pkt_data = pcap_ng_block_packet_get_data_ptr(block);
 	
-	if_info = pcap_find_if_info_by_id(print_info->pcap, if_id);
+	if_info = if_info_find_by_id(print_info->pcap, if_id);
 	if (if_info == NULL) {
 		error("%s: unknown interface id %u", __func__, if_id);
 		abort();
@@ -2751,8 +3315,7 @@ print_pcap_ng_block(struct print_info *print_info, const struct pcap_pkthdr *h,
 	/*
 	 * Evaluate the per-interface BPF filter expression
 	 */
-	if (if_info->if_filter_program.bf_insns != NULL &&
-		pcap_offline_filter(&if_info->if_filter_program, h, pkt_data) == 0)
+	if (if_info_filter_packet(if_info, pkt_data, h->len, h->caplen) == 0)
 		goto done;
 	
     if (pcap_ng_block_get_option(block, pack_flags_code, &option_info) == 1) {
@@ -2769,19 +3332,21 @@ print_pcap_ng_block(struct print_info *print_info, const struct pcap_pkthdr *h,
 	/*
 	 * Evaluate the packet metadata expression
 	 */
-	if (pkt_meta_data_expression != NULL) {
+	if (pkt_meta_data_program != NULL) {
 		struct pkt_meta_data pmd;
 		
 		pmd.itf = &if_info->if_name[0];
+		pmd.itf_key = if_info;
 		pmd.proc = (proc_info != NULL) ? proc_info->proc_name : "";
 		pmd.eproc = (e_proc_info != NULL) ? e_proc_info->proc_name : "";
 		pmd.pid = (proc_info != NULL) ? proc_info->proc_pid : -1;
 		pmd.epid = (e_proc_info != NULL) ? e_proc_info->proc_pid : -1;
 		pmd.svc = (pkt_svc != -1) ? svc2str(pkt_svc) : "";
+		pmd.svc_code = pkt_svc;
 		pmd.dir =  (packet_flags & 3) == 2 ? "out" :
 			(packet_flags & 3) == 1 ? "in" : "";
 		
-		if (evaluate_expression(pkt_meta_data_expression, &pmd) == 0) {
+		if (evaluate_program(pkt_meta_data_program, &pmd) == 0) {
 			packets_mtdt_fltr_drop++;
 			goto done;
 		}
@@ -2911,6 +3476,8 @@ print_pcap_ng_block(struct print_info *print_info, const struct pcap_pkthdr *h,
 	 * Rather than pass it all the way down, we set this global.
 	 */
 	snapend = pkt_data + h->caplen;
+	pkt_ts = h->ts;
+	nd_scratch_reset(gndo);
 
 	if ((printer = lookup_printer(if_info->if_linktype)) != NULL) {
 		hdrlen = printer(h, pkt_data);
@@ -2933,6 +3500,74 @@ done:
 	return (result);
 }
 
+/*
+ * The link-layer type of a packet in a pcap-ng block is the one of the
+ * interface it was captured on, so the interfaces are kept track of
+ * like when printing
+ */
+static int
+analyze_pcap_ng_block(struct print_info *print_info, const struct pcap_pkthdr *h, const u_char *sp)
+{
+	pcapng_block_t block;
+	struct pcap_if_info *if_info;
+	struct pcapng_option_info option_info;
+	uint32_t if_id;
+	u_char *pkt_data;
+	int result = 0;
+
+	block = pcap_ng_block_alloc_with_raw_block(print_info->pcap, (u_char *)sp);
+	if (block == NULL) {
+		warning("%s: unknown PCAP-NG block type", __func__);
+		return (0);
+	}
+
+	switch (pcap_ng_block_get_type(block)) {
+		case PCAPNG_BT_SHB:
+			pcap_clear_if_infos(print_info->pcap);
+			if_info_states_flush();
+			goto done;
+		case PCAPNG_BT_IDB: {
+			struct pcapng_interface_description_fields *idbp =
+				pcap_ng_get_interface_description_fields(block);
+			const char *ifname = "";
+
+			if (pcap_ng_block_get_option(block, PCAPNG_IF_NAME, &option_info) == 1)
+				ifname = (const char *)option_info.value;
+			if (pcap_add_if_info(print_info->pcap, ifname, -1, idbp->linktype, idbp->snaplen) == NULL)
+				error("%s: cannot allocate memory", __func__);
+			goto done;
+		}
+		case PCAPNG_BT_EPB:
+			if_id = pcap_ng_get_enhanced_packet_fields(block)->interface_id;
+			break;
+		case PCAPNG_BT_SPB:
+			if_id = 0;
+			break;
+		case PCAPNG_BT_PB:
+			if_id = pcap_ng_get_packet_fields(block)->interface_id;
+			break;
+		default:
+			goto done;
+	}
+
+	if_info = if_info_find_by_id(print_info->pcap, if_id);
+	if (if_info == NULL)
+		error("%s: unknown interface id %u", __func__, if_id);
+
+	pkt_data = pcap_ng_block_packet_get_data_ptr(block);
+	if (if_info_filter_packet(if_info, pkt_data, h->len, h->caplen) == 0)
+		goto done;
+
+	packets_captured++;
+	analyze_link(if_info->if_linktype, h, pkt_data);
+	result = 1;
+
+done:
+	pcap_ng_free_block(block);
+
+	return (result);
+}
+
 #endif /* DLT_PCAPNG */
 #endif /* __APPLE__ */
 
@@ -3047,7 +3682,15 @@ usage(void)
 "\t\t[ -i interface ]" j_FLAG_USAGE " [ -M secret ]\n");
 #if __APPLE__
 	(void)fprintf(stderr,
-"\t\t[ -Q metadata-filter-expression ]\n");
+"\t\t[ -Q metadata-filter-expression ] [ --dns-stats seconds ]\n");
+	(void)fprintf(stderr,
+"\t\t[ --fanout rules-file ] [ --ip-defrag ] [ --match pattern ]\n");
+	(void)fprintf(stderr,
+"\t\t[ --name-cache file ] [ --name-limit count ] [ --nfs-stats ]\n");
+	(void)fprintf(stderr,
+"\t\t[ --reassemble ] [ --resolve-wait msec ] [ --tcp-state-limit count ]\n");
+	(void)fprintf(stderr,
+"\t\t[ --tcp-stats ]\n");
 #endif /* __APPLE__ */
 	(void)fprintf(stderr,
 "\t\t[ -r file ] [ -s snaplen ] [ -T type ] [ -w file ]\n");
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * TCP connection summaries for --tcp-stats
+ *
+ * The statistics are updated one segment at a time from what is seen
+ * at the capture point:
+ *
+ * - the handshake time runs from the first SYN to the ACK of the SYN-ACK
+ * - a data RTT sample is the time from a segment to the first ACK that
+ *   covers it, with one segment timed at a time per direction and the
+ *   timing dropped when data is sent again (Karn's algorithm)
+ * - a segment below the highest sequence number sent is out of order
+ *   when it comes less than the smallest RTT (or TF_REORDER) after
+ *   that one, and a retransmission otherwise
+ * - a duplicate ACK repeats the last ACK and window with no data while
+ *   the other side has data outstanding
+ * - a zero window is counted once per stall, with the time it lasted
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <tcpdump-stdinc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interface.h"
+#include "tcp.h"
+#include "tcpflow.h"
+
+#define TF_REORDER	3000		/* usec, before there is an RTT sample */
+
+#define SEQ_LT(a, b)	((int32_t)((a) - (b)) < 0)
+#define SEQ_GT(a, b)	((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b)	((int32_t)((a) - (b)) >= 0)
+
+struct tcp_flow_dir {
+	/* what is reported */
+	u_int32_t	pkts;
+	u_int64_t	bytes;
+	u_int32_t	retrans;
+	u_int32_t	ooo;
+	u_int32_t	dupacks;
+	u_int32_t	zwin;
+	u_int64_t	zwin_time;
+	u_int32_t	rtt_n;
+	u_int64_t	rtt_min;
+	u_int64_t	rtt_max;
+	u_int64_t	rtt_sum;
+
+	/* sender state */
+	int		seen;		/* hiseq is valid */
+	u_int32_t	hiseq;		/* end of the highest segment */
+	u_int64_t	hiseq_time;
+	int		timing;		/* rtt_seq is being timed */
+	u_int32_t	rtt_seq;
+	u_int64_t	rtt_start;
+
+	/* receiver state */
+	int		acked;		/* lastack is valid */
+	u_int32_t	lastack;
+	u_int		lastwin;
+	int		zw;		/* advertising a zero window */
+	u_int64_t	zw_since;
+};
+
+struct tcp_flow {
+	u_int64_t	first;
+	u_int64_t	last;
+	u_int64_t	syn;
+	u_int64_t	synack;
+	u_int64_t	established;
+	int		syndir;
+	struct tcp_flow_dir dir[2];
+};
+
+int tcp_flow_stats;
+
+struct tcp_flow *
+tcp_flow_new(void)
+{
+	return ((struct tcp_flow *)calloc(1, sizeof(struct tcp_flow)));
+}
+
+void
+tcp_flow_free(struct tcp_flow *fs)
+{
+	free(fs);
+}
+
+void
+tcp_flow_segment(struct tcp_flow *fs, int dir, u_int64_t now, u_int flags,
+    u_int32_t seq, u_int32_t ack, u_int win, u_int len)
+{
+	struct tcp_flow_dir *d = &fs->dir[dir];
+	struct tcp_flow_dir *o = &fs->dir[!dir];
+	u_int32_t end;
+	u_int64_t rtt;
+
+	if (fs->first == 0)
+		fs->first = now;
+	fs->last = now;
+	d->pkts++;
+	d->bytes += len;
+
+	switch (flags & (TH_SYN | TH_ACK | TH_RST)) {
+	case TH_SYN:
+		if (fs->syn == 0) {
+			fs->syn = now;
+			fs->syndir = dir;
+		}
+		break;
+	case TH_SYN | TH_ACK:
+		if (fs->syn != 0 && fs->synack == 0 && dir != fs->syndir)
+			fs->synack = now;
+		break;
+	case TH_ACK:
+		if (fs->synack != 0 && fs->established == 0 &&
+		    dir == fs->syndir)
+			fs->established = now;
+		break;
+	}
+
+	/* segments that use sequence space */
+	end = seq + len + ((flags & TH_SYN) ? 1 : 0) + ((flags & TH_FIN) ? 1 : 0);
+	if (end != seq && !(flags & TH_RST)) {
+		if (!d->seen || SEQ_GEQ(seq, d->hiseq)) {
+			d->seen = 1;
+			d->hiseq = end;
+			d->hiseq_time = now;
+			if (!d->timing) {
+				d->timing = 1;
+				d->rtt_seq = end;
+				d->rtt_start = now;
+			}
+		} else if (!SEQ_GT(end, d->hiseq) &&
+		    now - d->hiseq_time < (d->rtt_n ? d->rtt_min : TF_REORDER)) {
+			d->ooo++;
+		} else {
+			d->retrans++;
+			d->timing = 0;
+			if (SEQ_GT(end, d->hiseq)) {
+				d->hiseq = end;
+				d->hiseq_time = now;
+			}
+		}
+	}
+
+	if (flags & TH_ACK) {
+		if (o->timing && SEQ_GEQ(ack, o->rtt_seq)) {
+			rtt = now - o->rtt_start;
+			if (o->rtt_n == 0 || rtt < o->rtt_min)
+				o->rtt_min = rtt;
+			if (rtt > o->rtt_max)
+				o->rtt_max = rtt;
+			o->rtt_sum += rtt;
+			o->rtt_n++;
+			o->timing = 0;
+		}
+		if (len == 0 && !(flags & (TH_SYN | TH_FIN | TH_RST)) &&
+		    d->acked && ack == d->lastack && win == d->lastwin &&
+		    o->seen && SEQ_LT(ack, o->hiseq))
+			d->dupacks++;
+		d->acked = 1;
+		d->lastack = ack;
+		d->lastwin = win;
+	}
+
+	if (!(flags & (TH_SYN | TH_RST))) {
+		if (win == 0) {
+			if (!d->zw) {
+				d->zw = 1;
+				d->zw_since = now;
+				d->zwin++;
+			}
+		} else if (d->zw) {
+			d->zw = 0;
+			d->zwin_time += now - d->zw_since;
+		}
+	}
+}
+
+static void
+tcp_flow_dir_print(const struct tcp_flow *fs, const struct tcp_flow_dir *d,
+    const char *src, const char *dst)
+{
+	u_int64_t zwin_time = d->zwin_time;
+
+	if (d->zw)
+		zwin_time += fs->last - d->zw_since;
+	printf("\n\t%s > %s: %u packet%s, %llu byte%s", src, dst,
+	    d->pkts, PLURAL_SUFFIX(d->pkts),
+	    (unsigned long long)d->bytes, PLURAL_SUFFIX(d->bytes));
+	if (d->rtt_n != 0)
+		printf(", rtt min/avg/max %.3f/%.3f/%.3f ms",
+		    d->rtt_min / 1000.0,
+		    (double)d->rtt_sum / d->rtt_n / 1000.0,
+		    d->rtt_max / 1000.0);
+	printf(", %u retransmitted, %u out of order, %u duplicate ACK%s",
+	    d->retrans, d->ooo, d->dupacks, PLURAL_SUFFIX(d->dupacks));
+	if (d->zwin != 0)
+		printf(", %u zero window%s (%.3f s)", d->zwin,
+		    PLURAL_SUFFIX(d->zwin), zwin_time / 1000000.0);
+}
+
+void
+tcp_flow_print(const struct tcp_flow *fs, const char *src, const char *dst)
+{
+	const char *tmp;
+	int first = 0;
+
+	/* put the side that opened the connection first */
+	if (fs->syn != 0 && fs->syndir == 1) {
+		tmp = src;
+		src = dst;
+		dst = tmp;
+		first = 1;
+	}
+	printf("%s <> %s: %.6f s", src, dst, (fs->last - fs->first) / 1000000.0);
+	if (fs->established != 0)
+		printf(", handshake %.3f ms",
+		    (fs->established - fs->syn) / 1000.0);
+	else if (fs->synack != 0)
+		printf(", SYN-ACK after %.3f ms", (fs->synack - fs->syn) / 1000.0);
+	tcp_flow_dir_print(fs, &fs->dir[first], src, dst);
+	tcp_flow_dir_print(fs, &fs->dir[!first], dst, src);
+	putchar('\n');
+}
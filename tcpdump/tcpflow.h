@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef tcpdump_tcpflow_h
+#define tcpdump_tcpflow_h
+
+struct tcp_flow;
+
+/* --tcp-stats: summarize the TCP connections instead of printing packets */
+extern int tcp_flow_stats;
+
+struct tcp_flow * tcp_flow_new(void);
+void tcp_flow_free(struct tcp_flow *);
+
+/*
+ * Account for a segment sent in direction dir (0 or 1) at time now, in
+ * microseconds; seq and ack are the raw header fields and len is the
+ * length of the payload
+ */
+void tcp_flow_segment(struct tcp_flow *, int, u_int64_t, u_int, u_int32_t,
+    u_int32_t, u_int, u_int);
+
+/*
+ * Print the summary of the flow, src and dst are the end points of
+ * direction 0
+ */
+void tcp_flow_print(const struct tcp_flow *, const char *, const char *);
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * TCP stream reassembly for --reassemble
+ *
+ * Each direction of a connection keeps the bytes of the PDU it is in
+ * the middle of, and the segments that arrived past a hole. A framer
+ * callback finds the PDU boundaries so that the printer is handed one
+ * whole message at a time. Complete PDUs are printed straight from the
+ * packet; only the incomplete tail of a segment is copied.
+ *
+ * The memory is bounded three ways: a stream holds at most
+ * TCP_STREAM_MAX bytes and TCP_STREAM_SEGS out of order segments, and
+ * all the streams together at most tcp_reasm_limit bytes. A stream that
+ * would go over, or that sees data that does not frame, is given up on
+ * and its segments are printed as they come, as without reassembly.
+ *
+ * Buffers come from a bufpool, so streams that keep growing and
+ * shrinking do not go back to malloc for every PDU.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <tcpdump-stdinc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interface.h"
+#include "bufpool.h"
+#include "tcpreasm.h"
+
+#define TCP_STREAM_MAX		BUFPOOL_MAX
+#define TCP_STREAM_SEGS		32
+
+struct tcp_seg {
+	struct tcp_seg	*next;
+	u_int32_t	seq;
+	u_int		len;
+	u_char		data[];
+};
+
+u_int tcp_reasm_limit;
+
+static struct buf_pool tr_pool;
+
+void
+tcp_stream_free(struct tcp_stream *ts)
+{
+	struct tcp_seg *sg;
+
+	if (ts->buf != NULL)
+		bufpool_put(&tr_pool, ts->buf, ts->size);
+	while ((sg = ts->ooo) != NULL) {
+		ts->ooo = sg->next;
+		bufpool_put(&tr_pool, sg, sizeof(*sg) + sg->len);
+	}
+	memset(ts, 0, sizeof(*ts));
+}
+
+static int
+tr_lost(struct tcp_stream *ts)
+{
+	tcp_stream_free(ts);
+	ts->state = TCP_STREAM_LOST;
+	return (-1);
+}
+
+static void
+tr_print(tcp_pdu_printer printer, const u_char *p, u_int len)
+{
+	const u_char *saved_snapend = snapend;
+
+	snapend = p + len;
+	(*printer)(p, len);
+	snapend = saved_snapend;
+}
+
+/*
+ * Print the complete PDUs at the start of p and return how many bytes
+ * they took, or -1 if the data does not frame
+ */
+static int
+tr_frame(const u_char *p, u_int len, tcp_pdu_framer framer,
+    tcp_pdu_printer printer, int *npdu)
+{
+	u_int off = 0;
+	int r;
+
+	while (off < len) {
+		r = (*framer)(p + off, len - off);
+		if (r < 0 || r > TCP_STREAM_MAX)
+			return (-1);
+		if (r == 0 || (u_int)r > len - off)
+			break;
+		tr_print(printer, p + off, r);
+		off += r;
+		(*npdu)++;
+	}
+	return (off);
+}
+
+/*
+ * Data in sequence: frame it with what is buffered and keep the tail
+ */
+static int
+tr_deliver(struct tcp_stream *ts, const u_char *data, u_int len,
+    tcp_pdu_framer framer, tcp_pdu_printer printer, int *npdu)
+{
+	u_char *nbuf;
+	u_int need;
+	int used;
+
+	ts->next += len;
+	if (ts->len == 0) {
+		if ((used = tr_frame(data, len, framer, printer, npdu)) < 0)
+			return (-1);
+		data += used;
+		len -= used;
+		if (len == 0)
+			return (0);
+	}
+
+	need = ts->len + len;
+	if (need > TCP_STREAM_MAX)
+		return (-1);
+	if (need > ts->size) {
+		if ((nbuf = bufpool_get(&tr_pool, need, tcp_reasm_limit)) == NULL)
+			return (-1);
+		if (ts->buf != NULL) {
+			memcpy(nbuf, ts->buf, ts->len);
+			bufpool_put(&tr_pool, ts->buf, ts->size);
+		}
+		ts->buf = nbuf;
+		ts->size = bufpool_size(need);
+	}
+	memcpy(ts->buf + ts->len, data, len);
+	ts->len += len;
+	if (ts->len == len)
+		return (0);		/* already framed above */
+
+	if ((used = tr_frame(ts->buf, ts->len, framer, printer, npdu)) < 0)
+		return (-1);
+	if (used > 0) {
+		ts->len -= used;
+		memmove(ts->buf, ts->buf + used, ts->len);
+	}
+	return (0);
+}
+
+/*
+ * Keep a segment that arrived past a hole
+ */
+static int
+tr_queue(struct tcp_stream *ts, u_int32_t seq, const u_char *data, u_int len)
+{
+	struct tcp_seg *sg, **sgp;
+
+	if (ts->nooo >= TCP_STREAM_SEGS ||
+	    ts->len + ts->ooo_bytes + len > TCP_STREAM_MAX)
+		return (-1);
+	for (sgp = &ts->ooo; *sgp != NULL; sgp = &(*sgp)->next) {
+		if ((*sgp)->seq == seq && (*sgp)->len >= len)
+			return (0);	/* retransmitted */
+		if ((int32_t)((*sgp)->seq - seq) > 0)
+			break;
+	}
+	if ((sg = bufpool_get(&tr_pool, sizeof(*sg) + len, tcp_reasm_limit)) == NULL)
+		return (-1);
+	sg->seq = seq;
+	sg->len = len;
+	memcpy(sg->data, data, len);
+	sg->next = *sgp;
+	*sgp = sg;
+	ts->nooo++;
+	ts->ooo_bytes += len;
+	return (0);
+}
+
+int
+tcp_stream_segment(struct tcp_stream *ts, u_int32_t seq, const u_char *data,
+    u_int len, tcp_pdu_framer framer, tcp_pdu_printer printer)
+{
+	struct tcp_seg *sg;
+	int32_t off;
+	int npdu = 0;
+
+	if (ts->state == TCP_STREAM_LOST)
+		return (-1);
+	if (!TTEST2(*data, len))
+		return (tr_lost(ts));	/* cut by the snapshot length */
+	if (ts->state == TCP_STREAM_NEW) {
+		ts->next = seq;
+		ts->state = TCP_STREAM_SYNC;
+	}
+
+	off = seq - ts->next;
+	if (off < 0) {
+		/* retransmission, keep the new part */
+		if ((u_int)-off >= len)
+			return (0);
+		data += -off;
+		len -= -off;
+		off = 0;
+	}
+	if (off > 0)
+		return (tr_queue(ts, seq, data, len) < 0 ? tr_lost(ts) : 0);
+
+	if (tr_deliver(ts, data, len, framer, printer, &npdu) < 0)
+		goto lost;
+
+	/* the segment may have filled the hole in front of queued ones */
+	while ((sg = ts->ooo) != NULL &&
+	       (int32_t)(sg->seq - ts->next) <= 0) {
+		ts->ooo = sg->next;
+		ts->nooo--;
+		ts->ooo_bytes -= sg->len;
+		off = ts->next - sg->seq;
+		if ((u_int)off < sg->len &&
+		    tr_deliver(ts, sg->data + off, sg->len - off, framer,
+		    printer, &npdu) < 0) {
+			bufpool_put(&tr_pool, sg, sizeof(*sg) + sg->len);
+			goto lost;
+		}
+		bufpool_put(&tr_pool, sg, sizeof(*sg) + sg->len);
+	}
+	return (npdu);
+
+ lost:
+	tr_lost(ts);
+	return (npdu > 0 ? npdu : -1);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef tcpdump_tcpreasm_h
+#define tcpdump_tcpreasm_h
+
+struct tcp_seg;
+
+/*
+ * One direction of a TCP connection
+ */
+struct tcp_stream {
+	u_int32_t	next;		/* sequence number of the next byte in order */
+	int		state;
+	u_char		*buf;		/* start of a PDU that is not complete yet */
+	u_int		len;
+	u_int		size;
+	struct tcp_seg	*ooo;		/* data past a hole, in sequence order */
+	u_int		nooo;
+	u_int		ooo_bytes;
+};
+
+#define TCP_STREAM_NEW		0	/* no data seen yet */
+#define TCP_STREAM_SYNC		1	/* buf starts at a PDU boundary */
+#define TCP_STREAM_LOST		2	/* segments are printed as they are */
+
+#define TCP_REASM_LIMIT		(32 * 1024 * 1024)	/* default for --reassemble */
+
+/*
+ * Returns the length of the PDU at the start of the data, 0 when more
+ * data is needed to tell, or -1 when the data does not start a PDU.
+ */
+typedef int (*tcp_pdu_framer)(const u_char *, u_int);
+typedef void (*tcp_pdu_printer)(const u_char *, u_int);
+
+/* bytes that can be buffered by all the streams, reassembly is off when 0 */
+extern u_int tcp_reasm_limit;
+
+/*
+ * Add the data of a segment to the stream and print the PDUs it
+ * completes. Returns the number of PDUs printed, or -1 when the stream
+ * cannot be followed and the segment should be printed on its own.
+ */
+int tcp_stream_segment(struct tcp_stream *, u_int32_t, const u_char *, u_int,
+    tcp_pdu_framer, tcp_pdu_printer);
+
+/* Release the buffers, the stream starts again with the next segment */
+void tcp_stream_free(struct tcp_stream *);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2013 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Checks ppp_hdlc_unescape() against the byte at a time loop it replaced
+ * on random frames, then compares their speed on 1500 byte frames with
+ * no escapes, one escape in 64 bytes and one in 4 bytes.  "make hdlcbench"
+ * builds it with the tcpdump flags, or from the tests directory:
+ *
+ *	cc -O2 -DHAVE_CONFIG_H -I.. -o hdlcbench hdlcbench.c ../hdlc.c
+ *	cc -O2 -mno-sse2 -DHAVE_CONFIG_H -I.. -o hdlcbench hdlcbench.c ../hdlc.c
+ *
+ * the second one for the code without SSE2 (x86_64 only).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <tcpdump-stdinc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hdlc.h"
+
+#define NFRAMES		256	/* more than the branch predictor remembers */
+#define FRAMELEN	1500
+#define LOOPS		200000
+
+/* the loop from ppp_hdlc() before ppp_hdlc_unescape() */
+static u_char *
+old_unescape(u_char *t, const u_char *s, int length)
+{
+	u_char c;
+	int i;
+
+	for (i = length; i > 0; i--) {
+		c = *s++;
+		if (c == 0x7d) {
+			if (i > 1) {
+				i--;
+				c = *s++ ^ 0x20;
+			} else
+				continue;
+		}
+		*t++ = c;
+	}
+	return (t);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* a byte other than the escape */
+static u_char
+plain(void)
+{
+	u_char c;
+
+	do
+		c = random() & 0x7f;
+	while (c == 0x7d);
+	return (c);
+}
+
+static u_char frames[NFRAMES][FRAMELEN];
+static u_char a[FRAMELEN], b[FRAMELEN];
+
+int
+main(void)
+{
+	static const int rates[] = { 0, 64, 4 };
+	u_char *ea, *eb;
+	double t0, t1, t2, mb;
+	u_int sum = 0;
+	int i, k, len, rate;
+	u_int r;
+
+	srandom(1);
+	for (k = 0; k < 1000000; k++) {
+		len = random() % 200;
+		rate = random() % 4 == 0 ? 2 : 40;
+		for (i = 0; i < len; i++)
+			frames[0][i] = random() % rate == 0 ? 0x7d : random();
+		ea = old_unescape(a, frames[0], len);
+		eb = ppp_hdlc_unescape(b, frames[0], frames[0] + len);
+		if (ea - a != eb - b || memcmp(a, b, ea - a) != 0) {
+			printf("mismatch on a %d byte frame\n", len);
+			return (1);
+		}
+	}
+	printf("1000000 random frames unescaped the same\n");
+
+	mb = (double)LOOPS * FRAMELEN / 1e6;
+	for (r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+		for (k = 0; k < NFRAMES; k++)
+			for (i = 0; i < FRAMELEN; i++)
+				frames[k][i] = rates[r] != 0 &&
+				    random() % rates[r] == 0 ? 0x7d : plain();
+
+		t0 = now();
+		for (k = 0; k < LOOPS; k++) {
+			ea = old_unescape(a, frames[k % NFRAMES], FRAMELEN);
+			sum += ea[-1];
+		}
+		t1 = now();
+		for (k = 0; k < LOOPS; k++) {
+			eb = ppp_hdlc_unescape(b, frames[k % NFRAMES],
+			    frames[k % NFRAMES] + FRAMELEN);
+			sum += eb[-1];
+		}
+		t2 = now();
+
+		if (rates[r] == 0)
+			printf("no escapes:      ");
+		else
+			printf("escape 1 in %-3d: ", rates[r]);
+		printf("old %6.0f MB/s, new %6.0f MB/s\n",
+		    mb / (t1 - t0), mb / (t2 - t1));
+	}
+	/* keep the loops from being optimized away */
+	return (sum == 1);
+}
@@ -140,6 +140,42 @@ fn_printzp(register const u_char *s, register u_int n,
 	return (n == 0) ? 0 : ret;
 }
 
+/*
+ * Two ASCII digits for every value 0-99, so the timestamp code can
+ * emit fields with a table lookup instead of going through printf.
+ */
+static const char ts_pairs[] =
+	"00010203040506070809" "10111213141516171819"
+	"20212223242526272829" "30313233343536373839"
+	"40414243444546474849" "50515253545556575859"
+	"60616263646566676869" "70717273747576777879"
+	"80818283848586878889" "90919293949596979899";
+
+#define TS_PAIR(p, n)	memcpy((p), &ts_pairs[2 * (n)], 2)
+
+/* "HH:MM:SS." for 0 <= sec < 100 hours */
+static char *
+ts_hms(register char *p, register u_int sec)
+{
+	TS_PAIR(p, sec / 3600);
+	p[2] = ':';
+	TS_PAIR(p + 3, sec / 60 % 60);
+	p[5] = ':';
+	TS_PAIR(p + 6, sec % 60);
+	p[8] = '.';
+	return (p + 9);
+}
+
+/* six fractional digits for usec < 1000000 */
+static char *
+ts_frac(register char *p, register u_int usec)
+{
+	TS_PAIR(p, usec / 10000);
+	TS_PAIR(p + 2, usec / 100 % 100);
+	TS_PAIR(p + 4, usec % 100);
+	return (p + 6);
+}
+
 /*
  * Format the timestamp
  */
@@ -147,12 +183,52 @@ char *
 ts_format(register int sec, register int usec)
 {
         static char buf[sizeof("00:00:00.000000")];
-        (void)snprintf(buf, sizeof(buf), "%02d:%02d:%02d.%06u",
-               sec / 3600, (sec % 3600) / 60, sec % 60, usec);
+
+        if (sec < 0 || sec >= 100 * 3600 || usec < 0 || usec >= 1000000) {
+                (void)snprintf(buf, sizeof(buf), "%02d:%02d:%02d.%06u",
+                       sec / 3600, (sec % 3600) / 60, sec % 60, usec);
+                return buf;
+        }
+        *ts_frac(ts_hms(buf, sec), usec) = '\0';
 
         return buf;
 }
 
+/*
+ * Everything in front of the fractional digits only changes once a
+ * second, so each absolute format keeps the prefix for the second it
+ * last printed and only the microseconds are formatted per packet.
+ */
+struct ts_prefix {
+	int	built;			/* buf holds the prefix for sec */
+	long	sec;
+	size_t	len;
+	char	buf[sizeof("4294967295.")];
+};
+
+static struct ts_prefix ts_tod;		/* HH:MM:SS. */
+static struct ts_prefix ts_unix;	/* seconds. */
+
+static struct {
+	int	built;
+	long	sec;
+	int	ok;			/* gmtime() succeeded */
+	size_t	len;
+	char	buf[sizeof("0000-00-00 00:00:00.")];
+} ts_date;				/* YYYY-MM-DD HH:MM:SS. */
+
+static void
+ts_emit(register const char *prefix, register size_t len, u_int usec)
+{
+	char buf[sizeof(ts_date.buf) + sizeof("000000 ")];
+	register char *p;
+
+	memcpy(buf, prefix, len);
+	p = ts_frac(buf + len, usec);
+	*p++ = ' ';
+	(void)fwrite(buf, 1, p - buf, stdout);
+}
+
 /*
  * Print the timestamp
  */
@@ -164,18 +240,39 @@ ts_print(register const struct timeval *tvp)
 	time_t Time;
 	int d_usec;
 	long d_sec;
+	u_int usec = (u_int)tvp->tv_usec;
 
 	/* Default */
 	if (tflag == 0 || t0flag) {
 		s = (tvp->tv_sec + thiszone) % 86400;
-		(void)printf("%s ", ts_format(s, tvp->tv_usec));
+		if (s < 0 || usec >= 1000000)
+			(void)printf("%s ", ts_format(s, tvp->tv_usec));
+		else {
+			if (!ts_tod.built || ts_tod.sec != tvp->tv_sec + thiszone) {
+				ts_tod.len = ts_hms(ts_tod.buf, s) - ts_tod.buf;
+				ts_tod.sec = tvp->tv_sec + thiszone;
+				ts_tod.built = 1;
+			}
+			ts_emit(ts_tod.buf, ts_tod.len, usec);
+		}
 	}
 	
 	/* Unix timeval style */
 	if (tflag == 2 || t2flag) {
-		(void)printf("%u.%06u ",
-					 (unsigned)tvp->tv_sec,
-					 (unsigned)tvp->tv_usec);
+		if (usec >= 1000000)
+			(void)printf("%u.%06u ",
+						 (unsigned)tvp->tv_sec,
+						 (unsigned)tvp->tv_usec);
+		else {
+			if (!ts_unix.built || ts_unix.sec != tvp->tv_sec) {
+				ts_unix.len = snprintf(ts_unix.buf,
+				    sizeof(ts_unix.buf), "%u.",
+				    (unsigned)tvp->tv_sec);
+				ts_unix.sec = tvp->tv_sec;
+				ts_unix.built = 1;
+			}
+			ts_emit(ts_unix.buf, ts_unix.len, usec);
+		}
 	}
 	
 	/* Microseconds since previous packet */
@@ -197,7 +294,8 @@ ts_print(register const struct timeval *tvp)
 			d_sec--;
 		}
 		
-		(void)printf("%s ", ts_format((int)d_sec, d_usec));
+		(void)fputs(ts_format((int)d_sec, d_usec), stdout);
+		(void)putchar(' ');
 	
 		/* set timestamp for last packet */
 		p_sec = tvp->tv_sec;
@@ -207,14 +305,31 @@ ts_print(register const struct timeval *tvp)
 	/* Default + Date */
 	if (tflag == 4 || t4flag) {
 		s = (tvp->tv_sec + thiszone) % 86400;
-		Time = (tvp->tv_sec + thiszone) - s;
-		tm = gmtime (&Time);
-		if (!tm)
+		if (!ts_date.built || ts_date.sec != tvp->tv_sec + thiszone) {
+			Time = (tvp->tv_sec + thiszone) - s;
+			tm = gmtime (&Time);
+			ts_date.ok = (tm != NULL);
+			if (tm != NULL && s >= 0 && tm->tm_year + 1900 >= 0 &&
+			    tm->tm_year + 1900 <= 9999)
+				ts_date.len = ts_hms(ts_date.buf +
+				    snprintf(ts_date.buf, sizeof(ts_date.buf),
+				    "%04d-%02d-%02d ", tm->tm_year+1900,
+				    tm->tm_mon+1, tm->tm_mday), s) - ts_date.buf;
+			else
+				ts_date.len = 0;	/* not cacheable */
+			ts_date.sec = tvp->tv_sec + thiszone;
+			ts_date.built = 1;
+		}
+		if (!ts_date.ok)
 			printf("Date fail  ");
-		else
+		else if (ts_date.len == 0 || usec >= 1000000) {
+			Time = (tvp->tv_sec + thiszone) - s;
+			tm = gmtime (&Time);
 			printf("%04d-%02d-%02d %s ",
 				   tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
 				   ts_format(s, tvp->tv_usec));
+		} else
+			ts_emit(ts_date.buf, ts_date.len, usec);
 	}
 
 	/* Microseconds since first packet */
@@ -236,7 +351,8 @@ ts_print(register const struct timeval *tvp)
 			d_sec--;
 		}
 		
-		(void)printf("%s ", ts_format((int)d_sec, d_usec));
+		(void)fputs(ts_format((int)d_sec, d_usec), stdout);
+		(void)putchar(' ');
 	}
 }
 
@@ -296,6 +412,188 @@ print_unknown_data(const u_char *cp,const char *ident,int len)
 	return(1); /* everything is ok */
 }
 
+/*
+ * Token tables are looked up through an index built by the first lookup
+ * in each table: an array indexed by value when the values are dense
+ * enough, an open addressing hash of the values otherwise, and the list
+ * of the single bit tokens for bittok2str(). The tables are never
+ * modified, so the index of a table is found by the table's address.
+ */
+struct tok_bit {
+	u_int mask;			/* 0 for a token of value 0 */
+	const char *s;
+	size_t len;
+};
+
+struct tok_index {
+	const struct tok *table;
+	int min;			/* smallest value of a dense table */
+	u_int size;			/* number of values or hash slots */
+	int dense;
+	const struct tok **slots;	/* first token of each value */
+	u_int nbits;
+	struct tok_bit *bits;
+};
+
+#define TOK_DENSE_MAX	4096
+
+static struct tok_index **tok_indexes;
+static u_int tok_nindexes, tok_indexes_size;
+static struct tok_index *tok_last;
+
+static inline u_int
+tok_hash(u_int32_t v)
+{
+	return ((v * 0x9e3779b1U) ^ (v >> 16));
+}
+
+static void
+tok_index_free(struct tok_index *ix)
+{
+	free(ix->slots);
+	free(ix->bits);
+	free(ix);
+}
+
+static struct tok_index *
+tok_index_build(const struct tok *lp)
+{
+	struct tok_index *ix;
+	const struct tok *tp;
+	u_int n = 0, nbits = 0, i;
+	int min, max;
+	u_int32_t range;
+
+	min = max = lp->v;
+	for (tp = lp; tp->s != NULL; tp++) {
+		if (tp->v < min)
+			min = tp->v;
+		if (tp->v > max)
+			max = tp->v;
+		n++;
+	}
+	if ((ix = calloc(1, sizeof(*ix))) == NULL)
+		return (NULL);
+	ix->table = lp;
+
+	range = (u_int32_t)max - (u_int32_t)min;
+	if (range < TOK_DENSE_MAX && range <= 4 * n + 16) {
+		ix->dense = 1;
+		ix->min = min;
+		ix->size = range + 1;
+	} else {
+		for (ix->size = 8; ix->size < 2 * n; ix->size <<= 1)
+			;
+	}
+	ix->slots = calloc(ix->size, sizeof(*ix->slots));
+	ix->bits = calloc(n + 1, sizeof(*ix->bits));
+	if (ix->slots == NULL || ix->bits == NULL) {
+		tok_index_free(ix);
+		return (NULL);
+	}
+
+	for (tp = lp; tp->s != NULL; tp++) {
+		u_int32_t v = tp->v;
+
+		if (ix->dense)
+			i = v - (u_int32_t)min;
+		else {
+			for (i = tok_hash(v) & (ix->size - 1);
+			     ix->slots[i] != NULL && ix->slots[i]->v != tp->v;
+			     i = (i + 1) & (ix->size - 1))
+				;
+		}
+		/* the first token of a value wins */
+		if (ix->slots[i] == NULL)
+			ix->slots[i] = tp;
+
+		/* only a single bit, or 0, can match a bit of the value */
+		if ((v & (v - 1)) == 0) {
+			ix->bits[nbits].mask = v;
+			ix->bits[nbits].s = tp->s;
+			ix->bits[nbits].len = strlen(tp->s);
+			nbits++;
+		}
+	}
+	ix->nbits = nbits;
+	return (ix);
+}
+
+/*
+ * Return the index of a table, NULL when out of memory
+ */
+static struct tok_index *
+tok_index(const struct tok *lp)
+{
+	struct tok_index *ix, **indexes;
+	u_int i, mask, size;
+
+	if (tok_last != NULL && tok_last->table == lp)
+		return (tok_last);
+
+	if (tok_indexes != NULL) {
+		mask = tok_indexes_size - 1;
+		for (i = tok_hash((u_int32_t)((uintptr_t)lp >> 3)) & mask;
+		     (ix = tok_indexes[i]) != NULL; i = (i + 1) & mask)
+			if (ix->table == lp)
+				return (tok_last = ix);
+	}
+
+	if (tok_indexes == NULL || (tok_nindexes + 1) * 4 > tok_indexes_size * 3) {
+		size = tok_indexes_size ? 2 * tok_indexes_size : 256;
+		if ((indexes = calloc(size, sizeof(*indexes))) == NULL)
+			return (NULL);
+		mask = size - 1;
+		for (i = 0; i < tok_indexes_size; i++) {
+			u_int j;
+
+			if ((ix = tok_indexes[i]) == NULL)
+				continue;
+			for (j = tok_hash((u_int32_t)((uintptr_t)ix->table >> 3)) & mask;
+			     indexes[j] != NULL; j = (j + 1) & mask)
+				;
+			indexes[j] = ix;
+		}
+		free(tok_indexes);
+		tok_indexes = indexes;
+		tok_indexes_size = size;
+	}
+
+	if ((ix = tok_index_build(lp)) == NULL)
+		return (NULL);
+	mask = tok_indexes_size - 1;
+	for (i = tok_hash((u_int32_t)((uintptr_t)lp >> 3)) & mask;
+	     tok_indexes[i] != NULL; i = (i + 1) & mask)
+		;
+	tok_indexes[i] = ix;
+	tok_nindexes++;
+	return (tok_last = ix);
+}
+
+static const struct tok *
+tok_lookup(const struct tok *lp, int v)
+{
+	struct tok_index *ix;
+	const struct tok *tp;
+	u_int i;
+
+	if ((ix = tok_index(lp)) == NULL) {
+		for (; lp->s != NULL; lp++)
+			if (lp->v == v)
+				return (lp);
+		return (NULL);
+	}
+	if (ix->dense) {
+		i = (u_int32_t)v - (u_int32_t)ix->min;
+		return (i < ix->size ? ix->slots[i] : NULL);
+	}
+	for (i = tok_hash(v) & (ix->size - 1); (tp = ix->slots[i]) != NULL;
+	     i = (i + 1) & (ix->size - 1))
+		if (tp->v == v)
+			return (tp);
+	return (NULL);
+}
+
 /*
  * Convert a token value to a string; use "fmt" if not found.
  */
@@ -303,13 +601,10 @@ const char *
 tok2strbuf(register const struct tok *lp, register const char *fmt,
 	   register int v, char *buf, size_t bufsize)
 {
-	if (lp != NULL) {
-		while (lp->s != NULL) {
-			if (lp->v == v)
-				return (lp->s);
-			++lp;
-		}
-	}
+	const struct tok *tp;
+
+	if (lp != NULL && (tp = tok_lookup(lp, v)) != NULL)
+		return (tp->s);
 	if (fmt == NULL)
 		fmt = "#%d";
 
@@ -337,52 +632,69 @@ tok2str(register const struct tok *lp, register const char *fmt,
  * Convert a bit token value to a string; use "fmt" if not found.
  * this is useful for parsing bitfields, the output strings are seperated
  * if the s field is positive.
+ *
+ * A token matches when its value is one of the bits set in v, or when
+ * it is 0 and some bit of v is clear.
  */
 static char *
 bittok2str_internal(register const struct tok *lp, register const char *fmt,
 	   register int v, register int sep)
 {
-        static char buf[256]; /* our stringbuffer */
-        int buflen=0;
-        register int rotbit; /* this is the bit we rotate through all bitpositions */
-        register int tokval;
-
-	while (lp != NULL && lp->s != NULL) {
-            tokval=lp->v;   /* load our first value */
-            rotbit=1;
-            while (rotbit != 0) {
-                /*
-                 * lets AND the rotating bit with our token value
-                 * and see if we have got a match
-                 */
-		if (tokval == (v&rotbit)) {
-                    /* ok we have found something */
-                    buflen+=snprintf(buf+buflen, sizeof(buf)-buflen, "%s%s",
-                                     lp->s, sep ? ", " : "");
-                    break;
-                }
-                rotbit=rotbit<<1; /* no match - lets shift and try again */
-            }
-            lp++;
-	}
-
-        /* user didn't want string seperation - no need to cut off trailing seperators */
-        if (!sep) {
-            return (buf);
-        }
+	static char buf[256]; /* our stringbuffer */
+	struct tok_index *ix;
+	const struct tok_bit *bp;
+	size_t buflen = 0, len;
+	u_int i;
+
+	if (lp != NULL && (ix = tok_index(lp)) != NULL) {
+		for (i = 0, bp = ix->bits; i < ix->nbits; i++, bp++) {
+			if (bp->mask != 0 ? ((u_int)v & bp->mask) == 0 :
+			    (u_int)v == ~0U)
+				continue;
+			/* truncate like snprintf() would */
+			len = bp->len;
+			if (len > sizeof(buf) - 1 - buflen)
+				len = sizeof(buf) - 1 - buflen;
+			memcpy(buf + buflen, bp->s, len);
+			buflen += len;
+			if (sep) {
+				len = sizeof(buf) - 1 - buflen < 2 ?
+				    sizeof(buf) - 1 - buflen : 2;
+				memcpy(buf + buflen, ", ", len);
+				buflen += len;
+			}
+		}
+	} else if (lp != NULL) {
+		/* out of memory, no index */
+		for (; lp->s != NULL; lp++) {
+			u_int tokval = lp->v;
+
+			if ((tokval & (tokval - 1)) != 0 ||
+			    (tokval != 0 ? ((u_int)v & tokval) == 0 :
+			     (u_int)v == ~0U))
+				continue;
+			buflen += snprintf(buf + buflen, sizeof(buf) - buflen,
+			    "%s%s", lp->s, sep ? ", " : "");
+			if (buflen >= sizeof(buf))
+				buflen = sizeof(buf) - 1;
+		}
+	}
+	buf[buflen] = '\0';
 
-        if (buflen != 0) { /* did we find anything */
-            /* yep, set the the trailing zero 2 bytes before to eliminate the last comma & whitespace */
-            buf[buflen-2] = '\0';
-            return (buf);
-        }
-        else {
-            /* bummer - lets print the "unknown" message as advised in the fmt string if we got one */
-            if (fmt == NULL)
+	/* user didn't want string seperation - no need to cut off trailing seperators */
+	if (!sep)
+		return (buf);
+
+	if (buflen >= 2) {
+		/* eliminate the last comma & whitespace */
+		buf[buflen-2] = '\0';
+		return (buf);
+	}
+	/* bummer - lets print the "unknown" message as advised in the fmt string if we got one */
+	if (fmt == NULL)
 		fmt = "#%d";
-            (void)snprintf(buf, sizeof(buf), fmt, v);
-            return (buf);
-        }
+	(void)snprintf(buf, sizeof(buf), fmt, v);
+	return (buf);
 }
 
 /*
@@ -602,6 +914,63 @@ read_infile(char *fname)
 	return (cp);
 }
 
+/*
+ * Scratch memory for dissectors that need a private copy of part of the
+ * packet being printed, such as unescaped or decrypted data.  It stays
+ * valid until nd_scratch_reset() is called before the next packet, and
+ * is never freed by the caller.  When a packet needs more than the block
+ * has room for, a block twice as large is chained on; the reset then
+ * frees the smaller ones, so once the largest packet has been seen
+ * there are no more calls to malloc.
+ */
+struct nd_scratch {
+	struct nd_scratch *next;	/* older, smaller blocks */
+	size_t size;
+	size_t used;
+};
+
+#define ND_SCRATCH_MIN		(64 * 1024)
+#define ND_SCRATCH_ALIGN	8
+
+void *
+nd_scratch_alloc(netdissect_options *ndo, size_t len)
+{
+	struct nd_scratch *sb = ndo->ndo_scratch, *nb;
+	size_t size;
+	void *p;
+
+	len = (len + ND_SCRATCH_ALIGN - 1) & ~(size_t)(ND_SCRATCH_ALIGN - 1);
+	if (sb == NULL || sb->size - sb->used < len) {
+		size = sb == NULL ? ND_SCRATCH_MIN : sb->size * 2;
+		while (size < len)
+			size *= 2;
+		nb = (struct nd_scratch *)malloc(sizeof(*nb) + size);
+		if (nb == NULL)
+			return (NULL);
+		nb->next = sb;
+		nb->size = size;
+		nb->used = 0;
+		ndo->ndo_scratch = sb = nb;
+	}
+	p = (u_char *)(sb + 1) + sb->used;
+	sb->used += len;
+	return (p);
+}
+
+void
+nd_scratch_reset(netdissect_options *ndo)
+{
+	struct nd_scratch *sb = ndo->ndo_scratch, *ob;
+
+	if (sb == NULL)
+		return;
+	while ((ob = sb->next) != NULL) {
+		sb->next = ob->next;
+		free(ob);
+	}
+	sb->used = 0;
+}
+
 void
 safeputs(const char *s, int maxlen)
 {